@@ -0,0 +1,1099 @@
+//===- ConstantFolding.cpp - Native constant folding for stablehlo -------- //
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements folding of stablehlo operations on DenseElementsAttr
+// buffers and dense_resource blobs. Each kernel dispatches on the element type
+// once and then runs a plain loop over native values.
+//===----------------------------------------------------------------------===//
+
+#include "src/enzyme_ad/jax/Passes/ConstantFolding.h"
+
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/xxhash.h"
+
+#include "mlir/IR/BuiltinDialect.h"
+#include "mlir/IR/DialectResourceBlobManager.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+using namespace mlir;
+using namespace mlir::enzyme::constfold;
+
+namespace {
+
+template <typename T> struct IsComplex : std::false_type {};
+template <typename T> struct IsComplex<std::complex<T>> : std::true_type {};
+
+template <typename T>
+constexpr bool kIsInt = std::is_integral_v<T> && !std::is_same_v<T, bool>;
+template <typename T> constexpr bool kIsFloat = std::is_floating_point_v<T>;
+template <typename T> constexpr bool kIsComplex = IsComplex<T>::value;
+
+// Unsigned type that integer arithmetic on T is performed in, so that
+// overflow wraps instead of being undefined. Types narrower than int are
+// widened to unsigned int to avoid promotion to signed int.
+template <typename T>
+using WrappingType = decltype(0u + std::make_unsigned_t<T>{});
+
+} // namespace
+
+//===----------------------------------------------------------------------===//
+// Element storage
+//===----------------------------------------------------------------------===//
+
+// Number of bytes used to store one element in a DenseElementsAttr, with i1
+// counted as one byte since the kernels below work on unpacked booleans.
+size_t mlir::enzyme::constfold::storageWidth(Type elementType) {
+  if (auto complex = dyn_cast<ComplexType>(elementType))
+    return 2 * storageWidth(complex.getElementType());
+  if (elementType.isIndex())
+    return IndexType::kInternalStorageBitWidth / 8;
+  return llvm::divideCeil(elementType.getIntOrFloatBitWidth(), 8);
+}
+
+// The bytes of a constant, one element after the other except for i1, which
+// DenseElementsAttr bit-packs. Empty for a dense_resource without a blob.
+static ArrayRef<char> rawData(ElementsAttr attr) {
+  if (auto dense = dyn_cast<DenseElementsAttr>(attr))
+    return dense.getRawData();
+  if (auto resource = dyn_cast<DenseResourceElementsAttr>(attr))
+    if (AsmResourceBlob *blob = resource.getRawHandle().getBlob())
+      return blob->getData();
+  return {};
+}
+
+static bool isBlob(ElementsAttr attr) {
+  return isa<DenseResourceElementsAttr>(attr);
+}
+
+// Whether the kernels can read attr: a DenseElementsAttr, or a blob holding
+// every element.
+static bool readable(ElementsAttr attr) {
+  if (!isBlob(attr))
+    return isa<DenseElementsAttr>(attr);
+  return rawData(attr).size() ==
+         (size_t)attr.getNumElements() * storageWidth(attr.getElementType());
+}
+
+static bool allReadable(ArrayRef<ElementsAttr> attrs) {
+  return llvm::all_of(attrs, [](ElementsAttr attr) { return readable(attr); });
+}
+
+static bool anyBlob(ArrayRef<ElementsAttr> attrs) {
+  return llvm::any_of(attrs, isBlob);
+}
+
+static int64_t numElements(ArrayRef<int64_t> shape) {
+  int64_t n = 1;
+  for (auto sz : shape)
+    n *= sz;
+  return n;
+}
+
+static SmallVector<int64_t> rowMajorStrides(ArrayRef<int64_t> shape) {
+  SmallVector<int64_t> strides(shape.size(), 1);
+  for (int64_t i = (int64_t)shape.size() - 2; i >= 0; i--)
+    strides[i] = strides[i + 1] * shape[i + 1];
+  return strides;
+}
+
+// Enumerates the indices of shape in row-major order and returns, for each,
+// the sum of the index components weighted by strides.
+static SmallVector<int64_t> stridedOffsets(ArrayRef<int64_t> shape,
+                                           ArrayRef<int64_t> strides) {
+  SmallVector<int64_t> offsets;
+  int64_t n = numElements(shape);
+  if (n == 0)
+    return offsets;
+  offsets.reserve(n);
+  SmallVector<int64_t> index(shape.size(), 0);
+  int64_t offset = 0;
+  for (int64_t i = 0; i < n; i++) {
+    offsets.push_back(offset);
+    for (int64_t d = (int64_t)shape.size() - 1; d >= 0; d--) {
+      offset += strides[d];
+      if (++index[d] != shape[d])
+        break;
+      offset -= strides[d] * shape[d];
+      index[d] = 0;
+    }
+  }
+  return offsets;
+}
+
+namespace {
+
+// The elements of a constant as a byte buffer. i1 is bit-packed inside
+// DenseElementsAttr, so it is unpacked to one byte per element. Blobs already
+// hold one byte per i1.
+class RawElements {
+public:
+  explicit RawElements(ElementsAttr attr)
+      : width(storageWidth(attr.getElementType())), splat(attr.isSplat()) {
+    auto dense = dyn_cast<DenseElementsAttr>(attr);
+    if (dense && attr.getElementType().isInteger(1)) {
+      for (bool b : dense.getValues<bool>()) {
+        unpacked.push_back(b);
+        if (splat)
+          break;
+      }
+      bytes = unpacked;
+    } else {
+      bytes = rawData(attr);
+    }
+  }
+  RawElements(const RawElements &) = delete;
+
+  const char *at(int64_t i) const {
+    return bytes.data() + (splat ? 0 : i) * width;
+  }
+
+  size_t width;
+  bool splat;
+
+private:
+  SmallVector<char> unpacked;
+  ArrayRef<char> bytes;
+};
+
+} // namespace
+
+// Builds a constant of type from bytes, holding every element or a single
+// element to splat. With blob, a result that is not a splat is interned as a
+// dense_resource, which is what folding blobs gives.
+static ElementsAttr fromRaw(RankedTensorType type, ArrayRef<char> bytes,
+                            bool blob) {
+  if (type.getElementType().isInteger(1))
+    return DenseElementsAttr::get(
+        type, ArrayRef<bool>((const bool *)bytes.data(), bytes.size()));
+  if (blob && type.getNumElements() > 1 &&
+      bytes.size() != storageWidth(type.getElementType()))
+    return internBlob(type, bytes);
+  return DenseElementsAttr::getFromRawBuffer(type, bytes);
+}
+
+// Returns the splat constant attr, which holds one element, with type.
+static ElementsAttr resizeSplat(ElementsAttr attr, RankedTensorType type) {
+  if (auto dense = dyn_cast<DenseElementsAttr>(attr))
+    return dense.resizeSplat(type);
+  RawElements in(attr);
+  return fromRaw(type, ArrayRef<char>(in.at(0), in.width), /*blob*/ false);
+}
+
+template <size_t Width>
+static void copyStrided(char *dst, const char *src, int64_t count,
+                        int64_t stride) {
+  for (int64_t i = 0; i < count; i++)
+    memcpy(dst + i * Width, src + i * stride * Width, Width);
+}
+
+// Copies, for every index of shape in row-major order, the element of src at
+// base plus the index weighted by strides. Runs along the innermost dimension
+// are copied with a single memcpy when they are contiguous in src.
+static void gather(char *dst, const RawElements &src, int64_t base,
+                   ArrayRef<int64_t> shape, ArrayRef<int64_t> strides) {
+  size_t width = src.width;
+  if (shape.empty()) {
+    memcpy(dst, src.at(base), width);
+    return;
+  }
+  int64_t inner = shape.back();
+  int64_t innerStride = src.splat ? 0 : strides.back();
+  for (int64_t outer :
+       stridedOffsets(shape.drop_back(), strides.drop_back())) {
+    const char *from = src.at(base + outer);
+    if (innerStride == 1) {
+      memcpy(dst, from, inner * width);
+    } else {
+      switch (width) {
+      case 1:
+        copyStrided<1>(dst, from, inner, innerStride);
+        break;
+      case 2:
+        copyStrided<2>(dst, from, inner, innerStride);
+        break;
+      case 4:
+        copyStrided<4>(dst, from, inner, innerStride);
+        break;
+      case 8:
+        copyStrided<8>(dst, from, inner, innerStride);
+        break;
+      case 16:
+        copyStrided<16>(dst, from, inner, innerStride);
+        break;
+      default:
+        for (int64_t i = 0; i < inner; i++)
+          memcpy(dst + i * width, from + i * innerStride * width, width);
+      }
+    }
+    dst += inner * width;
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Typed values
+//===----------------------------------------------------------------------===//
+
+static uint16_t loadBits16(const char *ptr) {
+  uint16_t bits;
+  memcpy(&bits, ptr, sizeof(bits));
+  return bits;
+}
+
+static float halfToFloat(uint16_t bits, const llvm::fltSemantics &semantics) {
+  if (&semantics == &llvm::APFloat::BFloat()) {
+    uint32_t wide = uint32_t(bits) << 16;
+    float f;
+    memcpy(&f, &wide, sizeof(f));
+    return f;
+  }
+  llvm::APFloat value(semantics, llvm::APInt(16, bits));
+  bool losesInfo;
+  value.convert(llvm::APFloat::IEEEsingle(),
+                llvm::APFloat::rmNearestTiesToEven, &losesInfo);
+  return value.convertToFloat();
+}
+
+static uint16_t floatToHalf(float f, const llvm::fltSemantics &semantics) {
+  if (&semantics == &llvm::APFloat::BFloat() && !std::isnan(f)) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    // Round to nearest, ties to even, on the 16 bits that are dropped.
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return bits >> 16;
+  }
+  llvm::APFloat value(f);
+  bool losesInfo;
+  value.convert(semantics, llvm::APFloat::rmNearestTiesToEven, &losesInfo);
+  return value.bitcastToAPInt().getZExtValue();
+}
+
+// The semantics of elementType if it is a 16-bit float, which is computed in
+// f32, or null otherwise.
+static const llvm::fltSemantics *narrowSemantics(Type elementType) {
+  if (elementType.isF16() || elementType.isBF16())
+    return &cast<FloatType>(elementType).getFloatSemantics();
+  return nullptr;
+}
+
+// Rounds an f32 value to the 16-bit float type with the given semantics.
+// Rounding the f32 result of one operation on two 16-bit values gives the
+// correctly rounded 16-bit result, since f32 has more than twice their
+// precision, so chained operations match stablehlo when rounded after each.
+static float roundToNarrow(float f, const llvm::fltSemantics &semantics) {
+  return halfToFloat(floatToHalf(f, semantics), semantics);
+}
+
+// Loads the elements of attr as T, which must be the type dispatch() chose
+// for its element type. A splat yields a single element unless expandSplat is
+// set.
+template <typename T>
+static SmallVector<T> load(ElementsAttr attr, bool expandSplat = false) {
+  Type elementType = attr.getElementType();
+  int64_t count = attr.isSplat() ? 1 : attr.getNumElements();
+  SmallVector<T> values(count);
+  auto dense = dyn_cast<DenseElementsAttr>(attr);
+  if (dense && elementType.isInteger(1)) {
+    auto bools = dense.getValues<bool>();
+    for (int64_t i = 0; i < count; i++)
+      values[i] = bools[i];
+  } else if (elementType.isF16() || elementType.isBF16()) {
+    if constexpr (std::is_same_v<T, float>) {
+      auto &semantics = cast<FloatType>(elementType).getFloatSemantics();
+      const char *raw = rawData(attr).data();
+      for (int64_t i = 0; i < count; i++)
+        values[i] = halfToFloat(loadBits16(raw + 2 * i), semantics);
+    }
+  } else {
+    memcpy(values.data(), rawData(attr).data(), count * sizeof(T));
+  }
+  if (expandSplat && attr.isSplat())
+    values.assign(attr.getNumElements(), values[0]);
+  return values;
+}
+
+// Builds a constant of type from values, which holds either every element or
+// a single element to splat, as a blob if blob is set, like fromRaw.
+template <typename T>
+static ElementsAttr store(RankedTensorType type, ArrayRef<T> values,
+                          bool blob = false) {
+  Type elementType = type.getElementType();
+  if constexpr (std::is_same_v<T, bool>) {
+    return DenseElementsAttr::get(type, values);
+  } else if constexpr (std::is_same_v<T, float>) {
+    if (elementType.isF16() || elementType.isBF16()) {
+      auto &semantics = cast<FloatType>(elementType).getFloatSemantics();
+      SmallVector<uint16_t> bits(values.size());
+      for (size_t i = 0; i < values.size(); i++)
+        bits[i] = floatToHalf(values[i], semantics);
+      return fromRaw(
+          type, ArrayRef<char>((const char *)bits.data(), 2 * bits.size()),
+          blob);
+    }
+  }
+  return fromRaw(
+      type,
+      ArrayRef<char>((const char *)values.data(), values.size() * sizeof(T)),
+      blob);
+}
+
+// Calls fn with a value of the native type used to compute on elementType,
+// or returns null if there is none. Signless integers are treated as signed.
+template <typename Fn>
+static ElementsAttr dispatch(Type elementType, Fn &&fn) {
+  if (elementType.isInteger(1))
+    return fn(bool{});
+  if (auto intType = dyn_cast<IntegerType>(elementType)) {
+    bool isUnsigned = intType.isUnsigned();
+    switch (intType.getWidth()) {
+    case 8:
+      return isUnsigned ? fn(uint8_t{}) : fn(int8_t{});
+    case 16:
+      return isUnsigned ? fn(uint16_t{}) : fn(int16_t{});
+    case 32:
+      return isUnsigned ? fn(uint32_t{}) : fn(int32_t{});
+    case 64:
+      return isUnsigned ? fn(uint64_t{}) : fn(int64_t{});
+    }
+    return {};
+  }
+  if (elementType.isF16() || elementType.isBF16() || elementType.isF32())
+    return fn(float{});
+  if (elementType.isF64())
+    return fn(double{});
+  if (auto complex = dyn_cast<ComplexType>(elementType)) {
+    if (complex.getElementType().isF32())
+      return fn(std::complex<float>{});
+    if (complex.getElementType().isF64())
+      return fn(std::complex<double>{});
+  }
+  return {};
+}
+
+// Calls callback with a scalar function computing kind on T and returns true,
+// or returns false if kind is not defined on T.
+template <typename T, typename Callback>
+static bool withBinaryFn(BinaryKind kind, Callback &&callback) {
+  switch (kind) {
+  case BinaryKind::Add:
+    if constexpr (kIsInt<T>) {
+      using W = WrappingType<T>;
+      callback([](T a, T b) { return T(W(a) + W(b)); });
+      return true;
+    } else if constexpr (kIsFloat<T> || kIsComplex<T>) {
+      callback([](T a, T b) { return a + b; });
+      return true;
+    }
+    return false;
+  case BinaryKind::Sub:
+    if constexpr (kIsInt<T>) {
+      using W = WrappingType<T>;
+      callback([](T a, T b) { return T(W(a) - W(b)); });
+      return true;
+    } else if constexpr (kIsFloat<T> || kIsComplex<T>) {
+      callback([](T a, T b) { return a - b; });
+      return true;
+    }
+    return false;
+  case BinaryKind::Mul:
+    if constexpr (kIsInt<T>) {
+      using W = WrappingType<T>;
+      callback([](T a, T b) { return T(W(a) * W(b)); });
+      return true;
+    } else if constexpr (kIsFloat<T> || kIsComplex<T>) {
+      callback([](T a, T b) { return a * b; });
+      return true;
+    }
+    return false;
+  case BinaryKind::Div:
+    // Integer division by zero and overflow have special semantics in
+    // stablehlo, which are left to the interpreter.
+    if constexpr (kIsFloat<T> || kIsComplex<T>) {
+      callback([](T a, T b) { return a / b; });
+      return true;
+    }
+    return false;
+  case BinaryKind::Max:
+    // NaN operands propagate.
+    if constexpr (!kIsComplex<T>) {
+      callback([](T a, T b) { return (a != a || a > b) ? a : b; });
+      return true;
+    }
+    return false;
+  case BinaryKind::Min:
+    if constexpr (!kIsComplex<T>) {
+      callback([](T a, T b) { return (a != a || a < b) ? a : b; });
+      return true;
+    }
+    return false;
+  case BinaryKind::And:
+    if constexpr (std::is_integral_v<T>) {
+      callback([](T a, T b) { return T(a & b); });
+      return true;
+    }
+    return false;
+  case BinaryKind::Or:
+    if constexpr (std::is_integral_v<T>) {
+      callback([](T a, T b) { return T(a | b); });
+      return true;
+    }
+    return false;
+  case BinaryKind::Xor:
+    if constexpr (std::is_integral_v<T>) {
+      callback([](T a, T b) { return T(a ^ b); });
+      return true;
+    }
+    return false;
+  }
+  llvm_unreachable("Unhandled binary kind");
+}
+
+// Applies f elementwise, broadcasting an operand holding a single element.
+template <typename T, typename R, typename F>
+static void zipWith(ArrayRef<T> lhs, ArrayRef<T> rhs, MutableArrayRef<R> out,
+                    F f) {
+  size_t n = out.size();
+  if (lhs.size() != n) {
+    T a = lhs[0];
+    for (size_t i = 0; i < n; i++)
+      out[i] = f(a, rhs[i]);
+  } else if (rhs.size() != n) {
+    T b = rhs[0];
+    for (size_t i = 0; i < n; i++)
+      out[i] = f(lhs[i], b);
+  } else {
+    for (size_t i = 0; i < n; i++)
+      out[i] = f(lhs[i], rhs[i]);
+  }
+}
+
+template <typename S, typename D> static std::optional<D> convertValue(S v) {
+  if constexpr (std::is_same_v<S, D>) {
+    return v;
+  } else if constexpr (kIsComplex<D>) {
+    using R = typename D::value_type;
+    if constexpr (kIsComplex<S>)
+      return D(static_cast<R>(v.real()), static_cast<R>(v.imag()));
+    else
+      return D(static_cast<R>(v), R(0));
+  } else if constexpr (kIsComplex<S>) {
+    return std::nullopt;
+  } else if constexpr (std::is_same_v<D, bool>) {
+    return v != S(0);
+  } else if constexpr (kIsInt<D> && kIsFloat<S>) {
+    // Out of range conversions are implementation defined; leave them to the
+    // interpreter.
+    double d = v;
+    if (std::isnan(d) || d <= (double)std::numeric_limits<D>::min() - 1.0 ||
+        d >= (double)std::numeric_limits<D>::max() + 1.0)
+      return std::nullopt;
+    return static_cast<D>(v);
+  } else {
+    return static_cast<D>(v);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Shape operations
+//===----------------------------------------------------------------------===//
+
+DenseElementsAttr mlir::enzyme::constfold::iota(RankedTensorType type,
+                                                int64_t dimension) {
+  ArrayRef<int64_t> shape = type.getShape();
+  int64_t outer = numElements(shape.take_front(dimension));
+  int64_t length = shape[dimension];
+  int64_t inner = numElements(shape.drop_front(dimension + 1));
+  auto out = dispatch(type.getElementType(), [&](auto tag) -> ElementsAttr {
+    using T = decltype(tag);
+    if constexpr (std::is_same_v<T, bool>) {
+      return {};
+    } else {
+      SmallVector<T> values(type.getNumElements());
+      T *out = values.data();
+      for (int64_t i = 0; i < outer; i++)
+        for (int64_t j = 0; j < length; j++, out += inner)
+          std::fill(out, out + inner, T(j));
+      return store<T>(type, values);
+    }
+  });
+  return cast_or_null<DenseElementsAttr>(out);
+}
+
+ElementsAttr
+mlir::enzyme::constfold::broadcastInDim(ElementsAttr operand,
+                                        ArrayRef<int64_t> dimensions,
+                                        RankedTensorType type) {
+  if (!readable(operand))
+    return {};
+  if (operand.isSplat())
+    return resizeSplat(operand, type);
+  ArrayRef<int64_t> inShape = operand.getShapedType().getShape();
+  SmallVector<int64_t> inStrides = rowMajorStrides(inShape);
+  SmallVector<int64_t> strides(type.getRank(), 0);
+  for (size_t i = 0; i < dimensions.size(); i++)
+    if (inShape[i] != 1)
+      strides[dimensions[i]] = inStrides[i];
+
+  RawElements in(operand);
+  SmallVector<char> out(type.getNumElements() * in.width);
+  gather(out.data(), in, 0, type.getShape(), strides);
+  return fromRaw(type, out, isBlob(operand));
+}
+
+ElementsAttr mlir::enzyme::constfold::transpose(ElementsAttr operand,
+                                                ArrayRef<int64_t> permutation,
+                                                RankedTensorType type) {
+  if (!readable(operand))
+    return {};
+  if (operand.isSplat())
+    return resizeSplat(operand, type);
+  SmallVector<int64_t> inStrides =
+      rowMajorStrides(operand.getShapedType().getShape());
+  SmallVector<int64_t> strides;
+  for (auto dim : permutation)
+    strides.push_back(inStrides[dim]);
+
+  RawElements in(operand);
+  SmallVector<char> out(type.getNumElements() * in.width);
+  gather(out.data(), in, 0, type.getShape(), strides);
+  return fromRaw(type, out, isBlob(operand));
+}
+
+ElementsAttr mlir::enzyme::constfold::reshape(ElementsAttr operand,
+                                              RankedTensorType type) {
+  // A reshape keeps the bytes, so the result of a blob shares it.
+  if (auto resource = dyn_cast<DenseResourceElementsAttr>(operand))
+    return DenseResourceElementsAttr::get(type, resource.getRawHandle());
+  if (auto dense = dyn_cast<DenseElementsAttr>(operand))
+    return dense.reshape(type);
+  return {};
+}
+
+ElementsAttr mlir::enzyme::constfold::slice(ElementsAttr operand,
+                                            ArrayRef<int64_t> starts,
+                                            ArrayRef<int64_t> strides,
+                                            RankedTensorType type) {
+  if (!readable(operand))
+    return {};
+  if (operand.isSplat())
+    return resizeSplat(operand, type);
+  SmallVector<int64_t> inStrides =
+      rowMajorStrides(operand.getShapedType().getShape());
+  int64_t base = 0;
+  SmallVector<int64_t> outStrides;
+  for (auto [start, stride, inStride] :
+       llvm::zip(starts, strides, inStrides)) {
+    base += start * inStride;
+    outStrides.push_back(stride * inStride);
+  }
+
+  RawElements in(operand);
+  SmallVector<char> out(type.getNumElements() * in.width);
+  gather(out.data(), in, base, type.getShape(), outStrides);
+  return fromRaw(type, out, isBlob(operand));
+}
+
+ElementsAttr mlir::enzyme::constfold::pad(ElementsAttr operand,
+                                          ElementsAttr paddingValue,
+                                          ArrayRef<int64_t> edgePaddingLow,
+                                          ArrayRef<int64_t> interiorPadding,
+                                          RankedTensorType type) {
+  if (!allReadable({operand, paddingValue}))
+    return {};
+  auto denseOperand = dyn_cast<DenseElementsAttr>(operand);
+  auto densePadding = dyn_cast<DenseElementsAttr>(paddingValue);
+  if (denseOperand && densePadding && denseOperand.isSplat() &&
+      densePadding.isSplat() &&
+      denseOperand.getSplatValue<Attribute>() ==
+          densePadding.getSplatValue<Attribute>())
+    return denseOperand.resizeSplat(type);
+
+  RawElements in(operand);
+  RawElements pv(paddingValue);
+  size_t width = in.width;
+  int64_t n = type.getNumElements();
+  SmallVector<char> out(n * width);
+  for (int64_t i = 0; i < n; i++)
+    memcpy(out.data() + i * width, pv.at(0), width);
+
+  // For each operand dimension, the offset contributed by each index to the
+  // position in the result, or -1 if it falls outside the result, which
+  // happens with negative edge padding.
+  ArrayRef<int64_t> inShape = operand.getShapedType().getShape();
+  ArrayRef<int64_t> outShape = type.getShape();
+  SmallVector<int64_t> outStrides = rowMajorStrides(outShape);
+  SmallVector<SmallVector<int64_t>> contributions(inShape.size());
+  for (size_t d = 0; d < inShape.size(); d++) {
+    for (int64_t j = 0; j < inShape[d]; j++) {
+      int64_t pos = edgePaddingLow[d] + j * (interiorPadding[d] + 1);
+      contributions[d].push_back(pos >= 0 && pos < outShape[d]
+                                     ? pos * outStrides[d]
+                                     : -1);
+    }
+  }
+
+  SmallVector<int64_t> index(inShape.size(), 0);
+  int64_t count = operand.getNumElements();
+  for (int64_t i = 0; i < count; i++) {
+    int64_t offset = 0;
+    bool inside = true;
+    for (size_t d = 0; d < index.size() && inside; d++) {
+      int64_t c = contributions[d][index[d]];
+      inside = c >= 0;
+      offset += c;
+    }
+    if (inside)
+      memcpy(out.data() + offset * width, in.at(i), width);
+    for (int64_t d = (int64_t)index.size() - 1; d >= 0; d--) {
+      if (++index[d] != inShape[d])
+        break;
+      index[d] = 0;
+    }
+  }
+  return fromRaw(type, out, anyBlob({operand, paddingValue}));
+}
+
+ElementsAttr
+mlir::enzyme::constfold::concatenate(ArrayRef<ElementsAttr> operands,
+                                     int64_t dimension, RankedTensorType type) {
+  if (!allReadable(operands))
+    return {};
+  size_t width = storageWidth(type.getElementType());
+  int64_t top = numElements(type.getShape().take_front(dimension));
+  SmallVector<char> out(type.getNumElements() * width);
+  bool blob = anyBlob(operands);
+  if (top == 0)
+    return fromRaw(type, out, blob);
+
+  SmallVector<std::unique_ptr<RawElements>> inputs;
+  for (auto operand : operands)
+    inputs.push_back(std::make_unique<RawElements>(operand));
+
+  char *dst = out.data();
+  for (int64_t i = 0; i < top; i++) {
+    for (auto [operand, in] : llvm::zip(operands, inputs)) {
+      int64_t bottom = operand.getNumElements() / top;
+      if (in->splat) {
+        for (int64_t j = 0; j < bottom; j++)
+          memcpy(dst + j * width, in->at(0), width);
+      } else {
+        memcpy(dst, in->at(i * bottom), bottom * width);
+      }
+      dst += bottom * width;
+    }
+  }
+  return fromRaw(type, out, blob);
+}
+
+//===----------------------------------------------------------------------===//
+// Arithmetic
+//===----------------------------------------------------------------------===//
+
+ElementsAttr mlir::enzyme::constfold::binary(BinaryKind kind,
+                                             ElementsAttr lhs, ElementsAttr rhs,
+                                             RankedTensorType type) {
+  if (lhs.getElementType() != type.getElementType() ||
+      rhs.getElementType() != type.getElementType() ||
+      !allReadable({lhs, rhs}))
+    return {};
+  return dispatch(type.getElementType(), [&](auto tag) -> ElementsAttr {
+    using T = decltype(tag);
+    SmallVector<T> l = load<T>(lhs), r = load<T>(rhs);
+    SmallVector<T> out(lhs.isSplat() && rhs.isSplat() ? 1
+                                                      : type.getNumElements());
+    if (!withBinaryFn<T>(kind, [&](auto f) {
+          zipWith<T>(l, r, MutableArrayRef<T>(out), f);
+        }))
+      return {};
+    return store<T>(type, out, anyBlob({lhs, rhs}));
+  });
+}
+
+ElementsAttr mlir::enzyme::constfold::negate(ElementsAttr operand,
+                                             RankedTensorType type) {
+  if (!readable(operand))
+    return {};
+  return dispatch(type.getElementType(), [&](auto tag) -> ElementsAttr {
+    using T = decltype(tag);
+    if constexpr (std::is_same_v<T, bool>) {
+      return {};
+    } else {
+      SmallVector<T> values = load<T>(operand);
+      for (T &v : values) {
+        if constexpr (kIsInt<T>)
+          v = T(WrappingType<T>(0) - WrappingType<T>(v));
+        else
+          v = -v;
+      }
+      return store<T>(type, values, isBlob(operand));
+    }
+  });
+}
+
+ElementsAttr mlir::enzyme::constfold::convert(ElementsAttr operand,
+                                              RankedTensorType type) {
+  if (!readable(operand))
+    return {};
+  Type resultElementType = type.getElementType();
+  bool narrowResult = resultElementType.isF16() || resultElementType.isBF16();
+  return dispatch(
+      operand.getElementType(), [&](auto sourceTag) -> ElementsAttr {
+        using S = decltype(sourceTag);
+        // Results narrower than f32 are computed in f32 and rounded again when
+        // stored. That is only exact when the value in f32 is itself exact.
+        if constexpr (!std::is_same_v<S, float> && !std::is_same_v<S, bool> &&
+                      !(kIsInt<S> && sizeof(S) <= 2)) {
+          if (narrowResult)
+            return {};
+        }
+        SmallVector<S> in = load<S>(operand);
+        return dispatch(resultElementType,
+                        [&](auto resultTag) -> ElementsAttr {
+                          using D = decltype(resultTag);
+                          SmallVector<D> out(in.size());
+                          for (size_t i = 0; i < in.size(); i++) {
+                            std::optional<D> v = convertValue<S, D>(in[i]);
+                            if (!v)
+                              return {};
+                            out[i] = *v;
+                          }
+                          return store<D>(type, out, isBlob(operand));
+                        });
+      });
+}
+
+ElementsAttr mlir::enzyme::constfold::compare(
+    stablehlo::ComparisonDirection direction,
+    std::optional<stablehlo::ComparisonType> compareType, ElementsAttr lhs,
+    ElementsAttr rhs, RankedTensorType type) {
+  using stablehlo::ComparisonDirection;
+  using stablehlo::ComparisonType;
+  if (!allReadable({lhs, rhs}))
+    return {};
+  Type elementType = lhs.getElementType();
+  if (compareType) {
+    // Comparisons whose signedness disagrees with the element type, and total
+    // order comparisons of floats, are left to the interpreter.
+    if (*compareType == ComparisonType::TOTALORDER)
+      return {};
+    if (*compareType == ComparisonType::UNSIGNED &&
+        elementType.isSignlessInteger() && !elementType.isInteger(1))
+      return {};
+    if (*compareType == ComparisonType::SIGNED &&
+        elementType.isUnsignedInteger())
+      return {};
+  }
+  return dispatch(elementType, [&](auto tag) -> ElementsAttr {
+    using T = decltype(tag);
+    SmallVector<T> l = load<T>(lhs), r = load<T>(rhs);
+    SmallVector<bool> out(lhs.isSplat() && rhs.isSplat()
+                              ? 1
+                              : type.getNumElements());
+    MutableArrayRef<bool> outRef(out);
+    if constexpr (kIsComplex<T>) {
+      if (direction == ComparisonDirection::EQ)
+        zipWith<T>(l, r, outRef, [](T a, T b) { return a == b; });
+      else if (direction == ComparisonDirection::NE)
+        zipWith<T>(l, r, outRef, [](T a, T b) { return a != b; });
+      else
+        return {};
+    } else {
+      switch (direction) {
+      case ComparisonDirection::EQ:
+        zipWith<T>(l, r, outRef, [](T a, T b) { return a == b; });
+        break;
+      case ComparisonDirection::NE:
+        zipWith<T>(l, r, outRef, [](T a, T b) { return a != b; });
+        break;
+      case ComparisonDirection::GE:
+        zipWith<T>(l, r, outRef, [](T a, T b) { return a >= b; });
+        break;
+      case ComparisonDirection::GT:
+        zipWith<T>(l, r, outRef, [](T a, T b) { return a > b; });
+        break;
+      case ComparisonDirection::LE:
+        zipWith<T>(l, r, outRef, [](T a, T b) { return a <= b; });
+        break;
+      case ComparisonDirection::LT:
+        zipWith<T>(l, r, outRef, [](T a, T b) { return a < b; });
+        break;
+      }
+    }
+    return store<bool>(type, out);
+  });
+}
+
+ElementsAttr mlir::enzyme::constfold::reduce(BinaryKind kind,
+                                             ElementsAttr operand,
+                                             ElementsAttr init,
+                                             ArrayRef<int64_t> dimensions,
+                                             RankedTensorType type) {
+  if (operand.getElementType() != type.getElementType() ||
+      init.getElementType() != type.getElementType() ||
+      !allReadable({operand, init}))
+    return {};
+
+  // The stride of each operand dimension in the result, zero for the
+  // dimensions that are reduced.
+  ArrayRef<int64_t> inShape = operand.getShapedType().getShape();
+  SmallVector<int64_t> resultStrides = rowMajorStrides(type.getShape());
+  SmallVector<int64_t> strides(inShape.size(), 0);
+  for (size_t d = 0, r = 0; d < inShape.size(); d++)
+    if (!llvm::is_contained(dimensions, (int64_t)d))
+      strides[d] = resultStrides[r++];
+  SmallVector<int64_t> offsets = stridedOffsets(inShape, strides);
+
+  const llvm::fltSemantics *narrow = narrowSemantics(type.getElementType());
+  return dispatch(type.getElementType(), [&](auto tag) -> ElementsAttr {
+    using T = decltype(tag);
+    SmallVector<T> in = load<T>(operand, /*expandSplat=*/true);
+    SmallVector<T> out(type.getNumElements(), load<T>(init)[0]);
+    if (!withBinaryFn<T>(kind, [&](auto f) {
+          for (size_t i = 0; i < offsets.size(); i++) {
+            T v = f(out[offsets[i]], in[i]);
+            // f16 and bf16 accumulate in their own precision, step by step.
+            if constexpr (std::is_same_v<T, float>)
+              if (narrow)
+                v = roundToNarrow(v, *narrow);
+            out[offsets[i]] = v;
+          }
+        }))
+      return {};
+    return store<T>(type, out, isBlob(operand));
+  });
+}
+
+ElementsAttr mlir::enzyme::constfold::dotGeneral(
+    ElementsAttr lhs, ElementsAttr rhs,
+    ArrayRef<int64_t> lhsBatchingDimensions,
+    ArrayRef<int64_t> rhsBatchingDimensions,
+    ArrayRef<int64_t> lhsContractingDimensions,
+    ArrayRef<int64_t> rhsContractingDimensions, RankedTensorType type) {
+  if (lhs.getElementType() != type.getElementType() ||
+      rhs.getElementType() != type.getElementType() ||
+      !allReadable({lhs, rhs}))
+    return {};
+
+  ArrayRef<int64_t> lhsShape = lhs.getShapedType().getShape();
+  ArrayRef<int64_t> rhsShape = rhs.getShapedType().getShape();
+  SmallVector<int64_t> lhsStrides = rowMajorStrides(lhsShape);
+  SmallVector<int64_t> rhsStrides = rowMajorStrides(rhsShape);
+
+  // The result is indexed by the batching dimensions, then the free lhs
+  // dimensions, then the free rhs dimensions.
+  SmallVector<int64_t> resultLhsStrides, resultRhsStrides;
+  for (auto [l, r] : llvm::zip(lhsBatchingDimensions, rhsBatchingDimensions)) {
+    resultLhsStrides.push_back(lhsStrides[l]);
+    resultRhsStrides.push_back(rhsStrides[r]);
+  }
+  for (int64_t d = 0; d < (int64_t)lhsShape.size(); d++) {
+    if (llvm::is_contained(lhsBatchingDimensions, d) ||
+        llvm::is_contained(lhsContractingDimensions, d))
+      continue;
+    resultLhsStrides.push_back(lhsStrides[d]);
+    resultRhsStrides.push_back(0);
+  }
+  for (int64_t d = 0; d < (int64_t)rhsShape.size(); d++) {
+    if (llvm::is_contained(rhsBatchingDimensions, d) ||
+        llvm::is_contained(rhsContractingDimensions, d))
+      continue;
+    resultLhsStrides.push_back(0);
+    resultRhsStrides.push_back(rhsStrides[d]);
+  }
+  SmallVector<int64_t> contractingShape, contractingLhsStrides,
+      contractingRhsStrides;
+  for (auto [l, r] :
+       llvm::zip(lhsContractingDimensions, rhsContractingDimensions)) {
+    contractingShape.push_back(lhsShape[l]);
+    contractingLhsStrides.push_back(lhsStrides[l]);
+    contractingRhsStrides.push_back(rhsStrides[r]);
+  }
+
+  ArrayRef<int64_t> resultShape = type.getShape();
+  SmallVector<int64_t> lhsOffsets =
+      stridedOffsets(resultShape, resultLhsStrides);
+  SmallVector<int64_t> rhsOffsets =
+      stridedOffsets(resultShape, resultRhsStrides);
+  SmallVector<int64_t> lhsContractingOffsets =
+      stridedOffsets(contractingShape, contractingLhsStrides);
+  SmallVector<int64_t> rhsContractingOffsets =
+      stridedOffsets(contractingShape, contractingRhsStrides);
+
+  const llvm::fltSemantics *narrow = narrowSemantics(type.getElementType());
+  return dispatch(type.getElementType(), [&](auto tag) -> ElementsAttr {
+    using T = decltype(tag);
+    if constexpr (std::is_same_v<T, bool>) {
+      return {};
+    } else {
+      SmallVector<T> l = load<T>(lhs, /*expandSplat=*/true);
+      SmallVector<T> r = load<T>(rhs, /*expandSplat=*/true);
+      SmallVector<T> out(type.getNumElements());
+      for (size_t i = 0; i < out.size(); i++) {
+        const T *lp = l.data() + lhsOffsets[i];
+        const T *rp = r.data() + rhsOffsets[i];
+        T acc = T(0);
+        for (size_t k = 0; k < lhsContractingOffsets.size(); k++) {
+          T a = lp[lhsContractingOffsets[k]], b = rp[rhsContractingOffsets[k]];
+          if constexpr (kIsInt<T>) {
+            using W = WrappingType<T>;
+            acc = T(W(acc) + W(a) * W(b));
+          } else if constexpr (std::is_same_v<T, float>) {
+            // Like the interpreter, f16 and bf16 round the product and the
+            // sum to their own precision.
+            if (narrow)
+              acc = roundToNarrow(acc + roundToNarrow(a * b, *narrow), *narrow);
+            else
+              acc += a * b;
+          } else {
+            acc += a * b;
+          }
+        }
+        out[i] = acc;
+      }
+      return store<T>(type, out, anyBlob({lhs, rhs}));
+    }
+  });
+}
+
+//===----------------------------------------------------------------------===//
+// Blobs
+//===----------------------------------------------------------------------===//
+
+static std::string blobName(ArrayRef<char> bytes) {
+  uint64_t hash = llvm::xxh3_64bits(
+      ArrayRef<uint8_t>((const uint8_t *)bytes.data(), bytes.size()));
+  return "enzymexla_const_" + llvm::utohexstr(hash, /*LowerCase*/ true);
+}
+
+// The blob interned under name, if it holds bytes.
+static DialectResourceBlobManager::BlobEntry *
+lookupBlob(MLIRContext *ctx, StringRef name, ArrayRef<char> bytes) {
+  auto &manager = DenseResourceElementsHandle::getManagerInterface(ctx);
+  auto *entry = manager.getBlobManager().lookup(name);
+  if (!entry || !entry->getBlob() || entry->getBlob()->getData() != bytes)
+    return nullptr;
+  return entry;
+}
+
+DenseResourceElementsAttr
+mlir::enzyme::constfold::internBlob(RankedTensorType type, ArrayRef<char> bytes,
+                                    bool copy) {
+  MLIRContext *ctx = type.getContext();
+  std::string name = blobName(bytes);
+  if (auto *entry = lookupBlob(ctx, name, bytes))
+    return DenseResourceElementsAttr::get(
+        type, DenseResourceElementsHandle(
+                  entry, ctx->getLoadedDialect<BuiltinDialect>()));
+
+  // Attribute storage and heap buffers are aligned to at least 8 bytes, which
+  // is enough for every element type handled here.
+  constexpr size_t alignment = alignof(uint64_t);
+  AsmResourceBlob blob =
+      copy ? HeapAsmResourceBlob::allocateAndCopyWithAlign(bytes, alignment)
+           : UnmanagedAsmResourceBlob::allocateWithAlign(bytes, alignment);
+  return DenseResourceElementsAttr::get(type, name, std::move(blob));
+}
+
+size_t mlir::enzyme::constfold::constantsToBlobs(Operation *root,
+                                                 size_t minBytes) {
+  size_t converted = 0;
+  root->walk([&](stablehlo::ConstantOp op) {
+    auto dense = dyn_cast<DenseElementsAttr>(op.getValue());
+    if (!dense || dense.isSplat() || dense.getElementType().isInteger(1) ||
+        dense.getRawData().size() < minBytes)
+      return;
+    op.setValueAttr(internBlob(cast<RankedTensorType>(dense.getType()),
+                               dense.getRawData(), /*copy*/ false));
+    converted++;
+  });
+  return converted;
+}
+
+void mlir::enzyme::constfold::internBlobs(Operation *root) {
+  MLIRContext *ctx = root->getContext();
+  auto &manager = DenseResourceElementsHandle::getManagerInterface(ctx);
+  auto *dialect = ctx->getLoadedDialect<BuiltinDialect>();
+
+  // Parsing gives every resource a fresh entry, renamed if an interned blob
+  // already has its name, so an entry that duplicates an interned blob is only
+  // used by root and can be emptied once root no longer refers to it.
+  SmallPtrSet<DialectResourceBlobManager::BlobEntry *, 4> duplicates;
+  DenseMap<Attribute, Attribute> interned;
+  auto intern = [&](DenseResourceElementsAttr resource) -> Attribute {
+    DenseResourceElementsHandle handle = resource.getRawHandle();
+    AsmResourceBlob *blob = handle.getBlob();
+    if (!blob)
+      return resource;
+    ArrayRef<char> bytes = blob->getData();
+    std::string name = blobName(bytes);
+    if (handle.getKey() == name)
+      return resource;
+    if (auto *entry = lookupBlob(ctx, name, bytes)) {
+      duplicates.insert(handle.getResource());
+      return DenseResourceElementsAttr::get(
+          resource.getType(), DenseResourceElementsHandle(entry, dialect));
+    }
+    // Make the parsed bytes findable by later modules, without a copy.
+    if (!manager.getBlobManager().lookup(name))
+      manager.insert(name, UnmanagedAsmResourceBlob::allocateWithAlign(
+                               bytes, blob->getDataAlignment()));
+    return resource;
+  };
+
+  root->walk([&](Operation *op) {
+    SmallVector<NamedAttribute> updates;
+    for (NamedAttribute attr : op->getAttrs()) {
+      auto resource = dyn_cast<DenseResourceElementsAttr>(attr.getValue());
+      if (!resource)
+        continue;
+      auto [it, inserted] = interned.try_emplace(resource, nullptr);
+      if (inserted)
+        it->second = intern(resource);
+      if (it->second != resource)
+        updates.emplace_back(attr.getName(), it->second);
+    }
+    for (NamedAttribute update : updates)
+      op->setAttr(update.getName(), update.getValue());
+  });
+
+  for (auto *entry : duplicates)
+    entry->setBlob(AsmResourceBlob());
+}
+
+void mlir::enzyme::constfold::materializeBlobs(Operation *root) {
+  root->walk([](Operation *op) {
+    SmallVector<NamedAttribute> updates;
+    for (NamedAttribute attr : op->getAttrs()) {
+      auto resource = dyn_cast<DenseResourceElementsAttr>(attr.getValue());
+      if (!resource || !readable(resource))
+        continue;
+      ShapedType type = resource.getType();
+      ArrayRef<char> bytes = rawData(resource);
+      Attribute dense =
+          type.getElementType().isInteger(1)
+              ? DenseElementsAttr::get(
+                    type,
+                    ArrayRef<bool>((const bool *)bytes.data(), bytes.size()))
+              : DenseElementsAttr::getFromRawBuffer(type, bytes);
+      updates.emplace_back(attr.getName(), dense);
+    }
+    for (NamedAttribute update : updates)
+      op->setAttr(update.getName(), update.getValue());
+  });
+}
@@ -0,0 +1,110 @@
+//===- ConstantFolding.h - Native constant folding of stablehlo -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Folds stablehlo operations on constants by working directly on the raw
+// buffers of DenseElementsAttr and dense_resource blobs, instead of going
+// element by element through the stablehlo reference interpreter. Folding a
+// blob gives a blob, so large constants never become uniqued attributes.
+//
+// Shape operations move elements by their storage width and so support any
+// element type. Arithmetic is performed on native C++ types, with f16 and bf16
+// computed in f32 and rounded once when stored. Every function returns a null
+// attribute when it cannot fold the given element types, in which case the
+// caller should fall back to the reference interpreter.
+//===----------------------------------------------------------------------===//
+
+#ifndef ENZYMEXLA_CONSTANTFOLDING_H
+#define ENZYMEXLA_CONSTANTFOLDING_H
+
+#include "mlir/IR/BuiltinAttributes.h"
+#include "mlir/IR/BuiltinTypes.h"
+#include "stablehlo/dialect/StablehloOps.h"
+
+#include <optional>
+
+namespace mlir {
+namespace enzyme {
+namespace constfold {
+
+enum class BinaryKind { Add, Sub, Mul, Div, Max, Min, And, Or, Xor };
+
+DenseElementsAttr iota(RankedTensorType type, int64_t dimension);
+
+ElementsAttr broadcastInDim(ElementsAttr operand, ArrayRef<int64_t> dimensions,
+                            RankedTensorType type);
+
+ElementsAttr transpose(ElementsAttr operand, ArrayRef<int64_t> permutation,
+                       RankedTensorType type);
+
+ElementsAttr reshape(ElementsAttr operand, RankedTensorType type);
+
+ElementsAttr slice(ElementsAttr operand, ArrayRef<int64_t> starts,
+                   ArrayRef<int64_t> strides, RankedTensorType type);
+
+ElementsAttr pad(ElementsAttr operand, ElementsAttr paddingValue,
+                 ArrayRef<int64_t> edgePaddingLow,
+                 ArrayRef<int64_t> interiorPadding, RankedTensorType type);
+
+ElementsAttr concatenate(ArrayRef<ElementsAttr> operands, int64_t dimension,
+                         RankedTensorType type);
+
+ElementsAttr binary(BinaryKind kind, ElementsAttr lhs, ElementsAttr rhs,
+                    RankedTensorType type);
+
+ElementsAttr negate(ElementsAttr operand, RankedTensorType type);
+
+ElementsAttr convert(ElementsAttr operand, RankedTensorType type);
+
+ElementsAttr compare(stablehlo::ComparisonDirection direction,
+                     std::optional<stablehlo::ComparisonType> compareType,
+                     ElementsAttr lhs, ElementsAttr rhs, RankedTensorType type);
+
+// Reduces `operand` over `dimensions` starting from the scalar `init`, with
+// the reduction body given by `kind`.
+ElementsAttr reduce(BinaryKind kind, ElementsAttr operand, ElementsAttr init,
+                    ArrayRef<int64_t> dimensions, RankedTensorType type);
+
+ElementsAttr dotGeneral(ElementsAttr lhs, ElementsAttr rhs,
+                        ArrayRef<int64_t> lhsBatchingDimensions,
+                        ArrayRef<int64_t> rhsBatchingDimensions,
+                        ArrayRef<int64_t> lhsContractingDimensions,
+                        ArrayRef<int64_t> rhsContractingDimensions,
+                        RankedTensorType type);
+
+// Number of bytes each element of elementType takes in a raw buffer.
+size_t storageWidth(Type elementType);
+
+// Constants holding at least this many bytes are read into dense_resource
+// blobs when a module is parsed.
+constexpr size_t kBlobMinBytes = 1 << 16;
+
+// Returns a dense_resource constant of type holding bytes. Blobs are named
+// after a hash of their bytes, so constants with the same data share one.
+// Without copy, the blob refers to bytes, which must outlive its uses.
+DenseResourceElementsAttr internBlob(RankedTensorType type,
+                                     ArrayRef<char> bytes, bool copy = true);
+
+// Moves the non-splat constants of root holding at least minBytes into blobs
+// that refer to the attribute storage, so root must not outlive its context.
+// Returns the number of constants moved.
+size_t constantsToBlobs(Operation *root, size_t minBytes);
+
+// Points the dense_resource attributes of root, which must have just been
+// parsed, to the interned blob with the same bytes if there is one, and frees
+// the parsed copy.
+void internBlobs(Operation *root);
+
+// Replaces the dense_resource attributes of root by DenseElementsAttr, for
+// consumers such as the HLO exporter that only read the latter.
+void materializeBlobs(Operation *root);
+
+} // namespace constfold
+} // namespace enzyme
+} // namespace mlir
+
+#endif // ENZYMEXLA_CONSTANTFOLDING_H
@@ -0,0 +1,222 @@
+//===- CostModel.cpp - Analytical cost of stablehlo operations ------------ //
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the static cost model of stablehlo operations used to
+// gate rewrites in enzyme-hlo-opt.
+//===----------------------------------------------------------------------===//
+
+#include "src/enzyme_ad/jax/Passes/CostModel.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/MathExtras.h"
+
+#include "mlir/Interfaces/SideEffectInterfaces.h"
+
+#include "stablehlo/dialect/StablehloOps.h"
+
+#include <algorithm>
+#include <optional>
+
+using namespace mlir;
+using namespace mlir::enzyme;
+
+namespace {
+
+// Flops that can be performed in the time it takes to move one byte, which is
+// around 8-16 on current accelerators.
+constexpr double kFlopsPerByte = 8;
+
+// Time of launching one kernel, in flops.
+constexpr double kLaunchOverhead = 4096;
+
+int64_t elementBytes(Type elementType) {
+  if (auto complex = dyn_cast<ComplexType>(elementType))
+    return 2 * elementBytes(complex.getElementType());
+  if (elementType.isIntOrFloat())
+    return llvm::divideCeil(elementType.getIntOrFloatBitWidth(), 8);
+  return 8;
+}
+
+// Number of elements of a tensor type, or nullopt for dynamic shapes. Other
+// types, such as tokens, have no elements.
+std::optional<int64_t> numElements(Type type) {
+  auto shaped = dyn_cast<ShapedType>(type);
+  if (!shaped)
+    return 0;
+  if (!shaped.hasStaticShape())
+    return std::nullopt;
+  return shaped.getNumElements();
+}
+
+std::optional<int64_t> numBytes(Type type) {
+  auto elems = numElements(type);
+  if (!elems)
+    return std::nullopt;
+  if (auto shaped = dyn_cast<ShapedType>(type))
+    return *elems * elementBytes(shaped.getElementType());
+  return 0;
+}
+
+// Operations that only compute indices into their operands, which XLA fuses
+// into their users.
+bool isFusedIndexing(Operation *op) {
+  return isa<stablehlo::ConstantOp, stablehlo::IotaOp, stablehlo::ReshapeOp,
+             stablehlo::BroadcastInDimOp, stablehlo::SliceOp, stablehlo::PadOp,
+             stablehlo::ConcatenateOp>(op);
+}
+
+} // namespace
+
+OpCost &OpCost::operator+=(const OpCost &other) {
+  flops += other.flops;
+  bytes += other.bytes;
+  kernels += other.kernels;
+  peakLiveBytes = std::max(peakLiveBytes, other.peakLiveBytes);
+  time += other.time;
+  unknown |= other.unknown;
+  return *this;
+}
+
+OpCost mlir::enzyme::computeCost(TypeRange operandTypes, TypeRange resultTypes,
+                                 int64_t flops) {
+  OpCost cost;
+  cost.flops = flops;
+  for (TypeRange types : {operandTypes, resultTypes}) {
+    for (Type type : types) {
+      auto bytes = numBytes(type);
+      if (!bytes) {
+        cost.unknown = true;
+        continue;
+      }
+      cost.bytes += *bytes;
+    }
+  }
+  cost.kernels = 1;
+  cost.peakLiveBytes = cost.bytes;
+  cost.time = std::max((double)cost.flops, kFlopsPerByte * cost.bytes) +
+              kLaunchOverhead;
+  return cost;
+}
+
+OpCost mlir::enzyme::elementwiseCost(TypeRange operandTypes, Type resultType) {
+  auto elems = numElements(resultType);
+  OpCost cost = computeCost(operandTypes, resultType, elems.value_or(0));
+  cost.unknown |= !elems;
+  return cost;
+}
+
+OpCost
+mlir::enzyme::dotGeneralCost(RankedTensorType lhsType, RankedTensorType rhsType,
+                             RankedTensorType resultType,
+                             ArrayRef<int64_t> lhsContractingDimensions) {
+  auto elems = numElements(resultType);
+  int64_t contracted = 1;
+  bool unknown = !elems;
+  for (int64_t dim : lhsContractingDimensions) {
+    if (lhsType.isDynamicDim(dim))
+      unknown = true;
+    else
+      contracted *= lhsType.getDimSize(dim);
+  }
+  // One multiply and one add per contracted element of each result.
+  OpCost cost = computeCost({lhsType, rhsType}, {resultType},
+                            2 * elems.value_or(0) * contracted);
+  cost.unknown |= unknown;
+  return cost;
+}
+
+OpCost mlir::enzyme::reduceCost(TypeRange inputTypes, TypeRange resultTypes) {
+  int64_t flops = 0;
+  bool unknown = false;
+  for (Type type : inputTypes) {
+    auto elems = numElements(type);
+    unknown |= !elems;
+    flops += elems.value_or(0);
+  }
+  OpCost cost = computeCost(inputTypes, resultTypes, flops);
+  cost.unknown |= unknown;
+  return cost;
+}
+
+OpCost mlir::enzyme::estimateCost(Operation *op) {
+  if (isFusedIndexing(op))
+    return OpCost();
+
+  if (auto dot = dyn_cast<stablehlo::DotGeneralOp>(op))
+    return dotGeneralCost(
+        cast<RankedTensorType>(dot.getLhs().getType()),
+        cast<RankedTensorType>(dot.getRhs().getType()),
+        cast<RankedTensorType>(dot.getType()),
+        dot.getDotDimensionNumbers().getLhsContractingDimensions());
+
+  if (auto reduce = dyn_cast<stablehlo::ReduceOp>(op))
+    return reduceCost(reduce.getInputs().getTypes(), reduce->getResultTypes());
+
+  if (op->hasTrait<OpTrait::Elementwise>() && op->getNumResults() == 1)
+    return elementwiseCost(op->getOperandTypes(), op->getResult(0).getType());
+
+  // Anything else is charged for the memory it touches and one flop per
+  // result element.
+  int64_t flops = 0;
+  bool unknown = false;
+  for (Type type : op->getResultTypes()) {
+    auto elems = numElements(type);
+    unknown |= !elems;
+    flops += elems.value_or(0);
+  }
+  OpCost cost = computeCost(op->getOperandTypes(), op->getResultTypes(), flops);
+  cost.unknown |= unknown;
+  return cost;
+}
+
+OpCost mlir::enzyme::estimateErasedCost(Operation *root) {
+  SmallVector<Operation *> erased = {root};
+  llvm::SmallPtrSet<Operation *, 8> seen = {root};
+  OpCost cost;
+  while (!erased.empty()) {
+    Operation *op = erased.pop_back_val();
+    cost += estimateCost(op);
+    for (Value operand : op->getOperands()) {
+      Operation *def = operand.getDefiningOp();
+      if (!def || seen.contains(def) || !isMemoryEffectFree(def))
+        continue;
+      if (!llvm::all_of(def->getUsers(),
+                        [&](Operation *user) { return seen.contains(user); }))
+        continue;
+      seen.insert(def);
+      erased.push_back(def);
+    }
+  }
+  return cost;
+}
+
+OpCost mlir::enzyme::estimateProgramCost(Operation *root) {
+  OpCost cost;
+  root->walk<WalkOrder::PreOrder>([&](Operation *op) {
+    if (!isa_and_nonnull<stablehlo::StablehloDialect>(op->getDialect()))
+      return WalkResult::advance();
+    cost += estimateCost(op);
+    // The bodies of reduce, sort, scatter and the like are scalar
+    // computations that the cost of the operation already accounts for.
+    // Charging each of their operations as a kernel launch would make a
+    // program look cheaper for every reduce it drops.
+    if (op->getNumRegions() != 0 &&
+        !isa<stablehlo::WhileOp, stablehlo::CaseOp, stablehlo::IfOp>(op))
+      return WalkResult::skip();
+    return WalkResult::advance();
+  });
+  return cost;
+}
+
+bool mlir::enzyme::lowersCost(const OpCost &before, const OpCost &after) {
+  if (before.unknown || after.unknown)
+    return true;
+  if (after.time != before.time)
+    return after.time < before.time;
+  return after.peakLiveBytes < before.peakLiveBytes;
+}
@@ -0,0 +1,82 @@
+//===- CostModel.h - Analytical cost of stablehlo operations ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A static cost model for stablehlo, used by rewrite patterns to check that a
+// rewrite lowers the estimated cost of the program before applying it.
+//
+// Each operation is charged the floating point operations it performs, the
+// bytes it reads and writes, and one kernel launch. Operations that only
+// index into their operand (reshape, broadcast_in_dim, slice, pad and
+// concatenate) are assumed to be fused into their users by XLA and are free,
+// as are constants. The time of an operation follows a roofline: the larger
+// of its flops and its bytes scaled by the machine balance, plus the launch
+// overhead. Peak live size is the largest set of buffers one operation keeps
+// alive at once.
+//===----------------------------------------------------------------------===//
+
+#ifndef ENZYMEXLA_COSTMODEL_H
+#define ENZYMEXLA_COSTMODEL_H
+
+#include "mlir/IR/BuiltinTypes.h"
+#include "mlir/IR/Operation.h"
+#include "mlir/IR/TypeRange.h"
+
+namespace mlir {
+namespace enzyme {
+
+struct OpCost {
+  int64_t flops = 0;
+  int64_t bytes = 0;
+  int64_t kernels = 0;
+  int64_t peakLiveBytes = 0;
+  // Estimated time, in flops.
+  double time = 0;
+  // Set when a shape is not static, in which case nothing can be compared.
+  bool unknown = false;
+
+  OpCost &operator+=(const OpCost &other);
+};
+
+inline OpCost operator+(OpCost lhs, const OpCost &rhs) { return lhs += rhs; }
+
+// Cost of an operation computing `flops` values from operandTypes into
+// resultTypes.
+OpCost computeCost(TypeRange operandTypes, TypeRange resultTypes,
+                   int64_t flops);
+
+// Cost of an elementwise operation, which performs one flop per result.
+OpCost elementwiseCost(TypeRange operandTypes, Type resultType);
+
+OpCost dotGeneralCost(RankedTensorType lhsType, RankedTensorType rhsType,
+                      RankedTensorType resultType,
+                      ArrayRef<int64_t> lhsContractingDimensions);
+
+// Cost of a reduction, which performs one flop per input element.
+OpCost reduceCost(TypeRange inputTypes, TypeRange resultTypes);
+
+// Cost of an existing operation.
+OpCost estimateCost(Operation *op);
+
+// Cost of `root` together with the producers that become dead once `root` is
+// erased, which is the cost a rewrite replacing `root` removes.
+OpCost estimateErasedCost(Operation *root);
+
+// Cost of all stablehlo operations nested in `root`. Loop and branch bodies
+// are counted once, while the bodies of other operations, such as the reducer
+// of a reduce, are part of the cost of that operation.
+OpCost estimateProgramCost(Operation *root);
+
+// Returns true when `after` is estimated to run faster than `before`, or
+// equally fast with a smaller peak live size. An unknown cost on either side
+// is accepted so that dynamic shapes are rewritten as before.
+bool lowersCost(const OpCost &before, const OpCost &after);
+
+} // namespace enzyme
+} // namespace mlir
+
+#endif // ENZYMEXLA_COSTMODEL_H
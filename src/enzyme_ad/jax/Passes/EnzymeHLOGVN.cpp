@@ -0,0 +1,140 @@
+//===- EnzymeHLOGVN.cpp - Global value numbering for stablehlo ------------ //
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a pass to replace pure stablehlo operations with an
+// equivalent operation that dominates them.
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/ScopedHashTable.h"
+#include "llvm/Support/RecyclingAllocator.h"
+
+#include "mlir/IR/OperationSupport.h"
+#include "mlir/Interfaces/SideEffectInterfaces.h"
+
+#include "src/enzyme_ad/jax/Passes/PassCounter.h"
+#include "src/enzyme_ad/jax/Passes/PassDetails.h"
+#include "src/enzyme_ad/jax/Passes/Passes.h"
+
+#include "stablehlo/dialect/StablehloOps.h"
+
+#define DEBUG_TYPE "enzyme"
+
+using namespace mlir;
+using namespace mlir::enzyme;
+using namespace enzyme;
+
+namespace {
+
+// Hashes operations by name, attributes, result types and operand values, and
+// compares them including their regions, ignoring locations, as upstream CSE
+// does. Regions are not hashed, so operations that only differ in their bodies
+// share a hash and are told apart by isEqual.
+struct OperationInfo : public llvm::DenseMapInfo<Operation *> {
+  static unsigned getHashValue(const Operation *cop) {
+    return OperationEquivalence::computeHash(
+        const_cast<Operation *>(cop),
+        /*hashOperands=*/OperationEquivalence::directHashValue,
+        /*hashResults=*/OperationEquivalence::ignoreHashValue,
+        OperationEquivalence::IgnoreLocations);
+  }
+  static bool isEqual(const Operation *lhsC, const Operation *rhsC) {
+    auto *lhs = const_cast<Operation *>(lhsC);
+    auto *rhs = const_cast<Operation *>(rhsC);
+    if (lhs == rhs)
+      return true;
+    if (lhs == getTombstoneKey() || lhs == getEmptyKey() ||
+        rhs == getTombstoneKey() || rhs == getEmptyKey())
+      return false;
+    return OperationEquivalence::isEquivalentTo(
+        lhs, rhs, OperationEquivalence::IgnoreLocations);
+  }
+};
+
+using ScopedTable = llvm::ScopedHashTable<
+    Operation *, Operation *, OperationInfo,
+    llvm::RecyclingAllocator<
+        llvm::BumpPtrAllocator,
+        llvm::ScopedHashTableVal<Operation *, Operation *>>>;
+
+// Operations that can be numbered. Like upstream CSE, this leaves out
+// operations with multi-block regions, which stablehlo does not create.
+static bool isCandidate(Operation *op) {
+  return isa<stablehlo::StablehloDialect>(op->getDialect()) &&
+         op->getNumResults() != 0 && isMemoryEffectFree(op) &&
+         llvm::all_of(op->getRegions(), [](Region &region) {
+           return region.empty() || region.hasOneBlock();
+         });
+}
+
+struct GVN {
+  ScopedTable table;
+  size_t eliminated = 0;
+
+  void visitRegion(Region &region) {
+    // Blocks of a region only share the scopes enclosing the region, since a
+    // block does not in general dominate its siblings.
+    for (Block &block : region) {
+      ScopedTable::ScopeTy scope(table);
+      for (Operation &op : llvm::make_early_inc_range(block))
+        visitOp(&op);
+    }
+  }
+
+  void visitOp(Operation *op) {
+    // Bodies are numbered first, so two reduces whose bodies only become
+    // equal once numbered are merged. Only while, case and if bodies see the
+    // enclosing scopes: HLO export turns every other body, such as a reducer
+    // or a sort comparator, into a standalone computation that cannot capture
+    // values from outside, so those are numbered as if isolated from above.
+    for (Region &region : op->getRegions()) {
+      if (isa<stablehlo::WhileOp, stablehlo::CaseOp, stablehlo::IfOp>(op)) {
+        visitRegion(region);
+        continue;
+      }
+      GVN isolated;
+      isolated.visitRegion(region);
+      eliminated += isolated.eliminated;
+    }
+    if (!isCandidate(op))
+      return;
+    if (Operation *existing = table.lookup(op)) {
+      op->replaceAllUsesWith(existing);
+      op->erase();
+      eliminated++;
+      return;
+    }
+    table.insert(op, op);
+  }
+};
+
+PassCounter num_eliminated("enzyme-hlo-gvn", "eliminated",
+                           "Number of operations replaced by an equivalent "
+                           "one");
+
+struct EnzymeHLOGVNPass : public EnzymeHLOGVNPassBase<EnzymeHLOGVNPass> {
+  void runOnOperation() override {
+    num_eliminated += eliminateRedundantStablehloOps(getOperation());
+  }
+};
+
+} // end anonymous namespace
+
+namespace mlir {
+namespace enzyme {
+size_t eliminateRedundantStablehloOps(Operation *root) {
+  GVN gvn;
+  for (Region &region : root->getRegions())
+    gvn.visitRegion(region);
+  return gvn.eliminated;
+}
+
+std::unique_ptr<Pass> createEnzymeHLOGVNPass() {
+  return std::make_unique<EnzymeHLOGVNPass>();
+}
+} // namespace enzyme
+} // namespace mlir
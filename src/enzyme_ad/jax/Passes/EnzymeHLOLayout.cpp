@@ -0,0 +1,576 @@
+//===- EnzymeHLOLayout.cpp - Transpose propagation for stablehlo --------- //
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a pass that moves stablehlo transposes through the
+// operations around them so that as few as possible are materialized.
+//
+// Transposes are sunk below elementwise operations, reductions and
+// concatenations when their operands share a permutation. They are hoisted
+// above elementwise operations and concatenations when every operand takes
+// the permutation for free. Broadcasts and splat constants absorb
+// permutations, and consecutive transposes compose. A value carried by a
+// while loop that is transposed back on every iteration is carried in the
+// layout of the loop body instead, which trades one transpose per iteration
+// for one before and one after the loop. Outside of loops, no rewrite
+// increases the number of transposes. The counts before and after are
+// reported as statistics.
+//===----------------------------------------------------------------------===//
+
+#include "mlir/IR/Matchers.h"
+#include "mlir/IR/PatternMatch.h"
+#include "mlir/Transforms/GreedyPatternRewriteDriver.h"
+
+#include "src/enzyme_ad/jax/Passes/ConstantFolding.h"
+#include "src/enzyme_ad/jax/Passes/PassCounter.h"
+#include "src/enzyme_ad/jax/Passes/PassDetails.h"
+#include "src/enzyme_ad/jax/Passes/Passes.h"
+
+#include "stablehlo/dialect/StablehloOps.h"
+
+#define DEBUG_TYPE "enzyme"
+
+using namespace mlir;
+using namespace mlir::enzyme;
+using namespace enzyme;
+
+namespace {
+
+SmallVector<int64_t> invertPermutation(ArrayRef<int64_t> perm) {
+  SmallVector<int64_t> inv(perm.size());
+  for (auto en : llvm::enumerate(perm))
+    inv[en.value()] = en.index();
+  return inv;
+}
+
+bool isIdentityPermutation(ArrayRef<int64_t> perm) {
+  for (auto en : llvm::enumerate(perm))
+    if (en.value() != (int64_t)en.index())
+      return false;
+  return true;
+}
+
+// Permutation of transpose(transpose(x, inner), outer) as one transpose of x.
+SmallVector<int64_t> composePermutations(ArrayRef<int64_t> inner,
+                                         ArrayRef<int64_t> outer) {
+  SmallVector<int64_t> perm;
+  for (int64_t dim : outer)
+    perm.push_back(inner[dim]);
+  return perm;
+}
+
+RankedTensorType getTransposedType(RankedTensorType type,
+                                   ArrayRef<int64_t> perm) {
+  SmallVector<int64_t> shape;
+  for (int64_t dim : perm)
+    shape.push_back(type.getDimSize(dim));
+  return RankedTensorType::get(shape, type.getElementType());
+}
+
+Value createTranspose(PatternRewriter &rewriter, Location loc, Value v,
+                      ArrayRef<int64_t> perm) {
+  if (isIdentityPermutation(perm))
+    return v;
+  return rewriter.create<stablehlo::TransposeOp>(loc, v, perm);
+}
+
+// Returns true when v can be transposed by perm without materializing a
+// transpose: a transpose composes into the identity, a broadcast absorbs the
+// permutation in its dimensions, and a splat constant is reshaped.
+bool isFreeToTranspose(Value v, ArrayRef<int64_t> perm) {
+  if (isIdentityPermutation(perm))
+    return true;
+  if (!isa<RankedTensorType>(v.getType()))
+    return false;
+  if (auto transpose = v.getDefiningOp<stablehlo::TransposeOp>())
+    return isIdentityPermutation(
+        composePermutations(transpose.getPermutation(), perm));
+  if (v.getDefiningOp<stablehlo::BroadcastInDimOp>())
+    return true;
+  SplatElementsAttr splat;
+  return matchPattern(v, m_Constant(&splat));
+}
+
+// Transposes v by perm, for a value that is free to transpose.
+Value transposeFree(PatternRewriter &rewriter, Location loc, Value v,
+                    ArrayRef<int64_t> perm) {
+  if (isIdentityPermutation(perm))
+    return v;
+  if (auto transpose = v.getDefiningOp<stablehlo::TransposeOp>())
+    return transpose.getOperand();
+  auto type = getTransposedType(cast<RankedTensorType>(v.getType()), perm);
+  if (auto broadcast = v.getDefiningOp<stablehlo::BroadcastInDimOp>()) {
+    // Result dimension j is the broadcast dimension perm[j].
+    auto inv = invertPermutation(perm);
+    SmallVector<int64_t> dims;
+    for (int64_t dim : broadcast.getBroadcastDimensions())
+      dims.push_back(inv[dim]);
+    return rewriter.create<stablehlo::BroadcastInDimOp>(
+        loc, type, broadcast.getOperand(), dims);
+  }
+  SplatElementsAttr splat;
+  matchPattern(v, m_Constant(&splat));
+  return rewriter.create<stablehlo::ConstantOp>(loc, splat.resizeSplat(type));
+}
+
+// Returns true when every use of the transpose t is in op, so that it goes
+// away once op is rewritten.
+bool onlyUsedBy(stablehlo::TransposeOp t, Operation *op) {
+  return llvm::all_of(t->getUsers(),
+                      [&](Operation *user) { return user == op; });
+}
+
+// Finds the permutation shared by the transposed operands of op, such that
+// every other operand takes the inverse permutation for free. Returns the
+// number of transposes that die once op no longer uses them, or -1 when the
+// operands do not agree.
+int64_t getSinkablePermutation(Operation *op, ValueRange operands,
+                               SmallVectorImpl<int64_t> &perm) {
+  for (Value v : operands) {
+    if (auto t = v.getDefiningOp<stablehlo::TransposeOp>()) {
+      perm.assign(t.getPermutation().begin(), t.getPermutation().end());
+      break;
+    }
+  }
+  if (perm.empty() || isIdentityPermutation(perm))
+    return -1;
+  auto inv = invertPermutation(perm);
+  SmallPtrSet<Operation *, 4> removed;
+  for (Value v : operands) {
+    auto t = v.getDefiningOp<stablehlo::TransposeOp>();
+    if (t && t.getPermutation() == ArrayRef<int64_t>(perm)) {
+      if (onlyUsedBy(t, op))
+        removed.insert(t);
+      continue;
+    }
+    if (!isFreeToTranspose(v, inv))
+      return -1;
+  }
+  return removed.size();
+}
+
+// Operands of op once the transpose by perm is sunk below it.
+SmallVector<Value> getSunkOperands(PatternRewriter &rewriter, Location loc,
+                                   ValueRange operands,
+                                   ArrayRef<int64_t> perm) {
+  auto inv = invertPermutation(perm);
+  SmallVector<Value> newOperands;
+  for (Value v : operands) {
+    auto t = v.getDefiningOp<stablehlo::TransposeOp>();
+    if (t && t.getPermutation() == perm)
+      newOperands.push_back(t.getOperand());
+    else
+      newOperands.push_back(transposeFree(rewriter, loc, v, inv));
+  }
+  return newOperands;
+}
+
+// Elementwise operations whose operands all have the shape of the result,
+// which excludes the scalar predicate of select.
+bool isShapePreservingElementwise(Operation *op) {
+  if (!op->hasTrait<OpTrait::Elementwise>() || op->getNumResults() != 1 ||
+      op->getNumRegions() != 0 || op->getNumOperands() == 0)
+    return false;
+  auto type = dyn_cast<RankedTensorType>(op->getResult(0).getType());
+  if (!type)
+    return false;
+  return llvm::all_of(op->getOperandTypes(), [&](Type t) {
+    auto operandType = dyn_cast<RankedTensorType>(t);
+    return operandType && operandType.getShape() == type.getShape();
+  });
+}
+
+struct ComposeTransposes final : OpRewritePattern<stablehlo::TransposeOp> {
+  using OpRewritePattern::OpRewritePattern;
+
+  LogicalResult matchAndRewrite(stablehlo::TransposeOp op,
+                                PatternRewriter &rewriter) const override {
+    if (isIdentityPermutation(op.getPermutation())) {
+      rewriter.replaceOp(op, op.getOperand());
+      return success();
+    }
+    auto inner = op.getOperand().getDefiningOp<stablehlo::TransposeOp>();
+    if (!inner)
+      return failure();
+    rewriter.replaceOp(
+        op, createTranspose(rewriter, op.getLoc(), inner.getOperand(),
+                            composePermutations(inner.getPermutation(),
+                                                op.getPermutation())));
+    return success();
+  }
+};
+
+// transpose(broadcast_in_dim(x)) and transpose(splat) -> broadcast_in_dim(x)
+// and splat.
+struct TransposeAbsorb final : OpRewritePattern<stablehlo::TransposeOp> {
+  using OpRewritePattern::OpRewritePattern;
+
+  LogicalResult matchAndRewrite(stablehlo::TransposeOp op,
+                                PatternRewriter &rewriter) const override {
+    Value operand = op.getOperand();
+    if (operand.getDefiningOp<stablehlo::TransposeOp>() ||
+        !isFreeToTranspose(operand, op.getPermutation()))
+      return failure();
+    rewriter.replaceOp(op, transposeFree(rewriter, op.getLoc(), operand,
+                                         op.getPermutation()));
+    return success();
+  }
+};
+
+// broadcast_in_dim(transpose(x)) -> broadcast_in_dim(x)
+struct BroadcastAbsorb final : OpRewritePattern<stablehlo::BroadcastInDimOp> {
+  using OpRewritePattern::OpRewritePattern;
+
+  LogicalResult matchAndRewrite(stablehlo::BroadcastInDimOp op,
+                                PatternRewriter &rewriter) const override {
+    auto t = op.getOperand().getDefiningOp<stablehlo::TransposeOp>();
+    if (!t)
+      return failure();
+    // Dimension i of the transpose is dimension perm[i] of x.
+    auto dims = op.getBroadcastDimensions();
+    SmallVector<int64_t> newDims(dims.size());
+    for (auto en : llvm::enumerate(t.getPermutation()))
+      newDims[en.value()] = dims[en.index()];
+    rewriter.replaceOpWithNewOp<stablehlo::BroadcastInDimOp>(
+        op, op.getType(), t.getOperand(), newDims);
+    return success();
+  }
+};
+
+// elementwise(transpose(x, p), transpose(y, p)) -> transpose(elementwise(x, y))
+struct SinkTransposeElementwise final : RewritePattern {
+  SinkTransposeElementwise(MLIRContext *context, PatternBenefit benefit = 1)
+      : RewritePattern(MatchAnyOpTypeTag(), benefit, context) {}
+
+  LogicalResult matchAndRewrite(Operation *op,
+                                PatternRewriter &rewriter) const override {
+    if (!isShapePreservingElementwise(op))
+      return failure();
+    SmallVector<int64_t> perm;
+    if (getSinkablePermutation(op, op->getOperands(), perm) < 1)
+      return failure();
+
+    auto type = cast<RankedTensorType>(op->getResult(0).getType());
+    auto newOperands =
+        getSunkOperands(rewriter, op->getLoc(), op->getOperands(), perm);
+    auto newOp = rewriter.create(
+        op->getLoc(), op->getName().getIdentifier(), ValueRange(newOperands),
+        TypeRange(getTransposedType(type, invertPermutation(perm))),
+        op->getAttrs(), {}, {});
+    rewriter.replaceOp(op, createTranspose(rewriter, op->getLoc(),
+                                           newOp->getResult(0), perm));
+    return success();
+  }
+};
+
+// transpose(elementwise(x, y)) -> elementwise(transpose(x), transpose(y)),
+// when every operand is free to transpose.
+struct HoistTransposeElementwise final
+    : OpRewritePattern<stablehlo::TransposeOp> {
+  using OpRewritePattern::OpRewritePattern;
+
+  LogicalResult matchAndRewrite(stablehlo::TransposeOp op,
+                                PatternRewriter &rewriter) const override {
+    Operation *elem = op.getOperand().getDefiningOp();
+    if (!elem || !isShapePreservingElementwise(elem) || !elem->hasOneUse())
+      return failure();
+    auto perm = op.getPermutation();
+    if (!llvm::all_of(elem->getOperands(),
+                      [&](Value v) { return isFreeToTranspose(v, perm); }))
+      return failure();
+
+    SmallVector<Value> newOperands;
+    for (Value v : elem->getOperands())
+      newOperands.push_back(transposeFree(rewriter, op.getLoc(), v, perm));
+    auto newOp = rewriter.create(
+        elem->getLoc(), elem->getName().getIdentifier(),
+        ValueRange(newOperands), TypeRange(op.getType()), elem->getAttrs(),
+        {}, {});
+    rewriter.replaceOp(op, newOp->getResults());
+    return success();
+  }
+};
+
+// reduce(transpose(x, p), dims) -> transpose(reduce(x, p[dims]), q), where q
+// is what remains of p and is often the identity.
+struct SinkTransposeReduce final : OpRewritePattern<stablehlo::ReduceOp> {
+  using OpRewritePattern::OpRewritePattern;
+
+  LogicalResult matchAndRewrite(stablehlo::ReduceOp op,
+                                PatternRewriter &rewriter) const override {
+    SmallVector<int64_t> perm;
+    for (Value v : op.getInputs()) {
+      auto t = v.getDefiningOp<stablehlo::TransposeOp>();
+      if (!t)
+        return failure();
+      if (perm.empty())
+        perm.assign(t.getPermutation().begin(), t.getPermutation().end());
+      else if (t.getPermutation() != ArrayRef<int64_t>(perm))
+        return failure();
+    }
+    int64_t removed = getSinkablePermutation(op, op.getInputs(), perm);
+    if (removed < 0)
+      return failure();
+
+    SmallVector<int64_t> newDims;
+    for (int64_t dim : op.getDimensions())
+      newDims.push_back(perm[dim]);
+    llvm::sort(newDims);
+    // Result dimension k is transposed dimension remaining[k], which is
+    // dimension perm[remaining[k]] of x.
+    SmallVector<int64_t> kept, remaining;
+    for (int64_t i = 0, e = perm.size(); i < e; i++) {
+      if (!llvm::is_contained(newDims, i))
+        kept.push_back(i);
+      if (!llvm::is_contained(op.getDimensions(), i))
+        remaining.push_back(i);
+    }
+    SmallVector<int64_t> resultPerm;
+    for (int64_t dim : remaining)
+      resultPerm.push_back(llvm::find(kept, perm[dim]) - kept.begin());
+    if (removed < (isIdentityPermutation(resultPerm) ? 0 : 1))
+      return failure();
+
+    SmallVector<Value> inputs;
+    for (Value v : op.getInputs())
+      inputs.push_back(v.getDefiningOp<stablehlo::TransposeOp>().getOperand());
+    SmallVector<Type> resultTypes;
+    for (Type type : op->getResultTypes()) {
+      auto resultType = cast<RankedTensorType>(type);
+      resultTypes.push_back(getTransposedType(
+          resultType, invertPermutation(resultPerm)));
+    }
+    auto newReduce = rewriter.create<stablehlo::ReduceOp>(
+        op.getLoc(), resultTypes, inputs, op.getInitValues(), newDims);
+    newReduce.getRegion().takeBody(op.getRegion());
+
+    SmallVector<Value> results;
+    for (Value result : newReduce->getResults())
+      results.push_back(
+          createTranspose(rewriter, op.getLoc(), result, resultPerm));
+    rewriter.replaceOp(op, results);
+    return success();
+  }
+};
+
+// concatenate(transpose(x, p), transpose(y, p), d)
+//   -> transpose(concatenate(x, y, p[d]), p)
+struct SinkTransposeConcat final : OpRewritePattern<stablehlo::ConcatenateOp> {
+  using OpRewritePattern::OpRewritePattern;
+
+  LogicalResult matchAndRewrite(stablehlo::ConcatenateOp op,
+                                PatternRewriter &rewriter) const override {
+    SmallVector<int64_t> perm;
+    if (getSinkablePermutation(op, op.getInputs(), perm) < 1)
+      return failure();
+
+    auto newOperands =
+        getSunkOperands(rewriter, op.getLoc(), op.getInputs(), perm);
+    auto newConcat = rewriter.create<stablehlo::ConcatenateOp>(
+        op.getLoc(), newOperands, perm[op.getDimension()]);
+    rewriter.replaceOp(op,
+                       createTranspose(rewriter, op.getLoc(), newConcat, perm));
+    return success();
+  }
+};
+
+// transpose(concatenate(x, y, d), p) -> concatenate(x', y', inv(p)[d]), when
+// every operand is free to transpose.
+struct HoistTransposeConcat final : OpRewritePattern<stablehlo::TransposeOp> {
+  using OpRewritePattern::OpRewritePattern;
+
+  LogicalResult matchAndRewrite(stablehlo::TransposeOp op,
+                                PatternRewriter &rewriter) const override {
+    auto concat = op.getOperand().getDefiningOp<stablehlo::ConcatenateOp>();
+    if (!concat || !concat->hasOneUse())
+      return failure();
+    auto perm = op.getPermutation();
+    if (!llvm::all_of(concat.getInputs(),
+                      [&](Value v) { return isFreeToTranspose(v, perm); }))
+      return failure();
+
+    SmallVector<Value> newOperands;
+    for (Value v : concat.getInputs())
+      newOperands.push_back(transposeFree(rewriter, op.getLoc(), v, perm));
+    rewriter.replaceOpWithNewOp<stablehlo::ConcatenateOp>(
+        op, newOperands, invertPermutation(perm)[concat.getDimension()]);
+    return success();
+  }
+};
+
+// A loop-carried value that the body yields as transpose(y, p), and that
+// the loop only reads through transposes, is carried as y instead. The
+// transpose applied on entry to the body then composes with the ones that
+// read it, which removes one transpose per iteration for at most one before
+// and one after the loop.
+struct WhileCarriedTranspose final : OpRewritePattern<stablehlo::WhileOp> {
+  int64_t &numCarried;
+
+  WhileCarriedTranspose(MLIRContext *context, int64_t &numCarried,
+                        PatternBenefit benefit = 1)
+      : OpRewritePattern(context, benefit), numCarried(numCarried) {}
+
+  // Makes every user of v other than replacement use replacement instead.
+  static void replaceOtherUses(PatternRewriter &rewriter, Value v,
+                               Operation *replacement) {
+    for (OpOperand &use : llvm::make_early_inc_range(v.getUses())) {
+      Operation *user = use.getOwner();
+      if (user != replacement)
+        rewriter.modifyOpInPlace(
+            user, [&]() { use.set(replacement->getResult(0)); });
+    }
+  }
+
+  static bool onlyReadThroughTransposes(Value v) {
+    return llvm::all_of(v.getUsers(), [](Operation *user) {
+      return isa<stablehlo::TransposeOp>(user);
+    });
+  }
+
+  LogicalResult matchAndRewrite(stablehlo::WhileOp op,
+                                PatternRewriter &rewriter) const override {
+    Block &body = op.getBody().front();
+    Block &cond = op.getCond().front();
+    Operation *yield = body.getTerminator();
+    for (unsigned i = 0, e = op->getNumOperands(); i < e; i++) {
+      auto t = yield->getOperand(i).getDefiningOp<stablehlo::TransposeOp>();
+      if (!t || !t->hasOneUse() || t->getBlock() != &body)
+        continue;
+      // Yielding a transpose of a body argument would yield the new argument
+      // itself, which no longer changes the value.
+      auto arg = dyn_cast<BlockArgument>(t.getOperand());
+      if (arg && arg.getOwner() == &body)
+        continue;
+      if (!onlyReadThroughTransposes(body.getArgument(i)) ||
+          !onlyReadThroughTransposes(cond.getArgument(i)))
+        continue;
+      rewrite(op, i, t, rewriter);
+      numCarried++;
+      return success();
+    }
+    return failure();
+  }
+
+  void rewrite(stablehlo::WhileOp op, unsigned i, stablehlo::TransposeOp t,
+               PatternRewriter &rewriter) const {
+    auto perm = t.getPermutation();
+    Value carried = t.getOperand();
+    Type newType = carried.getType();
+    Block &body = op.getBody().front();
+    Block &cond = op.getCond().front();
+
+    rewriter.setInsertionPoint(op);
+    Value init = op->getOperand(i);
+    Value newInit =
+        createTranspose(rewriter, op.getLoc(), init, invertPermutation(perm));
+    rewriter.modifyOpInPlace(op, [&]() {
+      op->setOperand(i, newInit);
+      body.getArgument(i).setType(newType);
+      cond.getArgument(i).setType(newType);
+      op->getResult(i).setType(newType);
+    });
+
+    for (Block *block : {&body, &cond}) {
+      Value arg = block->getArgument(i);
+      if (arg.use_empty())
+        continue;
+      rewriter.setInsertionPointToStart(block);
+      auto entry = rewriter.create<stablehlo::TransposeOp>(op.getLoc(), arg,
+                                                           perm);
+      replaceOtherUses(rewriter, arg, entry);
+    }
+
+    Operation *yield = body.getTerminator();
+    rewriter.modifyOpInPlace(yield, [&]() { yield->setOperand(i, carried); });
+    rewriter.eraseOp(t);
+
+    Value result = op->getResult(i);
+    if (!result.use_empty()) {
+      rewriter.setInsertionPointAfter(op);
+      auto exit =
+          rewriter.create<stablehlo::TransposeOp>(op.getLoc(), result, perm);
+      replaceOtherUses(rewriter, result, exit);
+    }
+  }
+};
+
+// Counts the transposes nested in root and the bytes they write, leaving out
+// transposes of constants, which are folded.
+std::pair<int64_t, int64_t> countTransposes(Operation *root) {
+  int64_t count = 0, bytes = 0;
+  root->walk([&](stablehlo::TransposeOp op) {
+    if (matchPattern(op.getOperand(), m_Constant()))
+      return;
+    count++;
+    auto type = cast<RankedTensorType>(op.getType());
+    if (type.hasStaticShape())
+      bytes += type.getNumElements() *
+               constfold::storageWidth(type.getElementType());
+  });
+  return {count, bytes};
+}
+
+PassCounter num_transposes_before("enzyme-hlo-transpose-propagation",
+                                  "transposes-before",
+                                  "Number of transposes of non-constant "
+                                  "values before propagation");
+PassCounter num_transposes_after("enzyme-hlo-transpose-propagation",
+                                 "transposes-after",
+                                 "Number of transposes of non-constant values "
+                                 "after propagation");
+PassCounter num_transpose_bytes_before("enzyme-hlo-transpose-propagation",
+                                       "transpose-bytes-before",
+                                       "Bytes written by transposes before "
+                                       "propagation");
+PassCounter num_transpose_bytes_after("enzyme-hlo-transpose-propagation",
+                                      "transpose-bytes-after",
+                                      "Bytes written by transposes after "
+                                      "propagation");
+PassCounter num_loop_carried("enzyme-hlo-transpose-propagation",
+                             "loop-carried",
+                             "Number of while loop values carried in the "
+                             "layout of the body");
+
+struct EnzymeHLOTransposePropagationPass
+    : public EnzymeHLOTransposePropagationPassBase<
+          EnzymeHLOTransposePropagationPass> {
+  void runOnOperation() override {
+    auto [countBefore, bytesBefore] = countTransposes(getOperation());
+    num_transposes_before += countBefore;
+    num_transpose_bytes_before += bytesBefore;
+
+    MLIRContext *context = &getContext();
+    RewritePatternSet patterns(context);
+    patterns.add<ComposeTransposes, TransposeAbsorb, BroadcastAbsorb>(
+        context, PatternBenefit(2));
+    patterns.add<SinkTransposeElementwise, HoistTransposeElementwise,
+                 SinkTransposeReduce, SinkTransposeConcat,
+                 HoistTransposeConcat>(context);
+    int64_t numCarried = 0;
+    patterns.add<WhileCarriedTranspose>(context, numCarried);
+    if (failed(applyPatternsAndFoldGreedily(getOperation(),
+                                            std::move(patterns)))) {
+      signalPassFailure();
+      return;
+    }
+    num_loop_carried += numCarried;
+
+    auto [countAfter, bytesAfter] = countTransposes(getOperation());
+    num_transposes_after += countAfter;
+    num_transpose_bytes_after += bytesAfter;
+  }
+};
+
+} // end anonymous namespace
+
+namespace mlir {
+namespace enzyme {
+std::unique_ptr<Pass> createEnzymeHLOTransposePropagationPass() {
+  return std::make_unique<EnzymeHLOTransposePropagationPass>();
+}
+} // namespace enzyme
+} // namespace mlir
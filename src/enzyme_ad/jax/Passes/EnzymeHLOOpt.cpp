@@ -17,7 +17,10 @@
 #include "mlir/IR/Matchers.h"
 #include "mlir/IR/PatternMatch.h"
 #include "mlir/Transforms/GreedyPatternRewriteDriver.h"
+#include "src/enzyme_ad/jax/Passes/ConstantFolding.h"
+#include "src/enzyme_ad/jax/Passes/CostModel.h"
 #include "src/enzyme_ad/jax/Passes/EnzymeHLOPatterns.h"
+#include "src/enzyme_ad/jax/Passes/PassCounter.h"
 #include "src/enzyme_ad/jax/Passes/PassDetails.h"
 #include "src/enzyme_ad/jax/Passes/Passes.h"
 #include "stablehlo/dialect/StablehloOps.h"
@@ -27,6 +30,8 @@
 
 #include "stablehlo/dialect/TypeInference.h"
 
+#include <chrono>
+
 #define DEBUG_TYPE "enzyme"
 
 using namespace mlir;
@@ -574,6 +579,17 @@ struct SliceTranspose final : OpRewritePattern<mlir::stablehlo::SliceOp> {
   }
 };
 
+// Types of the operands of the elementwise operation `elem` once they are
+// sliced to `shape`.
+static SmallVector<Type> slicedOperandTypes(Operation *elem,
+                                            ArrayRef<int64_t> shape) {
+  SmallVector<Type> types;
+  for (auto v : elem->getOperands())
+    types.push_back(RankedTensorType::get(
+        shape, v.getType().cast<ShapedType>().getElementType()));
+  return types;
+}
+
 struct SliceElementwise final : OpRewritePattern<mlir::stablehlo::SliceOp> {
   using OpRewritePattern::OpRewritePattern;
 
@@ -585,6 +601,10 @@ struct SliceElementwise final : OpRewritePattern<mlir::stablehlo::SliceOp> {
     if (!elem->hasTrait<mlir::OpTrait::Elementwise>())
       return failure();
     if (llvm::hasSingleElement(elem->getUsers())) {
+      auto newCost = elementwiseCost(
+          slicedOperandTypes(elem, op.getType().getShape()), op.getType());
+      if (!lowersCost(estimateErasedCost(op), newCost))
+        return rewriter.notifyMatchFailure(op, "does not lower modeled cost");
       SmallVector<Value> ops;
       for (auto v : elem->getOperands()) {
         ops.push_back(rewriter.create<stablehlo::SliceOp>(
@@ -638,6 +658,14 @@ struct SliceElementwise final : OpRewritePattern<mlir::stablehlo::SliceOp> {
     }
     if (!changed)
       return failure();
+    // The slices of the result are free, so this trades the elementwise
+    // operation for one on the union of the slices.
+    auto newCost = elementwiseCost(
+        slicedOperandTypes(elem, sizes),
+        RankedTensorType::get(sizes,
+                              op.getOperand().getType().getElementType()));
+    if (!lowersCost(estimateCost(elem), newCost))
+      return rewriter.notifyMatchFailure(op, "does not lower modeled cost");
     rewriter.setInsertionPoint(elem);
     SmallVector<Value> ops;
     for (auto v : elem->getOperands()) {
@@ -1366,20 +1394,27 @@ struct PadSimplify final : OpRewritePattern<mlir::stablehlo::PadOp> {
     }
 
     {
-      DenseElementsAttr inp;
+      ElementsAttr inp;
       matchPattern(op.getOperand(), m_Constant(&inp));
-      DenseElementsAttr pv;
+      ElementsAttr pv;
       matchPattern(op.getPaddingValue(), m_Constant(&pv));
       if (inp && pv) {
-        auto ten = mlir::stablehlo::constantOp(inp);
-        auto out = fromTensor(mlir::stablehlo::padOp(
-            mlir::stablehlo::constantOp(inp), mlir::stablehlo::constantOp(pv),
-            stablehlo::Sizes(op.getEdgePaddingLow()),
-            stablehlo::Sizes(op.getInteriorPadding()), op.getType()));
-
-        rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(),
-                                                           out);
-        return success();
+        auto out = constfold::pad(inp, pv, op.getEdgePaddingLow(),
+                                  op.getInteriorPadding(), op.getType());
+        auto denseInp = dyn_cast<DenseElementsAttr>(inp);
+        auto densePv = dyn_cast<DenseElementsAttr>(pv);
+        if (!out && denseInp && densePv)
+          out = fromTensor(mlir::stablehlo::padOp(
+              mlir::stablehlo::constantOp(denseInp),
+              mlir::stablehlo::constantOp(densePv),
+              stablehlo::Sizes(op.getEdgePaddingLow()),
+              stablehlo::Sizes(op.getInteriorPadding()), op.getType()));
+
+        if (out) {
+          rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(),
+                                                             out);
+          return success();
+        }
       }
     }
 
@@ -1532,6 +1567,34 @@ template <typename T> struct BinopPadToConcat final : OpRewritePattern<T> {
         if (idxs.size() == 1) {
           auto idx = idxs[0];
 
+          // The operation is only kept on the edges when the padding value
+          // is not an identity or zero of it.
+          bool trivialEdges =
+              (isa<stablehlo::AddOp>(op) &&
+               matchPattern(lhs.getPaddingValue(), m_AnyZeroFloat())) ||
+              (isa<stablehlo::MulOp>(op) &&
+               (matchPattern(lhs.getPaddingValue(), m_AnyZeroFloat()) ||
+                matchPattern(lhs.getPaddingValue(), m_OneFloat())));
+          auto midType = lhs.getOperand().getType().cast<RankedTensorType>();
+          OpCost newCost = elementwiseCost({midType, midType}, midType);
+          if (!trivialEdges) {
+            int64_t edges[2] = {lhs.getEdgePaddingLow()[idx],
+                                lhs.getEdgePaddingHigh()[idx]};
+            for (int64_t edge : edges) {
+              if (edge == 0)
+                continue;
+              SmallVector<int64_t> shape(type.getShape().begin(),
+                                         type.getShape().end());
+              shape[idx] = edge;
+              auto edgeType =
+                  RankedTensorType::get(shape, type.getElementType());
+              newCost += elementwiseCost({edgeType, edgeType}, edgeType);
+            }
+          }
+          if (!lowersCost(estimateErasedCost(op), newCost))
+            return rewriter.notifyMatchFailure(op,
+                                               "does not lower modeled cost");
+
           SmallVector<int64_t> strides(type.getShape().size(), 1);
           SmallVector<int64_t> starts(type.getShape().size(), 0);
           SmallVector<int64_t> limits(type.getShape().begin(),
@@ -2005,6 +2068,17 @@ struct ConcatPushBinop final
       if (c != typeconvert)
         return failure();
 
+    // When the operations have other users they are kept, and the rewrite
+    // computes everything twice.
+    auto binopType = RankedTensorType::get(
+        op.getType().getShape(),
+        lhs[0].getType().cast<ShapedType>().getElementType());
+    OpCost newCost = elementwiseCost({binopType, binopType}, binopType);
+    if (typeconvert)
+      newCost += elementwiseCost({binopType}, op.getType());
+    if (!lowersCost(estimateErasedCost(op), newCost))
+      return rewriter.notifyMatchFailure(op, "does not lower modeled cost");
+
     auto lhs2 = rewriter.create<stablehlo::ConcatenateOp>(op.getLoc(), lhs,
                                                           op.getDimension());
     auto rhs2 = rewriter.create<stablehlo::ConcatenateOp>(op.getLoc(), rhs,
@@ -2122,8 +2196,8 @@ struct ConcatConstProp final
       }
     }
 
-    SmallVector<DenseElementsAttr> constants;
-    constants.assign(op->getNumOperands(), DenseElementsAttr());
+    SmallVector<ElementsAttr> constants;
+    constants.assign(op->getNumOperands(), ElementsAttr());
     bool legal = true;
     for (unsigned i = 0, e = op->getNumOperands(); i != e; ++i) {
       matchPattern(op->getOperand(i), m_Constant(&constants[i]));
@@ -2132,14 +2206,12 @@ struct ConcatConstProp final
     }
 
     if (legal) {
-
-      SmallVector<stablehlo::Tensor> inps;
-      for (auto &c : constants)
-        inps.push_back(mlir::stablehlo::constantOp(c));
       auto out =
-          mlir::stablehlo::concatenateOp(inps, op.getDimension(), op.getType());
+          constfold::concatenate(constants, op.getDimension(), op.getType());
+      if (!out)
+        return failure();
       rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(),
-                                                         fromTensor(out));
+                                                         out);
       return success();
     }
     return failure();
@@ -2421,6 +2493,22 @@ struct ScatterToDynamicUpdateSlice final
   }
 };
 
+// Folds a binary elementwise op on two constants with the native kernels.
+// Element types these do not handle are left to the APFloat and APInt folds.
+template <typename OpTy>
+static LogicalResult foldConstantBinop(OpTy op, constfold::BinaryKind kind,
+                                       PatternRewriter &rewriter) {
+  ElementsAttr lhs, rhs;
+  if (!matchPattern(op.getLhs(), m_Constant(&lhs)) ||
+      !matchPattern(op.getRhs(), m_Constant(&rhs)))
+    return failure();
+  auto out = constfold::binary(kind, lhs, rhs, op.getType());
+  if (!out)
+    return failure();
+  rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(), out);
+  return success();
+}
+
 struct AddSimplify : public OpRewritePattern<mlir::stablehlo::AddOp> {
   using OpRewritePattern<mlir::stablehlo::AddOp>::OpRewritePattern;
 
@@ -2439,6 +2527,9 @@ struct AddSimplify : public OpRewritePattern<mlir::stablehlo::AddOp> {
       return success();
     }
 
+    if (succeeded(foldConstantBinop(op, constfold::BinaryKind::Add, rewriter)))
+      return success();
+
     SmallVector<Attribute> constants;
     constants.assign(op->getNumOperands(), Attribute());
     for (unsigned i = 0, e = op->getNumOperands(); i != e; ++i)
@@ -2501,6 +2592,9 @@ struct SubSimplify : public OpRewritePattern<mlir::stablehlo::SubtractOp> {
       return success();
     }
 
+    if (succeeded(foldConstantBinop(op, constfold::BinaryKind::Sub, rewriter)))
+      return success();
+
     SmallVector<Attribute> constants;
     constants.assign(op->getNumOperands(), Attribute());
     for (unsigned i = 0, e = op->getNumOperands(); i != e; ++i)
@@ -2544,6 +2638,15 @@ struct NegateSimplify : public OpRewritePattern<mlir::stablehlo::NegOp> {
   LogicalResult matchAndRewrite(mlir::stablehlo::NegOp op,
                                 PatternRewriter &rewriter) const final {
 
+    ElementsAttr inp;
+    if (matchPattern(op.getOperand(), m_Constant(&inp))) {
+      if (auto out = constfold::negate(inp, op.getType())) {
+        rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(),
+                                                           out);
+        return success();
+      }
+    }
+
     SmallVector<Attribute> constants;
     constants.assign(op->getNumOperands(), Attribute());
     for (unsigned i = 0, e = op->getNumOperands(); i != e; ++i)
@@ -2598,6 +2701,9 @@ struct AndSimplify : public OpRewritePattern<mlir::stablehlo::AndOp> {
       }
     }
 
+    if (succeeded(foldConstantBinop(op, constfold::BinaryKind::And, rewriter)))
+      return success();
+
     return failure();
   }
 };
@@ -2624,6 +2730,9 @@ struct OrSimplify : public OpRewritePattern<mlir::stablehlo::OrOp> {
       }
     }
 
+    if (succeeded(foldConstantBinop(op, constfold::BinaryKind::Or, rewriter)))
+      return success();
+
     return failure();
   }
 };
@@ -2661,6 +2770,9 @@ struct MulSimplify : public OpRewritePattern<mlir::stablehlo::MulOp> {
       return success();
     }
 
+    if (succeeded(foldConstantBinop(op, constfold::BinaryKind::Mul, rewriter)))
+      return success();
+
     SmallVector<Attribute> constants;
     constants.assign(op->getNumOperands(), Attribute());
     for (unsigned i = 0, e = op->getNumOperands(); i != e; ++i)
@@ -2716,6 +2828,9 @@ struct DivSimplify : public OpRewritePattern<mlir::stablehlo::DivOp> {
       return success();
     }
 
+    if (succeeded(foldConstantBinop(op, constfold::BinaryKind::Div, rewriter)))
+      return success();
+
     SmallVector<Attribute> constants;
     constants.assign(op->getNumOperands(), Attribute());
     for (unsigned i = 0, e = op->getNumOperands(); i != e; ++i)
@@ -2865,9 +2980,11 @@ struct IotaSimplify : public OpRewritePattern<mlir::stablehlo::IotaOp> {
     if (size >= max_constant_expansion)
       return failure();
 
-    auto out = mlir::stablehlo::iotaOp(op.getIotaDimension(), op.getType());
-    rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(),
-                                                       fromTensor(out));
+    auto out = constfold::iota(op.getType(), op.getIotaDimension());
+    if (!out)
+      out = fromTensor(
+          mlir::stablehlo::iotaOp(op.getIotaDimension(), op.getType()));
+    rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(), out);
     return success();
   }
 };
@@ -2984,21 +3101,28 @@ struct ConvertSimplify : public OpRewritePattern<mlir::stablehlo::ConvertOp> {
 
   LogicalResult matchAndRewrite(mlir::stablehlo::ConvertOp op,
                                 PatternRewriter &rewriter) const final {
-    DenseElementsAttr inp;
+    ElementsAttr inp;
     matchPattern(op->getOperand(0), m_Constant(&inp));
     if (inp) {
-      stablehlo::Tensor ten;
-      RankedTensorType ty = op.getType();
-      if (inp.isSplat()) {
-        ten = stablehlo::makeTensor(inp.resizeSplat(
-            RankedTensorType::get({}, inp.getType().getElementType())));
-        ty = RankedTensorType::get({}, op.getType().getElementType());
-      } else {
-        ten = mlir::stablehlo::constantOp(inp);
+      auto out = constfold::convert(inp, op.getType());
+      auto dense = dyn_cast<DenseElementsAttr>(inp);
+      if (!out && dense) {
+        stablehlo::Tensor ten;
+        RankedTensorType ty = op.getType();
+        if (dense.isSplat()) {
+          ten = stablehlo::makeTensor(dense.resizeSplat(
+              RankedTensorType::get({}, dense.getType().getElementType())));
+          ty = RankedTensorType::get({}, op.getType().getElementType());
+        } else {
+          ten = mlir::stablehlo::constantOp(dense);
+        }
+        auto result = fromTensor(mlir::stablehlo::convertOp(ten, ty));
+        if (dense.isSplat())
+          result = result.resizeSplat(op.getType());
+        out = result;
       }
-      auto out = fromTensor(mlir::stablehlo::convertOp(ten, ty));
-      if (inp.isSplat())
-        out = out.resizeSplat(op.getType());
+      if (!out)
+        return failure();
 
       rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(), out);
       return success();
@@ -3011,68 +3135,15 @@ struct ConvertSimplify : public OpRewritePattern<mlir::stablehlo::ConvertOp> {
 struct SliceSimplify : public OpRewritePattern<mlir::stablehlo::SliceOp> {
   using OpRewritePattern<mlir::stablehlo::SliceOp>::OpRewritePattern;
 
-  static size_t getDenseElementBitWidth(Type eltType) {
-    // Align the width for complex to 8 to make storage and interpretation
-    // easier.
-    if (ComplexType comp = llvm::dyn_cast<ComplexType>(eltType))
-      return llvm::alignTo<8>(getDenseElementBitWidth(comp.getElementType())) *
-             2;
-    if (eltType.isIndex())
-      return IndexType::kInternalStorageBitWidth;
-    return eltType.getIntOrFloatBitWidth();
-  }
-
-  static size_t getDenseElementStorageWidth(size_t origWidth) {
-    return origWidth == 1 ? origWidth : llvm::alignTo<8>(origWidth);
-  }
-  static size_t getDenseElementStorageWidth(Type elementType) {
-    return getDenseElementStorageWidth(getDenseElementBitWidth(elementType));
-  }
-
   LogicalResult matchAndRewrite(mlir::stablehlo::SliceOp op,
                                 PatternRewriter &rewriter) const final {
-    DenseElementsAttr inp;
+    ElementsAttr inp;
     matchPattern(op->getOperand(0), m_Constant(&inp));
     if (inp) {
-      DenseElementsAttr out;
-      if (inp.isSplat()) {
-        out = inp.resizeSplat(op.getType());
-      } else {
-        bool contiguous = true;
-        size_t offset = 0;
-        auto inshape = op.getOperand().getType().getShape();
-        auto outshape = op.getType().getShape();
-        size_t total = 1;
-        for (int i = 0; i < inshape.size(); i++) {
-          if (op.getStrides()[i] != 1) {
-            contiguous = false;
-          }
-          auto start = op.getStartIndices()[i];
-          auto lim = op.getLimitIndices()[i];
-          if (start != 0 || lim != inshape[i]) {
-            if (offset != 0) {
-              contiguous = false;
-            }
-          }
-          offset *= inshape[i];
-          offset += start;
-          total *= outshape[i];
-        }
-        auto elementType = op.getOperand().getType().getElementType();
-        auto bw = getDenseElementStorageWidth(elementType);
-        if (contiguous && bw != 1) {
-          const char *elementPtr = inp.getRawData().data() + (bw / 8) * offset;
-
-          auto values = ArrayRef((char *)elementPtr, (bw / 8) * total);
-          out =
-              DenseIntOrFPElementsAttr::getFromRawBuffer(op.getType(), values);
-        } else {
-          auto ten = mlir::stablehlo::constantOp(inp);
-          out = fromTensor(mlir::stablehlo::sliceOp(
-              ten, stablehlo::Sizes(op.getStartIndices()),
-              stablehlo::Sizes(op.getStrides()), op.getType()));
-        }
-      }
+      auto out = constfold::slice(inp, op.getStartIndices(), op.getStrides(),
+                                  op.getType());
+      if (!out)
+        return failure();
       rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(), out);
       return success();
     }
@@ -3094,23 +3165,20 @@ struct BroadcastInDimSimplify
 
   LogicalResult matchAndRewrite(mlir::stablehlo::BroadcastInDimOp op,
                                 PatternRewriter &rewriter) const final {
-    DenseElementsAttr inp;
+    ElementsAttr inp;
     matchPattern(op->getOperand(0), m_Constant(&inp));
     if (inp) {
-      DenseElementsAttr out;
-      if (inp.isSplat()) {
-        out = inp.resizeSplat(op.getType());
-      } else {
+      if (!inp.isSplat()) {
         size_t size = 1;
         for (auto sz : op.getType().getShape())
           size *= sz;
         if (size >= max_constant_expansion)
           return failure();
-        auto ten = mlir::stablehlo::constantOp(inp);
-        out = fromTensor(mlir::stablehlo::broadcastInDimOp(
-            ten, mlir::stablehlo::Axes(op.getBroadcastDimensions()),
-            op.getType()));
       }
+      auto out = constfold::broadcastInDim(inp, op.getBroadcastDimensions(),
+                                           op.getType());
+      if (!out)
+        return failure();
 
       rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(), out);
       return success();
@@ -3136,24 +3204,104 @@ struct DotGeneralSimplify
   }
 };
 
+struct DotGeneralConstProp
+    : public OpRewritePattern<mlir::stablehlo::DotGeneralOp> {
+  using OpRewritePattern<mlir::stablehlo::DotGeneralOp>::OpRewritePattern;
+
+  size_t max_constant_expansion;
+  DotGeneralConstProp(size_t max_constant_expansion, MLIRContext *context,
+                      PatternBenefit benefit = 1,
+                      ArrayRef<StringRef> generatedNames = {})
+      : OpRewritePattern(context, benefit, generatedNames),
+        max_constant_expansion(max_constant_expansion) {}
+
+  LogicalResult matchAndRewrite(mlir::stablehlo::DotGeneralOp op,
+                                PatternRewriter &rewriter) const final {
+    ElementsAttr lhs, rhs;
+    if (!matchPattern(op.getLhs(), m_Constant(&lhs)) ||
+        !matchPattern(op.getRhs(), m_Constant(&rhs)))
+      return failure();
+
+    auto type = dyn_cast<RankedTensorType>(op.getType());
+    if (!type || !type.hasStaticShape())
+      return failure();
+    auto dimensionNumbers = op.getDotDimensionNumbers();
+    size_t contracted = 1;
+    for (auto dim : dimensionNumbers.getLhsContractingDimensions())
+      contracted *= lhs.getShapedType().getShape()[dim];
+    // Only fold small products, bounding both the size of the result and the
+    // number of multiply-adds.
+    if (type.getNumElements() >= max_constant_expansion ||
+        type.getNumElements() * contracted >= 64 * max_constant_expansion)
+      return failure();
+
+    auto out = constfold::dotGeneral(
+        lhs, rhs, dimensionNumbers.getLhsBatchingDimensions(),
+        dimensionNumbers.getRhsBatchingDimensions(),
+        dimensionNumbers.getLhsContractingDimensions(),
+        dimensionNumbers.getRhsContractingDimensions(), type);
+    if (!out)
+      return failure();
+    rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, type, out);
+    return success();
+  }
+};
+
+struct ReduceConstProp final : OpRewritePattern<mlir::stablehlo::ReduceOp> {
+  using OpRewritePattern::OpRewritePattern;
+
+  LogicalResult matchAndRewrite(mlir::stablehlo::ReduceOp op,
+                                PatternRewriter &rewriter) const override {
+    if (op.getInputs().size() != 1)
+      return failure();
+    if (!isEligibleForCompactPrint(op))
+      return failure();
+
+    ElementsAttr inp, init;
+    if (!matchPattern(op.getInputs()[0], m_Constant(&inp)) ||
+        !matchPattern(op.getInitValues()[0], m_Constant(&init)))
+      return failure();
+
+    Operation &innerOp = op.getBody().front().front();
+    std::optional<constfold::BinaryKind> kind;
+    if (isa<stablehlo::AddOp>(innerOp))
+      kind = constfold::BinaryKind::Add;
+    else if (isa<stablehlo::MulOp>(innerOp))
+      kind = constfold::BinaryKind::Mul;
+    else if (isa<stablehlo::MaxOp>(innerOp))
+      kind = constfold::BinaryKind::Max;
+    else if (isa<stablehlo::MinOp>(innerOp))
+      kind = constfold::BinaryKind::Min;
+    else if (isa<stablehlo::AndOp>(innerOp))
+      kind = constfold::BinaryKind::And;
+    else if (isa<stablehlo::OrOp>(innerOp))
+      kind = constfold::BinaryKind::Or;
+    else
+      return failure();
+
+    auto type = dyn_cast<RankedTensorType>(op.getResult(0).getType());
+    if (!type)
+      return failure();
+    auto out = constfold::reduce(*kind, inp, init, op.getDimensions(), type);
+    if (!out)
+      return failure();
+    rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, type, out);
+    return success();
+  }
+};
+
 struct TransposeSimplify
     : public OpRewritePattern<mlir::stablehlo::TransposeOp> {
   using OpRewritePattern<mlir::stablehlo::TransposeOp>::OpRewritePattern;
 
   LogicalResult matchAndRewrite(mlir::stablehlo::TransposeOp op,
                                 PatternRewriter &rewriter) const final {
-    DenseElementsAttr inp;
+    ElementsAttr inp;
     matchPattern(op->getOperand(0), m_Constant(&inp));
     if (inp) {
-
-      DenseElementsAttr out;
-      if (inp.isSplat()) {
-        out = inp.resizeSplat(op.getType());
-      } else {
-        out = fromTensor(mlir::stablehlo::transposeOp(
-            stablehlo::constantOp(inp),
-            mlir::stablehlo::Axes(op.getPermutation()), op.getType()));
-      }
+      auto out = constfold::transpose(inp, op.getPermutation(), op.getType());
+      if (!out)
+        return failure();
       rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(), out);
       return success();
     }
@@ -3170,6 +3318,9 @@ struct MaxSimplify : public OpRewritePattern<mlir::stablehlo::MaxOp> {
       rewriter.replaceOp(op, op.getOperand(0));
       return success();
     }
+    if (succeeded(foldConstantBinop(op, constfold::BinaryKind::Max, rewriter)))
+      return success();
+
     SmallVector<Attribute> constants;
     constants.assign(op->getNumOperands(), Attribute());
     for (unsigned i = 0, e = op->getNumOperands(); i != e; ++i)
@@ -3212,6 +3363,9 @@ struct MinSimplify : public OpRewritePattern<mlir::stablehlo::MinOp> {
       rewriter.replaceOp(op, op.getOperand(0));
       return success();
     }
+    if (succeeded(foldConstantBinop(op, constfold::BinaryKind::Min, rewriter)))
+      return success();
+
     SmallVector<Attribute> constants;
     constants.assign(op->getNumOperands(), Attribute());
     for (unsigned i = 0, e = op->getNumOperands(); i != e; ++i)
@@ -3935,6 +4089,15 @@ struct BroadcastReduce : public OpRewritePattern<mlir::stablehlo::ReduceOp> {
     if (broadcastFromNothingDims.empty() && broadcastFromOneDims.empty())
       return rewriter.notifyMatchFailure(op, "no dimensions to remove");
 
+    // The constant and its conversion fold, which leaves the reduction of
+    // the source and one multiplication.
+    Type resultType = op->getResult(0).getType();
+    OpCost newCost =
+        reduceCost({broadcast.getOperand().getType()}, op->getResultTypes()) +
+        elementwiseCost({resultType, resultType}, resultType);
+    if (!lowersCost(estimateErasedCost(op), newCost))
+      return rewriter.notifyMatchFailure(op, "does not lower modeled cost");
+
     int64_t size = 1;
     for (int64_t dim : broadcastFromNothingDims) {
       size *= inputType.getDimSize(dim);
@@ -4759,6 +4922,25 @@ struct PadDotGeneral : public OpRewritePattern<mlir::stablehlo::DotGeneralOp> {
                                          "contracting dimensions not padded");
     }
 
+    // The slice and the pad are free, so this trades the dot_general for one
+    // on smaller operands, which may still not pay off for tiny tensors.
+    auto otherType = otherArg.getType().cast<RankedTensorType>();
+    SmallVector<int64_t> otherShape(otherType.getShape().begin(),
+                                    otherType.getShape().end());
+    for (auto &&[dim, low, high, interior] : otherDimsToSlice)
+      otherShape[dim] =
+          llvm::divideCeil(otherShape[dim] - low - high, interior + 1);
+    auto padOperandType = pad.getOperand().getType().cast<RankedTensorType>();
+    auto slicedType =
+        RankedTensorType::get(otherShape, otherType.getElementType());
+    auto newCost = dotGeneralCost(
+        otherIsLHS ? slicedType : padOperandType,
+        otherIsLHS ? padOperandType : slicedType,
+        RankedTensorType::get(resultShape, op.getType().getElementType()),
+        dimensionNumbers.getLhsContractingDimensions());
+    if (!lowersCost(estimateErasedCost(op), newCost))
+      return rewriter.notifyMatchFailure(op, "does not lower modeled cost");
+
     Value nextOtherArg = otherArg;
     if (!otherDimsToSlice.empty()) {
       SmallVector<int64_t> sliceLow, sliceHigh, sliceStride;
@@ -5564,31 +5746,42 @@ struct CompareOpCanon final : OpRewritePattern<mlir::stablehlo::CompareOp> {
     RankedTensorType type = op.getType();
 
     {
-      DenseElementsAttr lhs;
-      matchPattern(op.getLhs(), m_Constant(&lhs));
-      DenseElementsAttr rhs;
-      matchPattern(op.getRhs(), m_Constant(&rhs));
-      if (lhs && rhs) {
-        bool isSplat = lhs.isSplat() && rhs.isSplat();
-        auto ty = isSplat
-                      ? RankedTensorType::get({}, op.getType().getElementType())
+      ElementsAttr lhsAttr;
+      matchPattern(op.getLhs(), m_Constant(&lhsAttr));
+      ElementsAttr rhsAttr;
+      matchPattern(op.getRhs(), m_Constant(&rhsAttr));
+      if (lhsAttr && rhsAttr) {
+        auto out = constfold::compare(op.getComparisonDirection(),
+                                      op.getCompareType(), lhsAttr, rhsAttr,
+                                      op.getType());
+        // Blobs are only folded natively.
+        auto lhs = dyn_cast<DenseElementsAttr>(lhsAttr);
+        auto rhs = dyn_cast<DenseElementsAttr>(rhsAttr);
+        if (!out && lhs && rhs) {
+          bool isSplat = lhs.isSplat() && rhs.isSplat();
+          auto ty =
+              isSplat ? RankedTensorType::get({}, op.getType().getElementType())
                       : op.getType();
-        auto out = fromTensor(mlir::stablehlo::compareOp(
-            isSplat
-                ? stablehlo::makeTensor(lhs.resizeSplat(RankedTensorType::get(
-                      {}, lhs.getType().getElementType())))
-                : mlir::stablehlo::constantOp(lhs),
-            isSplat
-                ? stablehlo::makeTensor(rhs.resizeSplat(RankedTensorType::get(
-                      {}, rhs.getType().getElementType())))
-                : mlir::stablehlo::constantOp(rhs),
-            op.getComparisonDirection(), ty));
-        if (isSplat)
-          out = out.resizeSplat(op.getType());
+          auto result = fromTensor(mlir::stablehlo::compareOp(
+              isSplat ? stablehlo::makeTensor(
+                            lhs.resizeSplat(RankedTensorType::get(
+                                {}, lhs.getType().getElementType())))
+                      : mlir::stablehlo::constantOp(lhs),
+              isSplat ? stablehlo::makeTensor(
+                            rhs.resizeSplat(RankedTensorType::get(
+                                {}, rhs.getType().getElementType())))
+                      : mlir::stablehlo::constantOp(rhs),
+              op.getComparisonDirection(), ty));
+          if (isSplat)
+            result = result.resizeSplat(op.getType());
+          out = result;
+        }
 
-        rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(),
-                                                           out);
-        return success();
+        if (out) {
+          rewriter.replaceOpWithNewOp<stablehlo::ConstantOp>(op, op.getType(),
+                                                             out);
+          return success();
+        }
       }
     }
 
@@ -5797,31 +5990,16 @@ struct ConcatenateOpCanon final
 
     // Fold concatenate when all inputs are constants.
     OperandRange inputs = op.getInputs();
-    SmallVector<DenseElementsAttr> constants(inputs.size());
+    SmallVector<ElementsAttr> constants(inputs.size());
     for (auto [input, constant] : llvm::zip_equal(inputs, constants)) {
       if (!matchPattern(input, m_Constant(&constant)))
         return failure();
     }
 
-    uint64_t dim = op.getDimension();
-    ArrayRef<int64_t> shape = type.getShape();
-    int64_t topSize = std::accumulate(shape.begin(), shape.begin() + dim,
-                                      int64_t{1}, std::multiplies<>{});
-
-    SmallVector<Attribute> newElems;
-    newElems.reserve(numElems);
-
-    for (int64_t i = 0; i != topSize; ++i) {
-      for (ElementsAttr attr : constants) {
-        size_t bottomSize = attr.getNumElements() / topSize;
-        auto begin = attr.value_begin<Attribute>() + (i * bottomSize);
-        newElems.append(begin, begin + bottomSize);
-      }
-    }
-
-    assert(newElems.size() == numElems);
-    rewriter.replaceOpWithNewOp<mlir::stablehlo::ConstantOp>(
-        op, DenseElementsAttr::get(op.getType(), newElems));
+    auto out = constfold::concatenate(constants, op.getDimension(), type);
+    if (!out)
+      return failure();
+    rewriter.replaceOpWithNewOp<mlir::stablehlo::ConstantOp>(op, out);
     return success();
   }
 };
@@ -6198,12 +6376,15 @@ struct ReshapeOpCanon final : OpRewritePattern<mlir::stablehlo::ReshapeOp> {
     }
 
     // Fold reshape of a constant.
-    DenseElementsAttr cstAttr;
+    ElementsAttr cstAttr;
     if (!matchPattern(op.getOperand(), m_Constant(&cstAttr)))
       return failure();
 
-    rewriter.replaceOpWithNewOp<mlir::stablehlo::ConstantOp>(
-        op, cstAttr.reshape(op.getType()));
+    auto out = constfold::reshape(cstAttr, op.getType());
+    if (!out)
+      return failure();
+    rewriter.replaceOpWithNewOp<mlir::stablehlo::ConstantOp>(op, op.getType(),
+                                                             out);
     return success();
   }
 };
@@ -6387,6 +6568,14 @@ void mlir::transform::addBroadcastInDimSimplify(RewritePatternSet &patterns,
                                           benefit);
 }
 
+void mlir::transform::addDotGeneralConstProp(RewritePatternSet &patterns,
+                                             int64_t maxConstantExpansion,
+                                             MLIRContext &context,
+                                             PatternBenefit benefit) {
+  patterns.insert<DotGeneralConstProp>(maxConstantExpansion, &context,
+                                       benefit);
+}
+
 void mlir::transform::addSelectOpCanon(RewritePatternSet &patterns,
                                        int64_t maxConstantExpansion,
                                        MLIRContext &context,
@@ -6402,11 +6591,48 @@ void mlir::transform::addConcatenateOpCanon(RewritePatternSet &patterns,
 }
 
 namespace {
-struct EnzymeHLOOptPass : public EnzymeHLOOptPassBase<EnzymeHLOOptPass> {
+// Label of the patterns that move operations across concatenations and pads.
+// Applied early they can block simplifications, so try_orders also runs them
+// only once everything else has reached a fixpoint.
+static constexpr llvm::StringLiteral kReorderLabel = "reorder";
+
+PassCounter num_iterations("enzyme-hlo-opt", "iterations",
+                           "Number of greedy rewrite iterations");
+PassCounter num_converged("enzyme-hlo-opt", "converged",
+                          "Number of runs that reached a fixpoint");
+PassCounter num_not_converged("enzyme-hlo-opt", "not-converged",
+                              "Number of runs that stopped at max_iterations");
+PassCounter num_gvn_eliminated("enzyme-hlo-opt", "gvn-eliminated",
+                               "Number of operations removed by value "
+                               "numbering");
+PassCounter num_orders_tried("enzyme-hlo-opt", "orders-tried",
+                             "Number of rewrite orders tried with try_orders");
+PassCounter num_orders_improved("enzyme-hlo-opt", "orders-improved",
+                                "Number of runs where another order beat the "
+                                "default one");
 
-  void runOnOperation() override {
-    auto context = getOperation()->getContext();
+struct EnzymeHLOOptPass : public EnzymeHLOOptPassBase<EnzymeHLOOptPass> {
+  // Built once from the pass options when the pass manager initializes, and
+  // shared by the clones made for each nested operation.
+  std::shared_ptr<const FrozenRewritePatternSet> frozen;
+  // The same patterns without the reordering ones, only built with
+  // try_orders.
+  std::shared_ptr<const FrozenRewritePatternSet> frozenNoReorder;
+
+  LogicalResult initialize(MLIRContext *context) override {
     RewritePatternSet patterns(context);
+    populatePatterns(patterns, context);
+    frozen = std::make_shared<FrozenRewritePatternSet>(std::move(patterns));
+    if (try_orders) {
+      RewritePatternSet noReorder(context);
+      populatePatterns(noReorder, context);
+      frozenNoReorder = std::make_shared<FrozenRewritePatternSet>(
+          std::move(noReorder), ArrayRef<std::string>{kReorderLabel.str()});
+    }
+    return success();
+  }
+
+  void populatePatterns(RewritePatternSet &patterns, MLIRContext *context) {
     patterns
         .add<AddSimplify, SubSimplify, AndSimplify, MaxSimplify, MinSimplify,
              OrSimplify, NegateSimplify, MulSimplify, DivSimplify, RemSimplify,
@@ -6416,26 +6642,27 @@ struct EnzymeHLOOptPass : public EnzymeHLOOptPassBase<EnzymeHLOOptPass> {
              ConvertSimplify, TransposeSimplify, DotGeneralSimplify,
              DynamicSliceToStatic, DynamicUpdateSliceElim, ReduceToReshape,
              BroadcastToReshape, GatherSimplify, ReshapeEmptyBroadcast,
-             BroadcastReshape, ConstPropThroughBarrier>(context,
-                                                        PatternBenefit(65000));
+             BroadcastReshape, ConstPropThroughBarrier, ReduceConstProp>(
+            context, PatternBenefit(65000));
 
-    patterns.add<IotaSimplify, BroadcastInDimSimplify>(
+    patterns.add<IotaSimplify, BroadcastInDimSimplify, DotGeneralConstProp>(
         max_constant_expansion, context, PatternBenefit(65000));
 
     patterns.add<ConvertConcat, DynamicUpdateToConcat, SliceOfDynamicUpdate,
                  SliceElementwise, SliceReshapeElementwise, SlicePad,
                  SliceReshapePad, DotReshapeDot, ConcatConstProp, ConcatFuse,
                  ConcatToBroadcast, PadPad, PadReshapePad,
-                 ConcatPushBinop<stablehlo::AddOp>,
-                 ConcatPushBinop<stablehlo::MulOp>, ScatterToDynamicUpdateSlice,
-                 ReduceConcat, SliceConcat, SliceReshapeConcat,
+                 ScatterToDynamicUpdateSlice, ReduceConcat,
                  BinBroadcastSplat<stablehlo::AddOp>,
                  BinBroadcastSplat<stablehlo::SubtractOp>,
                  BinBroadcastSplat<stablehlo::DivOp>,
                  BinBroadcastSplat<stablehlo::MulOp>>(context);
 
-    patterns.add<BinopPadToConcat<stablehlo::AddOp>,
-                 BinopPadToConcat<stablehlo::MulOp>, ConcatPad>(context);
+    patterns.addWithLabel<
+        ConcatPushBinop<stablehlo::AddOp>, ConcatPushBinop<stablehlo::MulOp>,
+        SliceConcat, SliceReshapeConcat, BinopPadToConcat<stablehlo::AddOp>,
+        BinopPadToConcat<stablehlo::MulOp>, ConcatPad>({kReorderLabel},
+                                                       context);
 
     if (passses & 512)
       patterns.add<TransposeDotReorder, DotTranspose, ConvolutionTranspose,
@@ -6479,17 +6706,6 @@ struct EnzymeHLOOptPass : public EnzymeHLOOptPassBase<EnzymeHLOOptPass> {
     if (passses & 128)
       patterns.add<ReshapePad>(context);
 
-    if (cse) {
-      patterns.add<CSE<stablehlo::BroadcastInDimOp>, CSE<stablehlo::SliceOp>,
-                   CSE<stablehlo::TransposeOp>, CSE<stablehlo::ConvertOp>,
-                   CSE<stablehlo::PadOp>, CSE<stablehlo::DotGeneralOp>,
-                   CSE<stablehlo::ReshapeOp>, CSE<stablehlo::MulOp>,
-                   CSE<stablehlo::DivOp>, CSE<stablehlo::AddOp>,
-                   CSE<stablehlo::SubtractOp>, CSE<stablehlo::MinOp>,
-                   CSE<stablehlo::ConcatenateOp>, CSE<stablehlo::MaxOp>,
-                   CSE<stablehlo::NegOp>>(context, PatternBenefit(65000));
-    }
-
     if (passses & 256)
       patterns.add<TransposeConvert>(context);
 
@@ -6526,18 +6742,117 @@ struct EnzymeHLOOptPass : public EnzymeHLOOptPassBase<EnzymeHLOOptPass> {
              RealOpCanon, ImagOpCanon, GetDimensionSizeOpCanon, GatherOpCanon,
              ReshapeOpCanon, MergeConsecutiveReshapes, TransposeIsReshape,
              ZeroExtentTensorCanon, ReorderElementwiseAndShapeOp>(context);
-    patterns.add<SelectOpCanon>(max_constant_expansion, context,
+    // Constant selects still fold through vectors of Attributes, so they keep
+    // a lower limit than the patterns folding natively.
+    patterns.add<SelectOpCanon>(max_select_constant_expansion, context,
                                 PatternBenefit(65000));
     patterns.add<ConcatenateOpCanon>(max_constant_expansion, context,
                                      PatternBenefit(65000));
+  }
 
+  // Drives the rewrite of root one iteration at a time so that the number of
+  // iterations and whether a fixpoint was reached can be reported. Each call
+  // stops early and succeeds once an iteration changes nothing. With cse,
+  // redundant operations are value numbered away before each one. A positive
+  // maxOps gives up once root holds more operations than that.
+  LogicalResult runGreedy(Operation *root,
+                          const FrozenRewritePatternSet &patterns,
+                          bool topDown, int64_t maxOps = 0) {
     GreedyRewriteConfig config;
-    config.maxIterations = max_iterations;
-    config.useTopDownTraversal = top_down;
-    if (failed(applyPatternsAndFoldGreedily(getOperation(), std::move(patterns),
-                                            config))) {
-      signalPassFailure();
+    config.maxIterations = 1;
+    config.useTopDownTraversal = topDown;
+    for (int64_t iteration = 0;
+         max_iterations == GreedyRewriteConfig::kNoLimit ||
+         iteration < max_iterations;
+         iteration++) {
+      num_iterations++;
+      size_t eliminated = cse ? eliminateRedundantStablehloOps(root) : 0;
+      num_gvn_eliminated += eliminated;
+      if (succeeded(applyPatternsAndFoldGreedily(root, patterns, config)) &&
+          eliminated == 0)
+        return success();
+      if (maxOps > 0) {
+        int64_t numOps = 0;
+        root->walk([&](Operation *) { numOps++; });
+        if (numOps > maxOps)
+          return failure();
+      }
     }
+    return failure();
+  }
+
+  void runOnOperation() override {
+    if (try_orders) {
+      tryOrders();
+      return;
+    }
+    if (succeeded(runGreedy(getOperation(), *frozen, top_down))) {
+      num_converged++;
+      return;
+    }
+    num_not_converged++;
+    signalPassFailure();
+  }
+
+  // Rewrites copies of the operation in four fixed orders, and keeps the copy
+  // that reached a fixpoint with the lowest modeled cost. Each order is a
+  // sequence of phases, each run to a fixpoint with a set of patterns and a
+  // traversal direction.
+  void tryOrders() {
+    using Clock = std::chrono::steady_clock;
+    auto deadline =
+        Clock::now() + std::chrono::milliseconds(int64_t(try_orders_time_ms));
+    using Phase = std::pair<const FrozenRewritePatternSet *, bool>;
+    SmallVector<SmallVector<Phase, 2>> orders = {
+        {{frozen.get(), top_down}},
+        {{frozen.get(), !top_down}},
+        {{frozenNoReorder.get(), top_down}, {frozen.get(), top_down}},
+        {{frozenNoReorder.get(), !top_down}, {frozen.get(), !top_down}},
+    };
+
+    Operation *root = getOperation();
+    Operation *best = nullptr;
+    size_t bestIndex = 0;
+    double bestTime = 0;
+    for (auto en : llvm::enumerate(orders)) {
+      // The default order always runs, without a size limit, so that
+      // try_orders fails only where the default driver would.
+      bool isDefault = en.index() == 0;
+      if (!isDefault && Clock::now() > deadline)
+        break;
+      num_orders_tried++;
+      Operation *candidate = root->clone();
+      int64_t maxOps = isDefault ? int64_t(0) : int64_t(try_orders_max_ops);
+      bool converged = llvm::all_of(en.value(), [&](Phase phase) {
+        return succeeded(
+            runGreedy(candidate, *phase.first, phase.second, maxOps));
+      });
+      double time = estimateProgramCost(candidate).time;
+      if (!converged || (best && time >= bestTime)) {
+        candidate->erase();
+        continue;
+      }
+      if (best)
+        best->erase();
+      best = candidate;
+      bestIndex = en.index();
+      bestTime = time;
+    }
+
+    // Like without try_orders, a run counts once, whatever the number of
+    // orders.
+    if (!best) {
+      num_not_converged++;
+      signalPassFailure();
+      return;
+    }
+    num_converged++;
+    if (bestIndex != 0)
+      num_orders_improved++;
+    for (auto &&[region, bestRegion] :
+         llvm::zip(root->getRegions(), best->getRegions()))
+      region.takeBody(bestRegion);
+    best->erase();
   }
 };
 
@@ -0,0 +1,72 @@
+//===- PassCounter.cpp - Counters of pass runs ---------------------------- //
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the counters that passes keep for instrumented
+// pipelines.
+//===----------------------------------------------------------------------===//
+
+#include "src/enzyme_ad/jax/Passes/PassCounter.h"
+
+#include "llvm/ADT/DenseMap.h"
+
+#include <mutex>
+#include <vector>
+
+using namespace mlir;
+using namespace mlir::enzyme;
+
+namespace {
+
+// Counters are declared at namespace scope, so they register while the
+// library is loaded and stay registered until it is unloaded.
+struct Registry {
+  std::mutex mutex;
+  std::vector<const PassCounter *> counters;
+};
+
+Registry &getRegistry() {
+  static Registry registry;
+  return registry;
+}
+
+llvm::DenseMap<const PassCounter *, uint64_t> &getThreadValues() {
+  static thread_local llvm::DenseMap<const PassCounter *, uint64_t> values;
+  return values;
+}
+
+} // namespace
+
+PassCounter::PassCounter(const char *pass, const char *name,
+                         const char *description)
+    : pass(pass), name(name), description(description) {
+  Registry &registry = getRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.counters.push_back(this);
+}
+
+PassCounter &PassCounter::operator+=(uint64_t amount) {
+  getThreadValues()[this] += amount;
+  return *this;
+}
+
+uint64_t PassCounter::getValue() const {
+  auto &values = getThreadValues();
+  auto found = values.find(this);
+  return found == values.end() ? 0 : found->second;
+}
+
+llvm::SmallVector<const PassCounter *>
+PassCounter::forPass(llvm::StringRef pass) {
+  Registry &registry = getRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  llvm::SmallVector<const PassCounter *> result;
+  for (const PassCounter *counter : registry.counters)
+    if (counter->getPass() == pass)
+      result.push_back(counter);
+  return result;
+}
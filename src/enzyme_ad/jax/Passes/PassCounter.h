@@ -0,0 +1,61 @@
+//===- PassCounter.h - Counters of pass runs --------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Counters that passes bump as they run, such as the number of greedy
+// iterations of enzyme-hlo-opt, and that instrumented pipelines report per
+// pass.
+//
+// Pass statistics do nothing in builds without assertions, which include the
+// released wheels, so they cannot back a report. Counters always count. They
+// are declared once per pass, next to it, and are kept per thread: a pass runs
+// on the thread that runs its instrumentation, so the difference of a counter
+// around a run is the count of that run alone.
+//===----------------------------------------------------------------------===//
+
+#ifndef ENZYMEXLA_PASSCOUNTER_H
+#define ENZYMEXLA_PASSCOUNTER_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+
+namespace mlir {
+namespace enzyme {
+
+class PassCounter {
+public:
+  // pass is the argument of the pass the counter belongs to.
+  PassCounter(const char *pass, const char *name, const char *description);
+  PassCounter(const PassCounter &) = delete;
+  PassCounter &operator=(const PassCounter &) = delete;
+
+  PassCounter &operator+=(uint64_t amount);
+  void operator++(int) { *this += 1; }
+
+  // The count on the calling thread.
+  uint64_t getValue() const;
+
+  llvm::StringRef getPass() const { return pass; }
+  llvm::StringRef getName() const { return name; }
+  llvm::StringRef getDescription() const { return description; }
+
+  // The counters of the pass with the given argument, in the order they were
+  // declared.
+  static llvm::SmallVector<const PassCounter *> forPass(llvm::StringRef pass);
+
+private:
+  const char *pass;
+  const char *name;
+  const char *description;
+};
+
+} // namespace enzyme
+} // namespace mlir
+
+#endif // ENZYMEXLA_PASSCOUNTER_H
@@ -20,7 +20,13 @@ namespace enzyme {
 std::unique_ptr<Pass> createArithRaisingPass();
 std::unique_ptr<Pass> createEnzymeHLOOptPass();
 std::unique_ptr<Pass> createEnzymeHLOUnrollPass();
+std::unique_ptr<Pass> createEnzymeHLOGVNPass();
+std::unique_ptr<Pass> createEnzymeHLOTransposePropagationPass();
 std::unique_ptr<Pass> createPrintPass();
+
+// Replaces every pure stablehlo operation nested in root with an equivalent
+// operation that dominates it, and returns the number of operations erased.
+size_t eliminateRedundantStablehloOps(Operation *root);
 } // namespace enzyme
 } // namespace mlir
 
@@ -81,5 +87,7 @@ static void regsiterenzymeXLAPasses() {
   registerPrintPass();
   registerEnzymeHLOOptPass();
   registerEnzymeHLOUnrollPass();
+  registerEnzymeHLOGVNPass();
+  registerEnzymeHLOTransposePropagationPass();
 }
 #endif // ENZYMEXLA_PASSES_H
@@ -38,6 +38,11 @@ void ApplyBroadcastInDimSimplifyPatterns::populatePatterns(
   addBroadcastInDimSimplify(patterns, getParameter(), *getContext(),
                             PatternBenefit(getBenefit().value_or(1)));
 }
+void ApplyDotGeneralConstPropPatterns::populatePatterns(
+    RewritePatternSet &patterns) {
+  addDotGeneralConstProp(patterns, getParameter(), *getContext(),
+                         PatternBenefit(getBenefit().value_or(1)));
+}
 void ConcatenateOpCanonPatterns::populatePatterns(RewritePatternSet &patterns) {
   addConcatenateOpCanon(patterns, getParameter(), *getContext(),
                         PatternBenefit(getBenefit().value_or(1)));
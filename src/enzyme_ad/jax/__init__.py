@@ -1,5 +1,6 @@
 from enzyme_ad.jax.primitives import (
     cpp_call,
+    ShapeBuckets,
     enzyme_jax_ir,
     NewXLAPipeline,
     OldXLAPipeline,
@@ -7,4 +8,5 @@ from enzyme_ad.jax.primitives import (
     optimize_module,
     export,
     hlo_opts,
+    kernel_group,
 )
@@ -14,8 +14,20 @@
 #include "xla/service/local_service_utils.h"
 
 #include "absl/status/statusor.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ThreadPool.h"
 
+#include <chrono>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+
+#include "mlir/Bytecode/BytecodeWriter.h"
+#include "mlir/IR/AttrTypeSubElements.h"
 #include "mlir/Dialect/Arith/IR/Arith.h"
 #include "mlir/Dialect/Complex/IR/Complex.h"
 #include "mlir/Dialect/Func/IR/FuncOps.h"
@@ -47,6 +59,8 @@
 #include "Enzyme/MLIR/Implementations/CoreDialectsAutoDiffImplementations.h"
 #include "Implementations/XLADerivatives.h"
 #include "TransformOps/TransformOps.h"
+#include "src/enzyme_ad/jax/Passes/ConstantFolding.h"
+#include "src/enzyme_ad/jax/Passes/PassCounter.h"
 
 #include "mlir/Dialect/Func/Extensions/InlinerExtension.h"
 
@@ -60,6 +74,175 @@ void prepareRegistry(mlir::DialectRegistry &registry) {
   mlir::func::registerInlinerExtension(registry);
 }
 
+static mlir::DialectRegistry &sharedRegistry() {
+  static mlir::DialectRegistry *registry = []() {
+    auto *registry = new mlir::DialectRegistry();
+    prepareRegistry(*registry);
+    return registry;
+  }();
+  return *registry;
+}
+
+// A pass manager with a parsed pipeline. Passes build their pattern sets when
+// the pass manager is first run, so reusing it skips both pipeline parsing and
+// pattern construction. The mutex serializes runs of the same pass manager.
+struct CachedPipeline {
+  std::mutex mutex;
+  mlir::PassManager pm;
+
+  explicit CachedPipeline(mlir::MLIRContext *context) : pm(context) {}
+};
+
+static std::mutex pipeline_cache_mutex;
+static std::map<std::pair<mlir::MLIRContext *, std::string>,
+                std::unique_ptr<CachedPipeline>> &
+pipelineCache() {
+  static auto *cache =
+      new std::map<std::pair<mlir::MLIRContext *, std::string>,
+                   std::unique_ptr<CachedPipeline>>();
+  return *cache;
+}
+
+// Drops the pass managers built for context, which must happen before the
+// context is destroyed.
+static void dropCachedPipelines(mlir::MLIRContext *context) {
+  std::lock_guard<std::mutex> lock(pipeline_cache_mutex);
+  auto &cache = pipelineCache();
+  auto it = cache.lower_bound({context, ""});
+  while (it != cache.end() && it->first.first == context)
+    it = cache.erase(it);
+}
+
+// Returns the pass manager for pipeline in context, calling build to populate
+// a new one on first use. The key only needs to identify what build adds. If
+// build throws, nothing is cached.
+static CachedPipeline &
+cachedPipeline(mlir::MLIRContext *context, llvm::StringRef key,
+               llvm::function_ref<void(mlir::PassManager &)> build) {
+  std::lock_guard<std::mutex> lock(pipeline_cache_mutex);
+  auto &entry = pipelineCache()[{context, key.str()}];
+  if (!entry) {
+    auto pipeline = std::make_unique<CachedPipeline>(context);
+    build(pipeline->pm);
+    entry = std::move(pipeline);
+  }
+  return *entry;
+}
+
+// Contexts owned by Python are kept alive while pipelines are cached for them,
+// since their address could otherwise be reused by a new context. Only the
+// most recent few are kept to bound the memory pinned this way.
+static constexpr size_t kPinnedContexts = 4;
+
+static void pinContext(mlir::MLIRContext *context, pybind11::object owner) {
+  static auto *pinned =
+      new std::deque<std::pair<mlir::MLIRContext *, pybind11::object>>();
+  for (auto &entry : *pinned)
+    if (entry.first == context)
+      return;
+  if (pinned->size() == kPinnedContexts) {
+    dropCachedPipelines(pinned->front().first);
+    pinned->pop_front();
+  }
+  pinned->emplace_back(context, std::move(owner));
+}
+
+static void parsePipelineInto(mlir::PassManager &pm, llvm::StringRef pipeline,
+                              llvm::StringRef what) {
+  std::string error_message;
+  llvm::raw_string_ostream error_stream(error_message);
+  error_stream << what;
+  if (mlir::failed(mlir::parsePassPipeline(pipeline, pm, error_stream)))
+    throw pybind11::value_error(error_stream.str());
+}
+
+// Number of modules parsed into a context before it is replaced, which bounds
+// the memory held by its type and attribute uniquers.
+static constexpr unsigned kContextUses = 32;
+
+// A thread's MLIR context. Pipelines cached for it are dropped with it, also
+// when the thread exits, so that a later context at the same address does not
+// pick them up.
+struct ThreadContext {
+  std::unique_ptr<mlir::MLIRContext> context;
+  unsigned uses = 0;
+
+  void reset() {
+    if (context)
+      dropCachedPipelines(context.get());
+    context = nullptr;
+  }
+
+  ~ThreadContext() { reset(); }
+};
+
+static void loadHLODialects(mlir::MLIRContext &context) {
+  context.loadDialect<mlir::arith::ArithDialect>();
+  context.loadDialect<mlir::complex::ComplexDialect>();
+  context.loadDialect<mlir::tensor::TensorDialect>();
+  context.loadDialect<mlir::func::FuncDialect>();
+  context.loadDialect<mlir::mhlo::MhloDialect>();
+  context.loadDialect<mlir::stablehlo::StablehloDialect>();
+  context.loadDialect<mlir::chlo::ChloDialect>();
+}
+
+// Returns this thread's MLIR context with the HLO dialects loaded. Contexts are
+// kept warm across calls and share one thread pool. Anything created in the
+// context must be destroyed before the next call on the same thread.
+static mlir::MLIRContext &acquireContext() {
+  static llvm::DefaultThreadPool *threadPool = new llvm::DefaultThreadPool();
+  thread_local ThreadContext holder;
+  auto &context = holder.context;
+  auto &uses = holder.uses;
+  if (!context || uses == kContextUses) {
+    holder.reset();
+    context = std::make_unique<mlir::MLIRContext>(
+        sharedRegistry(), mlir::MLIRContext::Threading::DISABLED);
+    context->setThreadPool(*threadPool);
+    loadHLODialects(*context);
+    uses = 0;
+  }
+  uses++;
+  return *context;
+}
+
+// Parses source into context. Dense constants are uniqued in their context for
+// its whole lifetime, so the large constants of a long source are read in a
+// scratch context first and handed over as resource blobs, which the constant
+// folder shares across the modules parsed into the same context.
+static mlir::OwningOpRef<mlir::ModuleOp>
+parseModule(llvm::StringRef source, mlir::MLIRContext &context) {
+  using namespace mlir;
+  if (source.size() >= enzyme::constfold::kBlobMinBytes) {
+    MLIRContext scratch(sharedRegistry(), MLIRContext::Threading::DISABLED);
+    loadHLODialects(scratch);
+    ParserConfig scratch_config(&scratch);
+    OwningOpRef<ModuleOp> module =
+        parseSourceString<ModuleOp>(source, scratch_config);
+    if (!module)
+      return nullptr;
+    if (enzyme::constfold::constantsToBlobs(
+            *module, enzyme::constfold::kBlobMinBytes) != 0) {
+      std::string bytecode;
+      llvm::raw_string_ostream ss(bytecode);
+      if (failed(writeBytecodeToFile(*module, ss)))
+        return nullptr;
+      ParserConfig parser_config(&context);
+      OwningOpRef<ModuleOp> parsed =
+          parseSourceString<ModuleOp>(ss.str(), parser_config);
+      if (parsed)
+        enzyme::constfold::internBlobs(*parsed);
+      return parsed;
+    }
+  }
+  ParserConfig parser_config(&context);
+  OwningOpRef<ModuleOp> parsed =
+      parseSourceString<ModuleOp>(source, parser_config);
+  if (parsed)
+    enzyme::constfold::internBlobs(*parsed);
+  return parsed;
+}
+
 /// Returns an unused symbol in `module` for `oldSymbolName` by trying numeric
 /// suffix in `lastUsedID`.
 static mlir::StringAttr renameSymbol(llvm::StringRef oldSymName,
@@ -106,82 +289,187 @@ updateSymbolAndAllUses(mlir::SymbolOpInterface op, mlir::ModuleOp target,
   return success();
 }
 
-void run_pass_pipeline(mlir::Operation *mod, const std::string &pass_pipeline) {
+namespace {
+// Aggregates wall time, operation counts and counter increments per pass and
+// anchor operation, in the order passes first ran. Counters always count. Pass
+// statistics, which upstream passes such as canonicalize and cse keep, only
+// count when LLVM_ENABLE_STATS is set, so they are reported in those builds.
+class RecordingInstrumentation : public mlir::PassInstrumentation {
+public:
+  explicit RecordingInstrumentation(
+      std::vector<PassInstrumentationRecord> &records)
+      : records(records) {}
+
+  void runBeforePass(mlir::Pass *pass, mlir::Operation *op) override {
+    Pending entry;
+    entry.ops = countOps(op);
+    for (auto *counter : mlir::enzyme::PassCounter::forPass(
+             pass->getArgument()))
+      entry.stats.push_back(counter->getValue());
+#if LLVM_ENABLE_STATS
+    for (auto *stat : pass->getStatistics())
+      entry.stats.push_back(stat->getValue());
+#endif
+    entry.start = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    pending[pass] = std::move(entry);
+  }
+
+  void runAfterPass(mlir::Pass *pass, mlir::Operation *op) override {
+    finish(pass, op);
+  }
+
+  void runAfterPassFailed(mlir::Pass *pass, mlir::Operation *op) override {
+    finish(pass, op);
+  }
+
+private:
+  struct Pending {
+    std::chrono::steady_clock::time_point start;
+    size_t ops;
+    llvm::SmallVector<uint64_t> stats;
+  };
+
+  static size_t countOps(mlir::Operation *op) {
+    size_t count = 0;
+    op->walk([&](mlir::Operation *) { count++; });
+    return count;
+  }
+
+  void finish(mlir::Pass *pass, mlir::Operation *op) {
+    auto end = std::chrono::steady_clock::now();
+    size_t ops = countOps(op);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = pending.find(pass);
+    if (found == pending.end())
+      return;
+    Pending entry = std::move(found->second);
+    pending.erase(found);
+
+    llvm::StringRef name = pass->getArgument();
+    if (name.empty())
+      name = pass->getName();
+    std::string key = (name + "@" + op->getName().getStringRef()).str();
+    auto [it, inserted] = index.try_emplace(key, records.size());
+    if (inserted) {
+      records.emplace_back();
+      records.back().pass = name.str();
+      records.back().op = op->getName().getStringRef().str();
+    }
+    PassInstrumentationRecord &record = records[it->second];
+    record.runs++;
+    record.seconds +=
+        std::chrono::duration<double>(end - entry.start).count();
+    record.ops_before += entry.ops;
+    record.ops_after += ops;
+
+    // Counters come first, then pass statistics, in the order they were
+    // read before the run.
+    size_t i = 0;
+    for (auto *counter :
+         mlir::enzyme::PassCounter::forPass(pass->getArgument())) {
+      addStatistic(record, counter->getName(),
+                   counter->getValue() - entry.stats[i++]);
+    }
+#if LLVM_ENABLE_STATS
+    for (auto *stat : pass->getStatistics())
+      addStatistic(record, stat->getName(),
+                   stat->getValue() - entry.stats[i++]);
+#endif
+  }
+
+  static void addStatistic(PassInstrumentationRecord &record,
+                           llvm::StringRef name, uint64_t amount) {
+    for (auto &[existing, value] : record.statistics) {
+      if (existing == name) {
+        value += amount;
+        return;
+      }
+    }
+    record.statistics.emplace_back(name.str(), amount);
+  }
+
+  std::vector<PassInstrumentationRecord> &records;
+  std::mutex mutex;
+  llvm::DenseMap<mlir::Pass *, Pending> pending;
+  llvm::StringMap<size_t> index;
+};
+} // namespace
+
+// Runs pass_pipeline on mod, reporting failures and the diagnostics emitted
+// along the way as value errors. Instrumentations cannot be removed from a
+// pass manager, so instrumented runs never use the cache.
+static void runPipeline(mlir::ModuleOp mod, const std::string &pass_pipeline,
+                        llvm::StringRef parse_error, bool cache,
+                        std::vector<PassInstrumentationRecord> *records) {
   using namespace llvm;
   using namespace mlir;
 
-  mlir::DialectRegistry registry;
-  prepareRegistry(registry);
-  mod->getContext()->appendDialectRegistry(registry);
+  MLIRContext *context = mod->getContext();
+  auto build = [&](PassManager &pm) {
+    parsePipelineInto(pm, pass_pipeline, parse_error);
+  };
+  std::optional<PassManager> uncached;
+  PassManager *pm;
+  std::unique_lock<std::mutex> lock;
+  if (!cache || records) {
+    uncached.emplace(context);
+    build(*uncached);
+    if (records)
+      uncached->addInstrumentation(
+          std::make_unique<RecordingInstrumentation>(*records));
+    pm = &*uncached;
+  } else {
+    CachedPipeline &cached = cachedPipeline(context, pass_pipeline, build);
+    lock = std::unique_lock<std::mutex>(cached.mutex);
+    pm = &cached.pm;
+  }
 
-  mlir::PassManager pm(mod->getContext());
   std::string error_message;
   llvm::raw_string_ostream error_stream(error_message);
-  mlir::LogicalResult result =
-      mlir::parsePassPipeline(pass_pipeline, pm, error_stream);
-  if (mlir::failed(result)) {
-    throw pybind11::value_error(error_message);
-  }
-
-  DiagnosticEngine &engine = mod->getContext()->getDiagEngine();
   error_stream << "Pipeline failed:\n";
-  DiagnosticEngine::HandlerID id =
-      engine.registerHandler([&](Diagnostic &diag) -> LogicalResult {
-        error_stream << diag << "\n";
-        return failure();
-      });
-  if (!mlir::succeeded(pm.run(cast<mlir::ModuleOp>(mod)))) {
+  ScopedDiagnosticHandler handler(context,
+                                  [&](Diagnostic &diag) -> LogicalResult {
+                                    error_stream << diag << "\n";
+                                    return failure();
+                                  });
+  if (!mlir::succeeded(pm->run(mod))) {
     throw pybind11::value_error(error_stream.str());
   }
 }
 
+void run_pass_pipeline(mlir::Operation *mod, const std::string &pass_pipeline,
+                       pybind11::object context_owner,
+                       std::vector<PassInstrumentationRecord> *records) {
+  mod->getContext()->appendDialectRegistry(sharedRegistry());
+
+  bool cache = !context_owner.is_none() && !records;
+  if (cache)
+    pinContext(mod->getContext(), std::move(context_owner));
+  runPipeline(mlir::cast<mlir::ModuleOp>(mod), pass_pipeline, "", cache,
+              records);
+}
+
 std::pair<std::string, std::string>
 run_pass_pipeline(const std::vector<std::string> &oldsym_vec,
-                  const std::string &mlir, const std::string &pass_pipeline) {
+                  const std::string &mlir, const std::string &pass_pipeline,
+                  bool bytecode,
+                  std::vector<PassInstrumentationRecord> *records) {
   using namespace llvm;
   using namespace mlir;
 
   std::set<std::string> oldsyms(oldsym_vec.begin(), oldsym_vec.end());
 
   // Parse MLIR.
-  mlir::DialectRegistry registry;
-  prepareRegistry(registry);
-  MLIRContext context(registry);
-  context.loadDialect<mlir::arith::ArithDialect>();
-  context.loadDialect<mlir::complex::ComplexDialect>();
-  context.loadDialect<mlir::tensor::TensorDialect>();
-  context.loadDialect<mlir::func::FuncDialect>();
-  context.loadDialect<mlir::mhlo::MhloDialect>();
-  context.loadDialect<mlir::stablehlo::StablehloDialect>();
-  context.loadDialect<mlir::chlo::ChloDialect>();
-  mlir::ParserConfig parser_config(&context);
-  mlir::OwningOpRef<mlir::ModuleOp> parsed_module =
-      mlir::parseSourceString<mlir::ModuleOp>(mlir, parser_config);
+  MLIRContext &context = acquireContext();
+  mlir::OwningOpRef<mlir::ModuleOp> parsed_module = parseModule(mlir, context);
   if (!parsed_module) {
     throw pybind11::value_error("Failed to parse module");
   }
 
-  mlir::PassManager pm(&context);
-
-  std::string error_message;
-  llvm::raw_string_ostream error_stream(error_message);
-  error_stream << "Failed to parse pipeline\n";
-  mlir::LogicalResult result =
-      mlir::parsePassPipeline(pass_pipeline, pm, error_stream);
-  if (mlir::failed(result)) {
-    throw pybind11::value_error(error_message);
-  }
-
-  DiagnosticEngine &engine = context.getDiagEngine();
-  error_stream << "Pipeline failed:\n";
-  DiagnosticEngine::HandlerID id =
-      engine.registerHandler([&](Diagnostic &diag) -> LogicalResult {
-        error_stream << diag << "\n";
-        return failure();
-      });
-  if (!mlir::succeeded(pm.run(cast<mlir::ModuleOp>(*parsed_module)))) {
-    throw pybind11::value_error(error_stream.str());
-  }
+  runPipeline(*parsed_module, pass_pipeline, "Failed to parse pipeline\n",
+              /*cache*/ true, records);
 
   StringRef entryfn = "main";
 
@@ -209,14 +497,86 @@ run_pass_pipeline(const std::vector<std::string> &oldsym_vec,
     }
   }
 
+  // JAX hands the result to XLA, which is not known to read resource blobs.
+  enzyme::constfold::materializeBlobs(*parsed_module);
+
   std::string output;
   llvm::raw_string_ostream ss(output);
-  parsed_module->getOperation()->print(
-      ss, mlir::OpPrintingFlags().enableDebugInfo());
+  if (bytecode) {
+    if (failed(writeBytecodeToFile(parsed_module->getOperation(), ss)))
+      throw pybind11::value_error("failed to write bytecode");
+  } else {
+    parsed_module->getOperation()->print(
+        ss, mlir::OpPrintingFlags().enableDebugInfo());
+  }
 
   return std::make_pair(entryfn.str(), ss.str());
 }
 
+std::string inject_module(mlir::Operation *target, mlir::Operation *source) {
+  using namespace llvm;
+  using namespace mlir;
+
+  auto targetMod = cast<ModuleOp>(target);
+  auto sourceMod = cast<ModuleOp>(source);
+  MLIRContext *ctx = target->getContext();
+  if (source->getContext() != ctx)
+    throw pybind11::value_error("modules must share a context to be merged");
+
+  // Reserve every name on both sides up front so that a fresh name never
+  // collides with a symbol that has not been visited yet.
+  std::set<std::string> usedsyms;
+  for (auto &op : *targetMod.getBody())
+    if (auto symbolOp = dyn_cast<SymbolOpInterface>(op))
+      usedsyms.insert(symbolOp.getName().str());
+  SmallVector<SymbolOpInterface> clashing;
+  for (auto &op : *sourceMod.getBody()) {
+    auto symbolOp = dyn_cast<SymbolOpInterface>(op);
+    if (!symbolOp)
+      continue;
+    if (!usedsyms.insert(symbolOp.getName().str()).second)
+      clashing.push_back(symbolOp);
+  }
+
+  StringAttr entryfn = StringAttr::get(ctx, "main");
+  unsigned lastUsedID = 0;
+  DenseMap<StringAttr, StringAttr> renames;
+  for (auto symbolOp : clashing) {
+    StringAttr newSymName =
+        renameSymbol(symbolOp.getName(), lastUsedID, usedsyms, ctx);
+    renames[symbolOp.getNameAttr()] = newSymName;
+  }
+  if (auto it = renames.find(entryfn); it != renames.end())
+    entryfn = it->second;
+
+  // Rewrite all references in a single walk rather than one walk per renamed
+  // symbol.
+  if (!renames.empty()) {
+    AttrTypeReplacer replacer;
+    replacer.addReplacement([&](SymbolRefAttr ref) -> std::optional<Attribute> {
+      auto it = renames.find(ref.getRootReference());
+      if (it == renames.end())
+        return std::nullopt;
+      return SymbolRefAttr::get(it->second, ref.getNestedReferences());
+    });
+    replacer.recursivelyReplaceElementsIn(source, /*replaceAttrs=*/true,
+                                          /*replaceLocs=*/false,
+                                          /*replaceTypes=*/false);
+    for (auto symbolOp : clashing)
+      SymbolTable::setSymbolName(symbolOp,
+                                 renames.lookup(symbolOp.getNameAttr()));
+  }
+
+  for (auto &op : *sourceMod.getBody())
+    if (auto symbolOp = dyn_cast<SymbolOpInterface>(op))
+      if (symbolOp.getNameAttr() == entryfn)
+        SymbolTable::setSymbolVisibility(&op, SymbolTable::Visibility::Private);
+
+  targetMod.getBody()->getOperations().splice(
+      targetMod.getBody()->end(), sourceMod.getBody()->getOperations());
+  return entryfn.str();
+}
+
 absl::StatusOr<std::unique_ptr<xla::Executable>>
 RunBackend(xla::cpu::CpuCompiler *self, std::unique_ptr<xla::HloModule> module,
            [[maybe_unused]] xla::se::StreamExecutor *stream_exec,
@@ -292,55 +652,77 @@ BuildExecutable(xla::Service *self, const xla::HloModuleProto &module_proto,
   return std::move(executable);
 }
 
+// HLO simplification passes, by their HloPassInterface::name(), that
+// minimal_hlo disables for modules already simplified in MLIR. This is a
+// denylist rather than a list of the passes the CPU backend needs: the
+// expanders, rewriters and layout passes the emitter relies on vary across XLA
+// versions, and leaving one out would make the emitter fail or mis-lower. A
+// name here that does not match a pass of the pinned XLA only means that the
+// pass keeps running, which unknown_simplification_hlo_passes() detects. None
+// of these passes is required for correctness.
+static constexpr const char *kSimplificationCpuHloPasses[] = {
+    "algsimp",
+    "cse",
+    "constant_folding",
+    "simplify-while-loops",
+    "while-loop-constant-sinking",
+    "while-loop-invariant-code-motion",
+    "simplify-conditional",
+    "simplify-sorts",
+    "reshape-mover",
+    "transpose-folding",
+    "tuple-simplifier",
+    "gather_simplifier",
+    "scatter_simplifier",
+};
+
 // Compile an MHLO module given as a string to LLVM IR using XLA.
-std::unique_ptr<xla::LocalExecutable>
-compile_mhlo_to_llvm_with_xla(llvm::StringRef mhlo_text, std::string &output,
-                              bool xla_runtime,
-                              const std::string &pass_pipeline) {
+static std::unique_ptr<xla::LocalExecutable>
+compile_uncached(llvm::StringRef mhlo_text, std::string &output,
+                 bool xla_runtime, const std::string &pass_pipeline,
+                 bool hlo_profile, bool ir_only, bool minimal_hlo) {
   // Parse MLIR.
-  mlir::DialectRegistry registry;
-  prepareRegistry(registry);
-  mlir::MLIRContext context(registry);
-  context.loadDialect<mlir::arith::ArithDialect>();
-  context.loadDialect<mlir::complex::ComplexDialect>();
-  context.loadDialect<mlir::tensor::TensorDialect>();
-  context.loadDialect<mlir::func::FuncDialect>();
-  context.loadDialect<mlir::mhlo::MhloDialect>();
-  context.loadDialect<mlir::stablehlo::StablehloDialect>();
-  context.loadDialect<mlir::chlo::ChloDialect>();
-  mlir::ParserConfig parser_config(&context);
+  mlir::MLIRContext &context = acquireContext();
   mlir::OwningOpRef<mlir::ModuleOp> parsed_module =
-      mlir::parseSourceString<mlir::ModuleOp>(mhlo_text, parser_config);
+      parseModule(mhlo_text, context);
   if (!parsed_module) {
     throw pybind11::value_error("Failed to parse module");
   }
 
   llvm::StringRef cur_pipeline = pass_pipeline;
 
-  mlir::PassManager pm(&context);
-  if (!xla_runtime) {
-    pm.addPass(mlir::mhlo::createStablehloLegalizeToHloPass());
-  } else {
+  // The key of the default legalization cannot be a valid pipeline, so it
+  // never aliases a parsed one.
+  std::string pre = "<stablehlo-legalize-to-hlo>";
+  if (xla_runtime) {
     std::string tofind = "stablehlo-legalize-to-hlo,";
     auto pos = llvm::StringRef(pass_pipeline).find(tofind);
     assert(pos != std::string::npos);
-    auto pre = llvm::StringRef(pass_pipeline.data(), pos + tofind.size() - 1);
+    pre = pass_pipeline.substr(0, pos + tofind.size() - 1);
     cur_pipeline = llvm::StringRef(pass_pipeline.data() + pos + tofind.size(),
                                    pass_pipeline.size() - pos - tofind.size());
-
-    std::string error_message;
-    llvm::raw_string_ostream error_stream(error_message);
-    error_stream << "Failed to parse pre stablehlo pipeline\n";
-    mlir::LogicalResult result = mlir::parsePassPipeline(pre, pm, error_stream);
-    if (mlir::failed(result)) {
-      throw pybind11::value_error(error_message);
-    }
+  } else if (!pass_pipeline.empty()) {
+    // Without the XLA runtime, the pipeline runs on the StableHLO module
+    // before it is handed to XLA.
+    pre = pass_pipeline + ",stablehlo-legalize-to-hlo";
+    cur_pipeline = "";
   }
-  if (!mlir::succeeded(pm.run(*parsed_module))) {
+  CachedPipeline &cached =
+      cachedPipeline(&context, pre, [&](mlir::PassManager &pm) {
+        if (!xla_runtime && pass_pipeline.empty())
+          pm.addPass(mlir::mhlo::createStablehloLegalizeToHloPass());
+        else
+          parsePipelineInto(pm, pre,
+                            "Failed to parse pre stablehlo pipeline\n");
+      });
+  std::lock_guard<std::mutex> lock(cached.mutex);
+  if (!mlir::succeeded(cached.pm.run(*parsed_module))) {
     throw pybind11::value_error("StableHLO => MHLO failed");
   }
 
-  // Convert to XLA Computation.
+  // Convert to XLA Computation. The exporter is not known to read resource
+  // blobs, so they become dense constants again first.
+  mlir::enzyme::constfold::materializeBlobs(*parsed_module);
   xla::HloProto hlo_proto;
   mlir::ConvertMlirHloToHlo(*parsed_module, &hlo_proto,
                             /*use_tuple_args=*/false, /*return_tuple=*/false);
@@ -391,6 +773,19 @@ compile_mhlo_to_llvm_with_xla(llvm::StringRef mhlo_text, std::string &output,
   xla::ExecutableBuildOptions build_options;
   build_options.mutable_debug_options()->set_xla_embed_ir_in_executable(true);
   build_options.mutable_debug_options()->set_xla_cpu_use_thunk_runtime(false);
+  build_options.mutable_debug_options()->set_xla_hlo_profile(hlo_profile);
+  if (ir_only) {
+    // The IR handed back is optimized again by whoever consumes it, so spend
+    // as little time as possible in XLA's own LLVM pipeline and codegen.
+    build_options.mutable_debug_options()->set_xla_backend_optimization_level(
+        0);
+    build_options.mutable_debug_options()
+        ->set_xla_llvm_disable_expensive_passes(true);
+  }
+  if (minimal_hlo) {
+    for (const char *pass : kSimplificationCpuHloPasses)
+      build_options.mutable_debug_options()->add_xla_disable_hlo_passes(pass);
+  }
 
   build_options.mutable_debug_options()
       ->mutable_xla_backend_extra_options()
@@ -419,7 +814,7 @@ compile_mhlo_to_llvm_with_xla(llvm::StringRef mhlo_text, std::string &output,
   xla::Compiler::CompileOptions opts = {
       build_options.device_allocator(), build_options.compile_thread_pool(),
       build_options.layout_canonicalization_callback()};
-  opts.registry = &registry;
+  opts.registry = &sharedRegistry();
   auto executable =
       BuildExecutable(local_client->local_service(), xla_computation.proto(),
                       std::move(module_config_or_error.value()),
@@ -439,3 +834,84 @@ compile_mhlo_to_llvm_with_xla(llvm::StringRef mhlo_text, std::string &output,
   output = cpu_executable->ir_module_string();
   return std::move(local_executable);
 }
+
+namespace {
+struct CompiledModule {
+  std::shared_ptr<xla::LocalExecutable> executable;
+  std::string ir;
+  // Position of the key in compile_cache_order.
+  std::list<llvm::StringRef>::iterator order;
+};
+} // namespace
+
+// Tape and temporary sizes and every kernel of a gradient compile the same
+// module, so compiled modules are kept keyed by their text and options. Only
+// the most recently used are kept, since each holds an executable and its IR.
+static constexpr size_t kCompileCacheEntries = 16;
+static std::mutex compile_cache_mutex;
+static llvm::StringMap<CompiledModule> compile_cache;
+// Keys of compile_cache, most recently used first.
+static std::list<llvm::StringRef> compile_cache_order;
+
+std::shared_ptr<xla::LocalExecutable>
+compile_mhlo_to_llvm_with_xla(llvm::StringRef mhlo_text, std::string &output,
+                              bool xla_runtime,
+                              const std::string &pass_pipeline,
+                              bool hlo_profile, bool ir_only,
+                              bool minimal_hlo) {
+  std::string key;
+  llvm::raw_string_ostream ks(key);
+  ks << xla_runtime << hlo_profile << ir_only << minimal_hlo << pass_pipeline
+     << '\0' << mhlo_text;
+  {
+    std::lock_guard<std::mutex> lock(compile_cache_mutex);
+    auto found = compile_cache.find(key);
+    if (found != compile_cache.end()) {
+      compile_cache_order.splice(compile_cache_order.begin(),
+                                 compile_cache_order, found->second.order);
+      output = found->second.ir;
+      return found->second.executable;
+    }
+  }
+
+  std::shared_ptr<xla::LocalExecutable> executable =
+      compile_uncached(mhlo_text, output, xla_runtime, pass_pipeline,
+                       hlo_profile, ir_only, minimal_hlo);
+  std::lock_guard<std::mutex> lock(compile_cache_mutex);
+  auto [it, inserted] =
+      compile_cache.try_emplace(key, CompiledModule{executable, output, {}});
+  if (!inserted)
+    return executable;
+  compile_cache_order.push_front(it->getKey());
+  it->second.order = compile_cache_order.begin();
+  if (compile_cache.size() > kCompileCacheEntries) {
+    compile_cache.erase(compile_cache_order.back());
+    compile_cache_order.pop_back();
+  }
+  return executable;
+}
+
+std::vector<std::string> unknown_simplification_hlo_passes() {
+  // XLA records every pass it runs in the module metadata, whether or not the
+  // pass changed the module, so any module shows the whole pipeline.
+  static constexpr const char *source = R"(
+    func.func @main(%x : tensor<3xf32>) -> tensor<3xf32> {
+      %y = stablehlo.add %x, %x : tensor<3xf32>
+      return %y : tensor<3xf32>
+    }
+  )";
+  std::string llvm_ir;
+  auto executable = compile_uncached(
+      source, llvm_ir, /*xla_runtime*/ false, /*pass_pipeline*/ "",
+      /*hlo_profile*/ false, /*ir_only*/ true, /*minimal_hlo*/ false);
+  std::set<std::string> ran;
+  auto module = executable->executable()->shared_module();
+  for (const auto &pass : module->metadata()->proto().pass_metadata())
+    ran.insert(pass.pass_name());
+
+  std::vector<std::string> unknown;
+  for (const char *pass : kSimplificationCpuHloPasses)
+    if (!ran.count(pass))
+      unknown.push_back(pass);
+  return unknown;
+}
@@ -1,21 +1,68 @@
 #pragma once
+#include "pybind11/pybind11.h"
 #include "xla/client/local_client.h"
 #include "llvm/ADT/StringRef.h"
 #include <memory>
-
+#include <string>
 #include <utility>
+#include <vector>
 
-// Compile an MHLO module given as a string to LLVM IR using XLA.
-std::unique_ptr<xla::LocalExecutable>
+// Compile an MHLO module given as a string to LLVM IR using XLA. With
+// hlo_profile, XLA instruments the code with per-HLO cycle counters. With
+// ir_only, the caller only uses the IR and buffer assignment, and the
+// returned executable is built without optimization and must not be run.
+// Without xla_runtime, a non-empty pass_pipeline runs on the StableHLO module
+// before XLA, where it used to be ignored, and with minimal_hlo XLA then skips
+// its HLO simplification passes while still running every lowering pass of the
+// CPU backend.
+// The most recent results are cached, so repeated requests for the same module
+// and options share one executable.
+std::shared_ptr<xla::LocalExecutable>
 compile_mhlo_to_llvm_with_xla(llvm::StringRef mhlo_text, std::string &output,
                               bool xla_runtime,
-                              const std::string &pass_pipeline);
+                              const std::string &pass_pipeline,
+                              bool hlo_profile = false, bool ir_only = false,
+                              bool minimal_hlo = false);
+
+// Returns the HLO passes that minimal_hlo disables but that the pinned XLA does
+// not run, usually because they were renamed.
+std::vector<std::string> unknown_simplification_hlo_passes();
 
+// Measurements for one pass, summed over every run on the same kind of anchor
+// operation. Operation counts include the anchor and everything nested in it.
+struct PassInstrumentationRecord {
+  std::string pass;
+  std::string op;
+  size_t runs = 0;
+  double seconds = 0;
+  size_t ops_before = 0;
+  size_t ops_after = 0;
+  std::vector<std::pair<std::string, uint64_t>> statistics;
+};
+
+// Runs pass_pipeline on a module given as text or bytecode, renaming symbols
+// that clash with oldsyms. Returns the new name of the entry function and
+// the module, as bytecode if requested and as text with debug info otherwise.
+// If records is set, every pass run is measured into it.
 std::pair<std::string, std::string>
 run_pass_pipeline(const std::vector<std::string> &oldsyms,
-                  const std::string &mlir, const std::string &pass_pipeline);
+                  const std::string &mlir, const std::string &pass_pipeline,
+                  bool bytecode = false,
+                  std::vector<PassInstrumentationRecord> *records = nullptr);
 
 namespace mlir {
 class Operation;
 }
-void run_pass_pipeline(mlir::Operation *mod, const std::string &pass_pipeline);
+// Runs pass_pipeline on mod in place. If context_owner is the Python object
+// that owns the context of mod, the parsed pass manager is cached and reused
+// by later runs of the same pipeline in that context. If records is set, every
+// pass run is measured into it.
+void run_pass_pipeline(
+    mlir::Operation *mod, const std::string &pass_pipeline,
+    pybind11::object context_owner = pybind11::none(),
+    std::vector<PassInstrumentationRecord> *records = nullptr);
+
+// Moves every operation of the module source into the module target, renaming
+// the symbols of source that clash with target in a single batched rewrite.
+// The entry function is made private and its final name is returned.
+std::string inject_module(mlir::Operation *target, mlir::Operation *source);
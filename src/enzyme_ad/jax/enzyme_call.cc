@@ -9,18 +9,27 @@
 #include "src/enzyme_ad/jax/Passes/Passes.h"
 #include "src/enzyme_ad/jax/TransformOps/TransformOps.h"
 
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <regex>
 #include <string>
+#include <thread>
 
 #include "absl/status/statusor.h"
 #include "clang_compile.h"
 #include "pybind11/pybind11.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
@@ -35,7 +44,14 @@
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Parallel.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/RWMutex.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
@@ -45,6 +61,7 @@
 #include "mlir-c/IR.h"
 #include "mlir-c/Support.h"
 #include "mlir/Bindings/Python/PybindAdaptors.h"
+#include "mlir/Bytecode/Encoding.h"
 #include "mlir/CAPI/IR.h"
 #include "mlir/InitAllPasses.h"
 #include "xla/mlir_hlo/deallocation/transforms/passes.h"
@@ -57,17 +74,153 @@
 #include "xla/hlo/ir/hlo_casting_utils.h"
 #include "xla/hlo/ir/hlo_instructions.h"
 #include "xla/service/cpu/cpu_executable.h"
+#include "xla/service/hlo_execution_profile.h"
 
 #include "Enzyme/FunctionUtils.h"
 #include "Enzyme/MLIR/Passes/Passes.h"
 
+#include "stablehlo/dialect/Version.h"
 #include "stablehlo/transforms/Passes.h"
 
 enum class ABI { Primal, Forward, Augmented, Reverse, Tape };
 
 enum class Language : int { CPP = 0, LLVM = 1, MHLO = 2 };
 
+enum class Activity : int { Const = 0, Dup = 1, DupNoNeed = 2 };
+
+// Activity of each kernel input and output in the derivative ABIs. Arguments
+// without an entry are differentiated (Dup).
+struct Activities {
+  llvm::SmallVector<Activity> ins;
+  llvm::SmallVector<Activity> outs;
+
+  Activity in(size_t i) const {
+    return i < ins.size() ? ins[i] : Activity::Dup;
+  }
+  Activity out(size_t i) const {
+    return i < outs.size() ? outs[i] : Activity::Dup;
+  }
+};
+
 namespace {
+static const char *abiName(ABI mode) {
+  switch (mode) {
+  case ABI::Primal:
+    return "primal";
+  case ABI::Forward:
+    return "fwd";
+  case ABI::Augmented:
+    return "aug";
+  case ABI::Reverse:
+    return "rev";
+  case ABI::Tape:
+    return "tape";
+  }
+  llvm_unreachable("unknown ABI");
+}
+
+// Runs a textual LLVM pass pipeline over mod.
+static void runLLVMPipeline(llvm::Module &mod, llvm::StringRef pipeline) {
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  llvm::ModulePassManager MPM;
+  if (auto err = PB.parsePassPipeline(MPM, pipeline))
+    throw pybind11::value_error("invalid LLVM pass pipeline: " +
+                                llvm::toString(std::move(err)));
+  MPM.run(mod, MAM);
+}
+
+static const char *enzymeActivity(Activity act) {
+  switch (act) {
+  case Activity::Const:
+    return "enzyme_const";
+  case Activity::Dup:
+    return "enzyme_dup";
+  case Activity::DupNoNeed:
+    return "enzyme_dupnoneed";
+  }
+  llvm_unreachable("unknown activity");
+}
+
+// Appends the functions of every object the JIT loads to /tmp/perf-<pid>.map,
+// so that perf can symbolize samples taken inside enzyme kernels. Each entry
+// is tagged with the label of the kernel being added.
+class PerfMapListener : public llvm::JITEventListener {
+public:
+  std::string label;
+
+  void notifyObjectLoaded(
+      ObjectKey K, const llvm::object::ObjectFile &Obj,
+      const llvm::RuntimeDyld::LoadedObjectInfo &L) override {
+    auto DebugObjOwner = L.getObjectForDebug(Obj);
+    const llvm::object::ObjectFile *DebugObj = DebugObjOwner.getBinary();
+    if (!DebugObj)
+      return;
+
+    std::error_code EC;
+    llvm::raw_fd_ostream os(
+        "/tmp/perf-" + std::to_string(llvm::sys::Process::getProcessId()) +
+            ".map",
+        EC, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text);
+    if (EC)
+      return;
+
+    for (const auto &P : llvm::object::computeSymbolSizes(*DebugObj)) {
+      auto Sym = P.first;
+      auto Type = Sym.getType();
+      if (!Type) {
+        llvm::consumeError(Type.takeError());
+        continue;
+      }
+      if (*Type != llvm::object::SymbolRef::ST_Function)
+        continue;
+      auto Name = Sym.getName();
+      if (!Name) {
+        llvm::consumeError(Name.takeError());
+        continue;
+      }
+      auto Addr = Sym.getAddress();
+      if (!Addr) {
+        llvm::consumeError(Addr.takeError());
+        continue;
+      }
+      os << llvm::format_hex_no_prefix(*Addr, 1) << " "
+         << llvm::format_hex_no_prefix(P.second, 1) << " " << *Name << " "
+         << label << "\n";
+    }
+  }
+};
+
+// Cycle counters written by XLA's HLO profiling instrumentation, with the
+// name of the HLO instruction or computation that owns each one.
+struct HloProfile {
+  std::unique_ptr<int64_t[]> counters;
+  std::vector<std::string> names;
+
+  static std::unique_ptr<HloProfile> create(const xla::Executable &executable) {
+    if (!executable.hlo_profiling_enabled())
+      return nullptr;
+    auto &index_map = executable.hlo_profile_index_map();
+    auto profile = std::make_unique<HloProfile>();
+    profile->counters = std::make_unique<int64_t[]>(index_map.total_count());
+    profile->names.resize(index_map.total_count());
+    for (auto &pair : index_map.instruction_to_profile_idx())
+      profile->names[pair.second] = pair.first->name();
+    for (auto &pair : index_map.computation_to_profile_idx())
+      profile->names[pair.second] = pair.first->name();
+    return profile;
+  }
+};
+
 class CpuKernel {
   // static llvm::orc::ExecutionSession ES;
   static std::unique_ptr<llvm::DataLayout> DL;
@@ -77,11 +230,89 @@ class CpuKernel {
   size_t num_out;
   uint64_t addr;
 
+  // When batch_size is non-zero the kernel was compiled for a single example
+  // and call() runs it batch_size times, advancing each output and input
+  // buffer by its stride (in bytes) per example. A stride of zero broadcasts
+  // an unbatched input to every example.
+  size_t batch_size;
+  llvm::SmallVector<size_t> out_strides;
+  llvm::SmallVector<size_t> in_strides;
+
+  // Primal MHLO kernels call the function XLA already compiled rather than
+  // recompiling its IR. Each slot describes how to fill one entry of the
+  // executable's buffer table from the kernel's outputs and inputs.
+  enum class BufferKind { None, Input, Output, Tuple, Constant };
+  struct BufferSlot {
+    BufferKind kind;
+    size_t index;
+    void *data;
+  };
+  std::shared_ptr<xla::LocalExecutable> executable;
+  llvm::SmallVector<BufferSlot> buffer_slots;
+
+  // Set when the kernel was compiled with XLA's HLO profiling enabled.
+  std::unique_ptr<HloProfile> profile;
+
+  // Everything needed to build a kernel whose compilation is deferred to its
+  // first call; null once compiled.
+  struct KernelSource {
+    std::string fn;
+    std::string source;
+    llvm::SmallVector<llvm::SmallVector<int64_t>> out_shapes;
+    llvm::SmallVector<std::string> out_names;
+    llvm::SmallVector<llvm::SmallVector<int64_t>> in_shapes;
+    llvm::SmallVector<std::string> in_names;
+    llvm::SmallVector<std::string> argv;
+    ABI mode;
+    Language lang;
+    bool xla_runtime;
+    std::string pass_pipeline;
+    bool hlo_profile;
+    bool minimal_hlo;
+    Activities activity;
+  };
+  std::unique_ptr<KernelSource> pending;
+  std::once_flag compiled;
+
+  // Kernels created between begin_kernel_group() and end_kernel_group() are
+  // linked into one module, so that they share internal functions and
+  // constants, and are JIT compiled together on first use.
+  struct KernelGroup {
+    size_t identifier;
+    std::unique_ptr<llvm::LLVMContext> ctx;
+    // Null once the group has been compiled.
+    std::unique_ptr<llvm::Module> mod;
+    llvm::SmallVector<CpuKernel *> members;
+    std::once_flag linked;
+  };
+  std::shared_ptr<KernelGroup> group;
+
 public:
   static constexpr size_t UNKNOWN_PLATFORM = 0x1000000000;
 
-  CpuKernel(int64_t identifier, size_t num_out, uint64_t addr)
-      : identifier(identifier), num_out(num_out), addr(addr) {}
+  CpuKernel(int64_t identifier, size_t num_out, uint64_t addr,
+            size_t batch_size = 0, llvm::ArrayRef<size_t> out_strides = {},
+            llvm::ArrayRef<size_t> in_strides = {})
+      : identifier(identifier), num_out(num_out), addr(addr),
+        batch_size(batch_size), out_strides(out_strides),
+        in_strides(in_strides) {}
+
+  CpuKernel(int64_t identifier, std::unique_ptr<KernelSource> pending,
+            size_t batch_size, llvm::ArrayRef<size_t> out_strides,
+            llvm::ArrayRef<size_t> in_strides)
+      : identifier(identifier), num_out(0), addr(0), batch_size(batch_size),
+        out_strides(out_strides), in_strides(in_strides),
+        pending(std::move(pending)) {}
+
+  CpuKernel(int64_t identifier, size_t num_out,
+            std::shared_ptr<xla::LocalExecutable> executable,
+            llvm::ArrayRef<BufferSlot> buffer_slots)
+      : identifier(identifier), num_out(num_out), batch_size(0),
+        executable(std::move(executable)), buffer_slots(buffer_slots) {
+    auto *cpu_executable =
+        static_cast<xla::cpu::CpuExecutable *>(this->executable->executable());
+    addr = (uint64_t)cpu_executable->compute_function();
+  }
 
   static std::string make_type(std::string typenam,
                                llvm::ArrayRef<int64_t> shape, bool constv,
@@ -94,15 +325,210 @@ public:
     return s + ">";
   }
 
+  // Returns the index of the allocation backing each of the num_out results
+  // of an XLA CPU executable.
+  static std::vector<int>
+  outputAllocations(const xla::BufferAssignment &assignment, size_t num_out) {
+    std::vector<int> out_idxs;
+    if (num_out == 1) {
+      ssize_t idx = -1;
+      for (auto &buf2 : assignment.Allocations()) {
+        if (!buf2.maybe_live_out())
+          continue;
+        assert(!buf2.is_tuple());
+        assert(idx == -1);
+        idx = buf2.index();
+      }
+      assert(idx != -1);
+      out_idxs.push_back(idx);
+      return out_idxs;
+    }
+    // If a tuple, find the tuple buf, then use that to index the
+    // outputs.
+    ssize_t tupidx = -1;
+    for (auto &buf2 : assignment.Allocations()) {
+      if (!buf2.maybe_live_out())
+        continue;
+      if (!buf2.is_tuple())
+        continue;
+      assert(tupidx == -1);
+      tupidx = buf2.index();
+    }
+    assert(tupidx != -1);
+    auto &tup_buf = assignment.Allocations()[tupidx];
+    assert(tup_buf.assigned_buffers().size() == 1);
+    auto hlo = tup_buf.assigned_buffers().begin()->first;
+    auto val = hlo->instruction();
+    assert(val->operand_count() == num_out);
+    for (size_t i = 0; i < num_out; i++) {
+      ssize_t found = -1;
+      auto operand = val->operand(i);
+      while (found == -1) {
+        for (auto &buf : assignment.Allocations()) {
+          if (!buf.maybe_live_out())
+            continue;
+          if (buf.is_tuple())
+            continue;
+          bool contains_output = false;
+          for (auto &pair : buf.assigned_buffers()) {
+            if (pair.first->instruction() != operand)
+              continue;
+            assert(!contains_output);
+            contains_output = true;
+            assert(pair.second.offset == 0);
+          }
+          if (!contains_output)
+            continue;
+          assert(found == -1);
+          found = buf.index();
+        }
+        if (operand->opcode() == xla::HloOpcode::kBitcast) {
+          operand = operand->operand(0);
+          continue;
+        }
+        break;
+      }
+      if (found == -1) {
+        llvm::errs() << "assignment: " << assignment.ToString() << "\n";
+        llvm::errs() << "val: " << val->ToString() << "\n";
+        llvm::errs() << "vop: " << val->operand(i)->ToString() << "\n";
+        llvm::errs() << "i: " << i << "\n";
+      }
+      assert(found != -1);
+      out_idxs.push_back((int)found);
+    }
+    return out_idxs;
+  }
+
+  // Enzyme may reload rather than cache a value read by an invariant load,
+  // which is only sound for memory the reverse pass sees unchanged. XLA marks
+  // the loads of buffer table slots invariant as well as the loads from
+  // read-only buffers, but of those only the kernel inputs are passed to the
+  // reverse pass, whose temp buffer is null. The metadata is kept on loads in
+  // the entry function of an entry parameter's slot, in the buffer table that
+  // is its fourth argument, and of memory based on it. Without an assignment
+  // it is removed everywhere.
+  static void stripNonInputInvariantLoads(
+      llvm::Module &M, llvm::Function *entry,
+      const xla::BufferAssignment *assignment) {
+    const llvm::DataLayout &DL = M.getDataLayout();
+    llvm::SmallDenseSet<int64_t> paramOffsets;
+    if (assignment)
+      for (auto &buf : assignment->Allocations())
+        if (buf.is_entry_computation_parameter())
+          paramOffsets.insert(buf.index() * DL.getPointerSize());
+    llvm::Value *bufferTable =
+        assignment && entry->arg_size() > 3 ? entry->getArg(3) : nullptr;
+
+    auto isParamSlot = [&](const llvm::Value *v) {
+      auto *LI = llvm::dyn_cast<llvm::LoadInst>(v);
+      if (!LI || !bufferTable)
+        return false;
+      llvm::APInt offset(DL.getIndexTypeSizeInBits(LI->getPointerOperandType()),
+                         0);
+      const llvm::Value *base =
+          LI->getPointerOperand()->stripAndAccumulateConstantOffsets(
+              DL, offset, /*AllowNonInbounds*/ true);
+      return base == bufferTable &&
+             paramOffsets.contains(offset.getSExtValue());
+    };
+
+    for (auto &F : M)
+      for (auto &BB : F)
+        for (auto &I : BB) {
+          auto *LI = llvm::dyn_cast<llvm::LoadInst>(&I);
+          if (!LI || !LI->hasMetadata(llvm::LLVMContext::MD_invariant_load))
+            continue;
+          if (&F == entry &&
+              (isParamSlot(LI) ||
+               isParamSlot(llvm::getUnderlyingObject(LI->getPointerOperand()))))
+            continue;
+          LI->setMetadata(llvm::LLVMContext::MD_invariant_load, nullptr);
+        }
+  }
+
+  // Checks that every jax input maps onto exactly one entry parameter of the
+  // XLA executable. Errors print the HLO module, since the MLIR source may be
+  // bytecode.
+  static void checkEntryParameters(const xla::cpu::CpuExecutable &executable,
+                                   size_t num_inputs) {
+    auto &assignment = executable.buffer_assignment();
+    size_t num_in = 0;
+    for (auto &buf2 : assignment.Allocations()) {
+      if (buf2.is_entry_computation_parameter()) {
+        num_in++;
+      }
+    }
+    if (num_in != num_inputs) {
+      std::string err_str;
+      llvm::raw_string_ostream ss(err_str);
+      ss << assignment.ToString() << "\n";
+      ss << " Number of mhlo inputs (" << num_in
+         << ") != number of jax inputs (" << num_inputs << "):\n";
+      ss << executable.module().ToString() << "\n";
+      throw pybind11::value_error(ss.str());
+    }
+    for (size_t i = 0; i < num_inputs; i++) {
+      ssize_t idx = -1;
+      for (auto &buf2 : assignment.Allocations()) {
+        if (!buf2.is_entry_computation_parameter())
+          continue;
+        if (buf2.parameter_number() != i)
+          continue;
+        assert(idx == -1);
+        idx = buf2.index();
+      }
+      if (idx == -1) {
+        std::string err_str;
+        llvm::raw_string_ostream ss(err_str);
+        ss << " Could not find input parameter (" << i
+           << ") as hlo parameter:\n";
+        ss << executable.module().ToString() << "\n";
+        throw pybind11::value_error(ss.str());
+      }
+    }
+  }
+
+  static llvm::SmallVector<std::string> parseArgv(PyObject *pyargv) {
+    llvm::SmallVector<std::string> pyargv_strs;
+    assert(PySequence_Check(pyargv));
+    auto sz = PySequence_Size(pyargv);
+    for (Py_ssize_t i = 0; i < sz; ++i) {
+      PyObject *item = PySequence_GetItem(pyargv, i);
+#if PY_VERSION_HEX < 0x03000000
+      auto argv = PyString_AsString(item);
+#else
+      auto argv = PyUnicode_AsUTF8(item);
+#endif
+      Py_DECREF(item);
+      assert(argv);
+      pyargv_strs.emplace_back(argv);
+#if PY_VERSION_HEX < 0x03000000
+      free(argv);
+#else
+      // should not free py3+
+#endif
+    }
+    return pyargv_strs;
+  }
+
   static std::tuple<std::unique_ptr<llvm::Module>,
                     std::unique_ptr<llvm::LLVMContext>, size_t, size_t>
   createLLVMMod(std::string fn, llvm::StringRef source,
                 llvm::ArrayRef<llvm::SmallVector<int64_t>> out_shapes,
                 llvm::ArrayRef<std::string> out_names,
                 llvm::ArrayRef<llvm::SmallVector<int64_t>> in_shapes,
-                llvm::ArrayRef<std::string> in_names, PyObject *pyargv,
-                ABI mode, Language lang, bool xla_runtime,
-                const std::string &pass_pipeline) {
+                llvm::ArrayRef<std::string> in_names,
+                llvm::ArrayRef<std::string> argv, ABI mode,
+                Language lang, bool xla_runtime,
+                const std::string &pass_pipeline,
+                const Activities &activity = {},
+                std::unique_ptr<HloProfile> *profile = nullptr,
+                bool minimal_hlo = false) {
+    for (size_t i = 0; i < in_shapes.size(); i++)
+      if (activity.in(i) == Activity::DupNoNeed)
+        throw pybind11::value_error(
+            "kernel inputs must be const or dup, not dupnoneed");
     auto llvm_ctx = std::make_unique<llvm::LLVMContext>();
 
     std::string input;
@@ -112,11 +538,18 @@ public:
     ss << "#include <enzyme/utils>\n";
 
     std::unique_ptr<llvm::Module> linkMod;
-    std::unique_ptr<xla::LocalExecutable> local_executable;
+    std::shared_ptr<xla::LocalExecutable> local_executable;
     std::string stringbuf;
 
     size_t tmpBuf = 0;
-    llvm::StringRef origSource = source;
+
+    // With ENZYME_FUSION_AD, XLA's fusion and computation functions stay
+    // separate calls while Enzyme runs, so each distinct one is differentiated
+    // once rather than as part of a single inlined body. They are inlined
+    // after differentiation.
+    bool keepCalls = getenv("ENABLE_PERFLISTENER");
+    bool fusionAD = getenv("ENZYME_FUSION_AD") && mode != ABI::Primal;
+    llvm::SmallVector<std::string> fusions;
     switch (lang) {
     case Language::CPP:
       ss << source << "\n";
@@ -124,47 +557,16 @@ public:
 
     case Language::MHLO: {
       local_executable = compile_mhlo_to_llvm_with_xla(
-          source, stringbuf, xla_runtime, pass_pipeline);
+          source, stringbuf, xla_runtime, pass_pipeline,
+          /*hlo_profile*/ profile && !xla_runtime, /*ir_only*/ true,
+          minimal_hlo);
       auto *cpu_executable = static_cast<xla::cpu::CpuExecutable *>(
           local_executable->executable());
       auto &assignment = cpu_executable->buffer_assignment();
-      if (!xla_runtime) {
-        size_t num_in = 0;
-        for (auto &buf2 : assignment.Allocations()) {
-          if (buf2.is_entry_computation_parameter()) {
-            num_in++;
-          }
-        }
-        if (num_in != in_shapes.size()) {
-          std::string err_str;
-          llvm::raw_string_ostream ss(err_str);
-          ss << assignment.ToString() << "\n";
-          ss << source << "\n";
-          ss << " Number of mhlo inputs (" << num_in
-             << ") != number of jax inputs (" << in_shapes.size() << "):\n";
-          ss << source << "\n";
-          throw pybind11::value_error(ss.str());
-        }
-        for (size_t i = 0; i < in_shapes.size(); i++) {
-          ssize_t idx = -1;
-          for (auto &buf2 : assignment.Allocations()) {
-            if (!buf2.is_entry_computation_parameter())
-              continue;
-            if (buf2.parameter_number() != i)
-              continue;
-            assert(idx == -1);
-            idx = buf2.index();
-          }
-          if (idx == -1) {
-            std::string err_str;
-            llvm::raw_string_ostream ss(err_str);
-            ss << " Could not find input parameter (" << i
-               << ") as hlo parameter:\n";
-            ss << source << "\n";
-            throw pybind11::value_error(ss.str());
-          }
-        }
-      }
+      if (profile && !xla_runtime)
+        *profile = HloProfile::create(*cpu_executable);
+      if (!xla_runtime)
+        checkEntryParameters(*cpu_executable, in_shapes.size());
       source = stringbuf;
       if (xla_runtime)
         tmpBuf = 0;
@@ -200,21 +602,19 @@ public:
         assert(!F->empty());
         for (auto &F2 : *linkMod)
           if (!F2.empty()) {
-            F2.addFnAttr(llvm::Attribute::AlwaysInline);
-            // Remove invariant_load if we expect enzyme to cache explicitly all
-            // data. Otherwise invariant_load allows Enzyme to assume it need
-            // not cache, and it is illegal for us to pass in nullptr as the
-            // primal (since it may be needed).
-            if (mode == ABI::Augmented || mode == ABI::Reverse ||
-                mode == ABI::Tape) {
-              for (auto &BB : F2)
-                for (auto &I : BB)
-                  if (auto LI = llvm::dyn_cast<llvm::LoadInst>(&I))
-                    if (LI->hasMetadata(llvm::LLVMContext::MD_invariant_load))
-                      LI->setMetadata(llvm::LLVMContext::MD_invariant_load,
-                                      nullptr);
-            }
+            // When profiling with perf, keep XLA's fusion functions as
+            // separate symbols so samples are attributed to them.
+            if ((keepCalls || fusionAD) && &F2 != F) {
+              F2.addFnAttr(llvm::Attribute::NoInline);
+              fusions.push_back(F2.getName().str());
+            } else
+              F2.addFnAttr(llvm::Attribute::AlwaysInline);
           }
+        if (mode == ABI::Augmented || mode == ABI::Reverse ||
+            mode == ABI::Tape)
+          stripNonInputInvariantLoads(
+              *linkMod, F,
+              xla_runtime ? nullptr : &cpu_executable->buffer_assignment());
       }
       if (xla_runtime) {
         ss << " extern \"C\" void " << fn << "(void* exec";
@@ -382,73 +782,7 @@ public:
               local_executable->executable());
           auto &assignment = cpu_executable->buffer_assignment();
           numBuffers = assignment.Allocations().size();
-          if (out_shapes.size() == 1) {
-            ssize_t idx = -1;
-            for (auto &buf2 : assignment.Allocations()) {
-              if (!buf2.maybe_live_out())
-                continue;
-              assert(!buf2.is_tuple());
-              assert(idx == -1);
-              idx = buf2.index();
-            }
-            assert(idx != -1);
-            out_idxs.push_back(idx);
-          } else {
-            // If a tuple, find the tuple buf, then use that to index the
-            // outputs.
-            ssize_t tupidx = -1;
-            for (auto &buf2 : assignment.Allocations()) {
-              if (!buf2.maybe_live_out())
-                continue;
-              if (!buf2.is_tuple())
-                continue;
-              assert(tupidx == -1);
-              tupidx = buf2.index();
-            }
-            assert(tupidx != -1);
-            auto &tup_buf = assignment.Allocations()[tupidx];
-            assert(tup_buf.assigned_buffers().size() == 1);
-            auto hlo = tup_buf.assigned_buffers().begin()->first;
-            auto val = hlo->instruction();
-            assert(val->operand_count() == out_shapes.size());
-            for (size_t i = 0; i < out_shapes.size(); i++) {
-              ssize_t found = -1;
-              auto operand = val->operand(i);
-              while (found == -1) {
-                for (auto &buf : assignment.Allocations()) {
-                  if (!buf.maybe_live_out())
-                    continue;
-                  if (buf.is_tuple())
-                    continue;
-                  bool contains_output = false;
-                  for (auto &pair : buf.assigned_buffers()) {
-                    if (pair.first->instruction() != operand)
-                      continue;
-                    assert(!contains_output);
-                    contains_output = true;
-                    assert(pair.second.offset == 0);
-                  }
-                  if (!contains_output)
-                    continue;
-                  assert(found == -1);
-                  found = buf.index();
-                }
-                if (operand->opcode() == xla::HloOpcode::kBitcast) {
-                  operand = operand->operand(0);
-                  continue;
-                }
-                break;
-              }
-              if (found == -1) {
-                llvm::errs() << "assignment: " << assignment.ToString() << "\n";
-                llvm::errs() << "val: " << val->ToString() << "\n";
-                llvm::errs() << "vop: " << val->operand(i)->ToString() << "\n";
-                llvm::errs() << "i: " << i << "\n";
-              }
-              assert(found != -1);
-              out_idxs.push_back((int)found);
-            }
-          }
+          out_idxs = outputAllocations(assignment, out_shapes.size());
           for (auto &buf : assignment.Allocations()) {
             if (buf.is_thread_local()) {
               ss << "  char local_" << buf.index() << "[" << buf.size()
@@ -509,7 +843,6 @@ public:
               std::string err;
               llvm::raw_string_ostream ess(err);
               ess << " Failed to compile mhlo, unknown buffer type\n";
-              ess << origSource << "\n";
               ess << source << "\n";
               ess << local_executable->executable()->module().ToString()
                   << "\n";
@@ -542,8 +875,17 @@ public:
           }
         }
         ss << "};\n";
-        ss << "  " << fn
-           << "(nullptr, nullptr, nullptr, buffers, nullptr, nullptr);\n";
+        // The profile counters are owned by the kernel, so their address is
+        // baked into the generated call. Enzyme treats the counter updates as
+        // inactive, so differentiated kernels count cycles against the
+        // original HLO instructions.
+        std::string prof_counters = "nullptr";
+        if (profile && *profile)
+          prof_counters =
+              "(void*)" +
+              std::to_string((uintptr_t)(*profile)->counters.get()) + "ull";
+        ss << "  " << fn << "(nullptr, nullptr, nullptr, buffers, nullptr, "
+           << prof_counters << ");\n";
       }
       ss << "};\n";
       fn = abiName;
@@ -638,7 +980,7 @@ public:
     }
 
     for (size_t i = 0; i < in_shapes.size(); i++) {
-      if (mode != ABI::Reverse && mode != ABI::Tape) {
+      if (mode != ABI::Tape) {
         ss << " " << make_type(in_names[i], in_shapes[i], true, lang) << "& in_"
            << i << " = "
            << "*(" << make_type(in_names[i], in_shapes[i], true, lang)
@@ -701,6 +1043,27 @@ public:
       out_off++;
     }
 
+    // The tape layout depends on the activity of every argument, so the
+    // augmented, reverse and tape ABIs must describe them identically. The
+    // augmented pass exists to produce the primal outputs, so dupnoneed only
+    // takes effect in forward mode. XLA never writes to input buffers, and
+    // the reverse pass receives the same inputs as the augmented one, so
+    // inputs are marked nooverwrite and Enzyme need not tape their values.
+    auto tapeOutActivity = [&](size_t i) {
+      auto act = activity.out(i);
+      return act == Activity::DupNoNeed ? Activity::Dup : act;
+    };
+    auto emitTapeSize = [&]() {
+      ss << "  std::size_t tapesize = enzyme::__enzyme_augmentsize(" << fn;
+      for (size_t i = 0; i < out_shapes.size(); i++)
+        ss << ", " << enzymeActivity(tapeOutActivity(i));
+      if (tmpBuf != 0)
+        ss << ", enzyme_dup";
+      for (size_t i = 0; i < in_shapes.size(); i++)
+        ss << ", enzyme_nooverwrite, " << enzymeActivity(activity.in(i));
+      ss << ");\n";
+    };
+
     if (mode == ABI::Primal) {
       ss << "  " << fn << "(";
       bool comma = false;
@@ -724,78 +1087,73 @@ public:
       }
       ss << ");\n";
     } else if (mode == ABI::Forward) {
+      for (size_t i = 0; i < out_shapes.size(); i++)
+        if (activity.out(i) == Activity::Const)
+          ss << "  dout_" << i << " = (" << out_names[i] << ")0;\n";
       ss << "  enzyme::__enzyme_fwddiff(" << fn;
       for (size_t i = 0; i < out_shapes.size(); i++) {
-        ss << ", enzyme_dup, ";
-        ss << "&out_" << i << ", ";
-        ss << "&dout_" << i;
+        ss << ", " << enzymeActivity(activity.out(i)) << ", ";
+        ss << "&out_" << i;
+        if (activity.out(i) != Activity::Const)
+          ss << ", &dout_" << i;
       }
       if (tmpBuf != 0) {
         ss << ", enzyme_dup, &tmpBuf, &dtmpBuf";
       }
       for (size_t i = 0; i < in_shapes.size(); i++) {
-        ss << ", enzyme_dup, ";
-        ss << "&in_" << i << ", ";
-        ss << "&din_" << i;
+        ss << ", " << enzymeActivity(activity.in(i)) << ", ";
+        ss << "&in_" << i;
+        if (activity.in(i) != Activity::Const)
+          ss << ", &din_" << i;
       }
       ss << ");\n";
     } else if (mode == ABI::Augmented) {
       // outs, tapeout
       // ins
-      ss << "  std::size_t tapesize = enzyme::__enzyme_augmentsize(" << fn;
-      for (size_t i = 0; i < out_shapes.size(); i++) {
-        ss << ", enzyme_dup";
-      }
-      if (tmpBuf != 0) {
-        ss << ", enzyme_dup";
-      }
-      for (size_t i = 0; i < in_shapes.size(); i++) {
-        ss << ", enzyme_dup";
-      }
-      ss << ");\n";
+      emitTapeSize();
       ss << "  enzyme::__enzyme_augmentfwd<void*>(" << fn
          << ", enzyme_allocated, tapesize, enzyme_tape, &tape";
       for (size_t i = 0; i < out_shapes.size(); i++) {
-        ss << ", enzyme_dup, &out_" << i << ", nullptr";
+        ss << ", " << enzymeActivity(tapeOutActivity(i)) << ", &out_" << i;
+        if (tapeOutActivity(i) != Activity::Const)
+          ss << ", nullptr";
       }
       if (tmpBuf != 0) {
         ss << ", enzyme_dup, &tmpBuf, &dtmpBuf";
       }
       for (size_t i = 0; i < in_shapes.size(); i++) {
-        ss << ", enzyme_dup, &in_" << i << ", nullptr";
+        ss << ", enzyme_nooverwrite, " << enzymeActivity(activity.in(i))
+           << ", &in_" << i;
+        if (activity.in(i) != Activity::Const)
+          ss << ", nullptr";
       }
       ss << ");\n";
     } else if (mode == ABI::Reverse) {
 
       // d_ins
-      // tape, d_out
+      // tape, d_out, ins
 
       // og outputs, og inputs
       //     doutputs (in), dinputs (out)
-      ss << "  std::size_t tapesize = enzyme::__enzyme_augmentsize(" << fn;
-      for (size_t i = 0; i < out_shapes.size(); i++) {
-        ss << ", enzyme_dup";
-      }
-      if (tmpBuf != 0) {
-        ss << ", enzyme_dup";
-      }
-      for (size_t i = 0; i < in_shapes.size(); i++) {
-        ss << ", enzyme_dup";
-      }
-      ss << ");\n";
+      emitTapeSize();
       for (size_t i = 0; i < in_shapes.size(); i++) {
         ss << "  din_" << i << " = (" << in_names[i] << ")0;\n";
       }
       ss << "  enzyme::__enzyme_reverse<void>(" << fn
          << ", enzyme_allocated, tapesize, enzyme_tape, &tape";
       for (size_t i = 0; i < out_shapes.size(); i++) {
-        ss << ", enzyme_dup, nullptr, &dout_" << i;
+        ss << ", " << enzymeActivity(tapeOutActivity(i)) << ", nullptr";
+        if (tapeOutActivity(i) != Activity::Const)
+          ss << ", &dout_" << i;
       }
       if (tmpBuf != 0) {
         ss << ", enzyme_dup, &tmpBuf, &dtmpBuf";
       }
       for (size_t i = 0; i < in_shapes.size(); i++) {
-        ss << ", enzyme_dup, nullptr, &din_" << i;
+        ss << ", enzyme_nooverwrite, " << enzymeActivity(activity.in(i))
+           << ", &in_" << i;
+        if (activity.in(i) != Activity::Const)
+          ss << ", &din_" << i;
       }
       ss << ");\n";
       ss << "prevent_stores(";
@@ -808,49 +1166,35 @@ public:
     } else if (mode == ABI::Tape) {
       // outs, tapeout
       // ins
-      ss << "  std::size_t tapesize = enzyme::__enzyme_augmentsize(" << fn;
-      for (size_t i = 0; i < out_shapes.size(); i++) {
-        ss << ", enzyme_dup";
-      }
-      if (tmpBuf != 0) {
-        ss << ", enzyme_dup";
-      }
-      for (size_t i = 0; i < in_shapes.size(); i++) {
-        ss << ", enzyme_dup";
-      }
-      ss << ");\n";
+      emitTapeSize();
       ss << "  return tapesize;\n";
     } else {
       assert(0 && "unhandled mode");
     }
     ss << "}\n";
 
-    llvm::SmallVector<std::string> pyargv_strs;
-    assert(PySequence_Check(pyargv));
-    auto sz = PySequence_Size(pyargv);
-    for (Py_ssize_t i = 0; i < sz; ++i) {
-      PyObject *item = PySequence_GetItem(pyargv, i);
-#if PY_VERSION_HEX < 0x03000000
-      auto argv = PyString_AsString(item);
-#else
-      auto argv = PyUnicode_AsUTF8(item);
-#endif
-      Py_DECREF(item);
-      assert(argv);
-      pyargv_strs.emplace_back(argv);
-#if PY_VERSION_HEX < 0x03000000
-      free(argv);
-#else
-      // should not free py3+
-#endif
-    }
+    // Structurally identical fusions are merged first, so that Enzyme only
+    // derives one of them.
+    if (fusionAD && linkMod)
+      runLLVMPipeline(*linkMod, "mergefunc");
 
     auto mod = GetLLVMFromJob("/enzyme_call/source.cpp", ss.str(), /*cpp*/ true,
-                              pyargv_strs, llvm_ctx.get(), std::move(linkMod));
+                              argv, llvm_ctx.get(), std::move(linkMod));
     if (!mod) {
       llvm::errs() << "Source:\n" << ss.str() << "\n";
       throw pybind11::value_error("failed to compile C++");
     }
+
+    if (fusionAD && !keepCalls) {
+      for (auto &name : fusions)
+        if (auto *F = mod->getFunction(name)) {
+          F->removeFnAttr(llvm::Attribute::NoInline);
+          F->addFnAttr(llvm::Attribute::AlwaysInline);
+        }
+      runLLVMPipeline(*mod,
+                      "always-inline,globaldce,function(sroa,instcombine,"
+                      "simplifycfg)");
+    }
     return std::make_tuple(std::move(mod), std::move(llvm_ctx), out_off,
                            tmpBuf);
   }
@@ -862,28 +1206,56 @@ public:
                   llvm::ArrayRef<llvm::SmallVector<int64_t>> in_shapes,
                   llvm::ArrayRef<std::string> in_names, PyObject *pyargv,
                   Language lang, bool xla_runtime,
-                  const std::string &pass_pipeline) {
+                  const std::string &pass_pipeline, bool hlo_profile = false,
+                  bool minimal_hlo = false, const Activities &activity = {}) {
     auto mode = ABI::Tape;
-    auto [mod, llvm_ctx, num_out, tmpBuf] =
-        createLLVMMod(fn, source, out_shapes, out_names, in_shapes, in_names,
-                      pyargv, mode, lang, xla_runtime, pass_pipeline);
-    auto lfn = mod->getFunction("entry");
-    auto RI =
-        llvm::cast<llvm::ReturnInst>(lfn->getEntryBlock().getTerminator());
-    auto val = llvm::cast<llvm::ConstantInt>(RI->getReturnValue());
-    size_t res = val->getZExtValue();
-    // force deletion of mod first explicitly
-    mod = nullptr;
-    return std::make_pair(res, tmpBuf);
+    auto argv = parseArgv(pyargv);
+    // Abstract evaluation asks for the same sizes on every trace.
+    auto key = signature(fn, source, out_shapes, out_names, in_shapes,
+                         in_names, argv, mode, lang, xla_runtime,
+                         pass_pipeline, hlo_profile, minimal_hlo, activity);
+    {
+      std::lock_guard<std::mutex> lock(tape_cache_mutex);
+      auto found = tape_cache.find(key);
+      if (found != tape_cache.end())
+        return found->second;
+    }
+
+    // The cache lock is not held while compiling, so two threads may size the
+    // same kernel; both get the same answer.
+    size_t res, tmpBuf;
+    {
+      std::lock_guard<std::mutex> compile_lock(compile_mutex);
+      // Profiling changes the code Enzyme sees, so compute the tape size for
+      // the same instrumentation the kernel will use.
+      std::unique_ptr<HloProfile> profile;
+      auto [mod, llvm_ctx, num_out, modTmpBuf] =
+          createLLVMMod(fn, source, out_shapes, out_names, in_shapes, in_names,
+                        argv, mode, lang, xla_runtime, pass_pipeline, activity,
+                        hlo_profile ? &profile : nullptr, minimal_hlo);
+      auto lfn = mod->getFunction("entry");
+      auto RI =
+          llvm::cast<llvm::ReturnInst>(lfn->getEntryBlock().getTerminator());
+      auto val = llvm::cast<llvm::ConstantInt>(RI->getReturnValue());
+      res = val->getZExtValue();
+      tmpBuf = modTmpBuf;
+      // force deletion of mod first explicitly
+      mod = nullptr;
+    }
+    std::lock_guard<std::mutex> lock(tape_cache_mutex);
+    return tape_cache.try_emplace(key, res, tmpBuf).first->second;
   }
 
   static size_t tempSize(llvm::StringRef source, Language lang,
-                         bool xla_runtime, const std::string &pass_pipeline) {
+                         bool xla_runtime, const std::string &pass_pipeline,
+                         bool hlo_profile = false, bool minimal_hlo = false) {
     switch (lang) {
     case Language::MHLO: {
+      std::lock_guard<std::mutex> compile_lock(compile_mutex);
       std::string llvm_ir;
       auto local_executable = compile_mhlo_to_llvm_with_xla(
-          source, llvm_ir, xla_runtime, pass_pipeline);
+          source, llvm_ir, xla_runtime, pass_pipeline,
+          hlo_profile && !xla_runtime, /*ir_only*/ true, minimal_hlo);
       auto *cpu_executable = static_cast<xla::cpu::CpuExecutable *>(
           local_executable->executable());
       auto &assignment = cpu_executable->buffer_assignment();
@@ -894,23 +1266,99 @@ public:
     }
   }
 
-  static std::tuple<size_t, size_t>
-  create(std::string fn, llvm::StringRef source,
-         llvm::ArrayRef<llvm::SmallVector<int64_t>> out_shapes,
-         llvm::ArrayRef<std::string> out_names,
-         llvm::ArrayRef<llvm::SmallVector<int64_t>> in_shapes,
-         llvm::ArrayRef<std::string> in_names, PyObject *pyargv, ABI mode,
-         Language lang, bool xla_runtime, const std::string &pass_pipeline,
-         const std::string &platform) {
-    if (platform != "cpu")
-      return std::make_tuple(UNKNOWN_PLATFORM, 0);
-    llvm::sys::SmartScopedWriter<true> lock(kernel_mutex);
-    size_t identifier = last_identifier++;
+  // Compiles a primal MHLO kernel with XLA and keeps the resulting executable,
+  // whose entry point is called directly with a buffer table assembled from
+  // the kernel's outputs (followed by the temporary buffer) and inputs.
+  static std::tuple<std::unique_ptr<CpuKernel>, size_t>
+  createXLAPrimal(int64_t identifier, llvm::StringRef source,
+                  size_t num_results, size_t num_inputs,
+                  const std::string &pass_pipeline, bool hlo_profile,
+                  bool minimal_hlo) {
+    std::string llvm_ir;
+    auto local_executable = compile_mhlo_to_llvm_with_xla(
+        source, llvm_ir, /*xla_runtime*/ false, pass_pipeline, hlo_profile,
+        /*ir_only*/ false, minimal_hlo);
+    auto *cpu_executable =
+        static_cast<xla::cpu::CpuExecutable *>(local_executable->executable());
+    auto &assignment = cpu_executable->buffer_assignment();
+    checkEntryParameters(*cpu_executable, num_inputs);
+    auto out_idxs = outputAllocations(assignment, num_results);
+    size_t tmpBuf = assignment.temp_allocation_total_size();
+
+    llvm::SmallVector<BufferSlot> slots;
+    for (auto &buf : assignment.Allocations()) {
+      assert(buf.index() == slots.size());
+      BufferSlot slot = {BufferKind::None, 0, nullptr};
+      if (buf.is_entry_computation_parameter()) {
+        slot = {BufferKind::Input, (size_t)buf.parameter_number(), nullptr};
+      } else if (buf.IsPreallocatedTempBuffer()) {
+        slot = {BufferKind::Output, num_results, nullptr};
+      } else if (buf.maybe_live_out()) {
+        if (buf.is_tuple()) {
+          assert(num_results != 1);
+          slot = {BufferKind::Tuple, num_results, nullptr};
+        } else {
+          auto it = std::find(out_idxs.begin(), out_idxs.end(), buf.index());
+          assert(it != out_idxs.end());
+          slot = {BufferKind::Output, (size_t)(it - out_idxs.begin()),
+                  nullptr};
+        }
+      } else if (buf.is_constant()) {
+        assert(buf.assigned_buffers().size() == 1);
+        auto hlo = buf.assigned_buffers().begin()->first;
+        auto val = xla::Cast<xla::HloConstantInstruction>(hlo->instruction());
+        slot = {BufferKind::Constant, 0,
+                const_cast<void *>(val->literal().untyped_data())};
+      } else if (!buf.is_thread_local()) {
+        // Thread-local buffers are allocated by the compiled code itself, so
+        // like XLA's runtime we leave their entries null.
+        std::string err;
+        llvm::raw_string_ostream ess(err);
+        ess << " Failed to compile mhlo, unknown buffer type\n";
+        ess << cpu_executable->module().ToString() << "\n";
+        ess << " unknown buffer type: " << buf.ToString() << "\n";
+        throw std::runtime_error(ess.str());
+      }
+      slots.push_back(slot);
+    }
 
-    auto [mod, llvm_ctx, num_out, tmpBuf] =
-        createLLVMMod(fn, source, out_shapes, out_names, in_shapes, in_names,
-                      pyargv, mode, lang, xla_runtime, pass_pipeline);
+    size_t num_out = num_results + (tmpBuf != 0 ? 1 : 0);
+    auto kernel = std::make_unique<CpuKernel>(
+        identifier, num_out, std::move(local_executable), slots);
+    kernel->profile = HloProfile::create(*kernel->executable->executable());
+    return std::make_tuple(std::move(kernel), tmpBuf);
+  }
+
+  static std::string kernelLabel(llvm::StringRef fn, ABI mode,
+                                 size_t identifier) {
+    return ("[enzyme " + (fn.empty() ? llvm::StringRef("mhlo") : fn) + " " +
+            abiName(mode) + " #" + llvm::Twine(identifier) + "]")
+        .str();
+  }
+
+  static void checkBatch(size_t batch_size, llvm::ArrayRef<size_t> out_strides,
+                         size_t num_out, size_t tmpBuf) {
+    if (batch_size == 0)
+      return;
+    if (tmpBuf != 0)
+      throw pybind11::value_error(
+          "batched kernels do not support a temporary buffer");
+    if (out_strides.size() != num_out) {
+      std::string err_str;
+      llvm::raw_string_ostream ss(err_str);
+      ss << " Number of batched output strides (" << out_strides.size()
+         << ") != number of kernel outputs (" << num_out << ")\n";
+      throw pybind11::value_error(ss.str());
+    }
+  }
 
+  // Adds the module to its own JITDylib and returns the address of its entry
+  // point. Callers must hold compile_mutex. The label names the kernel in
+  // profiler symbol maps.
+  static llvm::orc::JITDylib &
+  addModuleToJIT(const std::string &name, std::unique_ptr<llvm::Module> mod,
+                 std::unique_ptr<llvm::LLVMContext> llvm_ctx,
+                 const std::string &label) {
     if (!JIT) {
       DL = std::make_unique<llvm::DataLayout>(mod->getDataLayoutStr());
       auto tJIT =
@@ -930,6 +1378,13 @@ public:
                           createGDBRegistrationListener();
                       obj->registerJITEventListener(*list);
                     }
+                    if (getenv("ENABLE_PERFLISTENER")) {
+                      // Only available if LLVM was built with perf support.
+                      if (auto list = llvm::JITEventListener::
+                              createPerfJITEventListener())
+                        obj->registerJITEventListener(*list);
+                      obj->registerJITEventListener(perf_map);
+                    }
                     return obj;
                   })
               .setJITTargetMachineBuilder(llvm::orc::JITTargetMachineBuilder(
@@ -943,7 +1398,8 @@ public:
       assert(JIT);
     }
 
-    auto LibA = JIT->createJITDylib("enzymedl_" + std::to_string(identifier));
+    auto LibA = JIT->createJITDylib(name);
+    perf_map.label = label;
 
     // Add the module.
     // if (auto Err =
@@ -955,22 +1411,346 @@ public:
       llvm::errs() << " error " << Err << "\n";
       throw pybind11::value_error("failed to add IR module");
     }
+    return LibA.get();
+  }
 
+  static uint64_t lookupEntry(llvm::orc::JITDylib &lib,
+                              const std::string &name) {
     // Look up the JIT'd code entry point.
-    auto EntrySym = JIT->lookup(LibA.get(), "entry");
+    auto EntrySym = JIT->lookup(lib, name);
     if (!EntrySym) {
       llvm::errs() << EntrySym.takeError() << "\n";
-      throw pybind11::value_error("failed to lookup function called 'entry'");
+      throw pybind11::value_error("failed to lookup function called '" + name +
+                                  "'");
     }
 
     // Cast the entry point address to a function pointer.
-    auto Entry = EntrySym->getValue();
+    return EntrySym->getValue();
+  }
 
-    kernels.try_emplace(
-        identifier, std::make_unique<CpuKernel>(identifier, num_out, Entry));
+  static uint64_t addModule(size_t identifier,
+                            std::unique_ptr<llvm::Module> mod,
+                            std::unique_ptr<llvm::LLVMContext> llvm_ctx,
+                            const std::string &label) {
+    auto &lib = addModuleToJIT("enzymedl_" + std::to_string(identifier),
+                               std::move(mod), std::move(llvm_ctx), label);
+    return lookupEntry(lib, "entry");
+  }
+
+  // Moves a kernel's module into the open group, renaming its entry point to
+  // entry_<identifier>. Callers must hold compile_mutex.
+  static void addToGroup(KernelGroup &group, size_t identifier,
+                         std::unique_ptr<llvm::Module> mod) {
+    auto *entry = mod->getFunction("entry");
+    entry->setName("entry_" + std::to_string(identifier));
+    // Only functions were internalized when the kernel was compiled alone.
+    // Globals of the user's source would clash with, or be shared with, those
+    // of the other kernels in the group.
+    for (auto &gv : mod->global_values()) {
+      if (&gv == entry || gv.isDeclaration() || gv.hasLocalLinkage() ||
+          gv.hasAppendingLinkage() || gv.getName().starts_with("llvm."))
+        continue;
+      gv.setLinkage(llvm::GlobalValue::InternalLinkage);
+      if (auto *go = llvm::dyn_cast<llvm::GlobalObject>(&gv))
+        go->setComdat(nullptr);
+    }
+    // Modules from different contexts cannot be linked directly.
+    llvm::SmallVector<char> buffer;
+    llvm::raw_svector_ostream os(buffer);
+    llvm::WriteBitcodeToFile(*mod, os);
+    auto moved = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(llvm::StringRef(buffer.data(), buffer.size()),
+                              mod->getModuleIdentifier()),
+        *group.ctx);
+    if (!moved) {
+      llvm::errs() << moved.takeError() << "\n";
+      throw pybind11::value_error("failed to move kernel into group");
+    }
+    if (llvm::Linker::linkModules(*group.mod, std::move(moved.get())))
+      throw pybind11::value_error("failed to link kernel into group");
+  }
+
+  // Compiles a kernel group and resolves the entry point of all its members.
+  static void linkGroup(KernelGroup &group) {
+    std::call_once(group.linked, [&group]() {
+      std::lock_guard<std::mutex> lock(compile_mutex);
+      // Every kernel brought its own internalized copies of helpers and
+      // constants; fold the identical ones.
+      runLLVMPipeline(*group.mod, "mergefunc,constmerge,globaldce");
+      auto name = "enzymegroup_" + std::to_string(group.identifier);
+      auto &lib =
+          addModuleToJIT(name, std::move(group.mod), std::move(group.ctx),
+                         "[enzyme group #" + std::to_string(group.identifier) +
+                             "]");
+      for (auto *kernel : group.members)
+        kernel->addr =
+            lookupEntry(lib, "entry_" + std::to_string(kernel->identifier));
+    });
+  }
+
+  static void beginGroup() {
+    llvm::sys::SmartScopedWriter<true> lock(kernel_mutex);
+    grouping = true;
+    open_group = nullptr;
+  }
+
+  static void endGroup() {
+    std::shared_ptr<KernelGroup> group;
+    {
+      llvm::sys::SmartScopedWriter<true> lock(kernel_mutex);
+      grouping = false;
+      group = std::move(open_group);
+    }
+    if (group)
+      linkGroup(*group);
+  }
+
+  // Builds a lazily compiled kernel on its first call. Safe to call from any
+  // thread; only the first caller compiles.
+  void ensureCompiled() {
+    std::call_once(compiled, [this]() {
+      if (group) {
+        linkGroup(*group);
+        return;
+      }
+      if (!pending)
+        return;
+      auto &src = *pending;
+      std::lock_guard<std::mutex> lock(compile_mutex);
+      auto [mod, llvm_ctx, num_out, tmpBuf] = createLLVMMod(
+          src.fn, src.source, src.out_shapes, src.out_names, src.in_shapes,
+          src.in_names, src.argv, src.mode, src.lang, src.xla_runtime,
+          src.pass_pipeline, src.activity,
+          src.hlo_profile ? &profile : nullptr, src.minimal_hlo);
+      checkBatch(batch_size, out_strides, num_out, tmpBuf);
+      this->num_out = num_out;
+      addr = addModule(identifier, std::move(mod), std::move(llvm_ctx),
+                       kernelLabel(src.fn, src.mode, identifier));
+      pending = nullptr;
+    });
+  }
+
+  // Identifies everything that determines the code of a kernel, so repeated
+  // lowerings of the same kernel at the same shapes share a single build.
+  static std::string
+  signature(llvm::StringRef fn, llvm::StringRef source,
+            llvm::ArrayRef<llvm::SmallVector<int64_t>> out_shapes,
+            llvm::ArrayRef<std::string> out_names,
+            llvm::ArrayRef<llvm::SmallVector<int64_t>> in_shapes,
+            llvm::ArrayRef<std::string> in_names,
+            llvm::ArrayRef<std::string> argv, ABI mode, Language lang,
+            bool xla_runtime, llvm::StringRef pass_pipeline, bool hlo_profile,
+            bool minimal_hlo, const Activities &activity, size_t batch_size = 0,
+            llvm::ArrayRef<size_t> out_strides = {},
+            llvm::ArrayRef<size_t> in_strides = {}) {
+    std::string key;
+    llvm::raw_string_ostream ks(key);
+    // Sources may be MLIR bytecode, which can contain NUL bytes.
+    ks << fn << '\0' << source.size() << ':' << source << pass_pipeline
+       << '\0' << (int)mode << ',' << (int)lang << ',' << xla_runtime << ','
+       << hlo_profile << ',' << minimal_hlo << ',' << batch_size << '\0';
+    auto addShapes = [&](llvm::ArrayRef<llvm::SmallVector<int64_t>> shapes,
+                         llvm::ArrayRef<std::string> names) {
+      for (size_t i = 0; i < shapes.size(); i++) {
+        ks << names[i];
+        for (auto idx : shapes[i])
+          ks << ',' << idx;
+        ks << ';';
+      }
+      ks << '\0';
+    };
+    addShapes(out_shapes, out_names);
+    addShapes(in_shapes, in_names);
+    for (size_t i = 0; i < out_shapes.size(); i++)
+      ks << (int)activity.out(i);
+    ks << '\0';
+    for (size_t i = 0; i < in_shapes.size(); i++)
+      ks << (int)activity.in(i);
+    ks << '\0';
+    for (auto &arg : argv)
+      ks << arg << ';';
+    ks << '\0';
+    for (auto stride : out_strides)
+      ks << stride << ',';
+    ks << '\0';
+    for (auto stride : in_strides)
+      ks << stride << ',';
+    return ks.str();
+  }
+
+  static std::tuple<size_t, size_t>
+  create(std::string fn, llvm::StringRef source,
+         llvm::ArrayRef<llvm::SmallVector<int64_t>> out_shapes,
+         llvm::ArrayRef<std::string> out_names,
+         llvm::ArrayRef<llvm::SmallVector<int64_t>> in_shapes,
+         llvm::ArrayRef<std::string> in_names, PyObject *pyargv, ABI mode,
+         Language lang, bool xla_runtime, const std::string &pass_pipeline,
+         const std::string &platform, size_t batch_size = 0,
+         llvm::ArrayRef<size_t> out_strides = {},
+         llvm::ArrayRef<size_t> in_strides = {}, bool lazy = false,
+         bool prefetch = false, bool hlo_profile = false,
+         bool minimal_hlo = false, const Activities &activity = {}) {
+    if (platform != "cpu")
+      return std::make_tuple(UNKNOWN_PLATFORM, 0);
+    auto argv = parseArgv(pyargv);
+    auto key = signature(fn, source, out_shapes, out_names, in_shapes,
+                         in_names, argv, mode, lang, xla_runtime,
+                         pass_pipeline, hlo_profile, minimal_hlo, activity,
+                         batch_size, out_strides, in_strides);
+
+    llvm::sys::SmartScopedWriter<true> lock(kernel_mutex);
+    auto found = kernel_cache.find(key);
+    if (found != kernel_cache.end())
+      return found->second;
+
+    auto result = build(fn, source, out_shapes, out_names, in_shapes, in_names,
+                        argv, mode, lang, xla_runtime, pass_pipeline,
+                        batch_size, out_strides, in_strides, lazy, prefetch,
+                        hlo_profile, minimal_hlo, activity);
+    kernel_cache.try_emplace(key, result);
+    return result;
+  }
+
+  // Builds a new kernel. Callers must hold kernel_mutex for writing.
+  static std::tuple<size_t, size_t>
+  build(std::string fn, llvm::StringRef source,
+        llvm::ArrayRef<llvm::SmallVector<int64_t>> out_shapes,
+        llvm::ArrayRef<std::string> out_names,
+        llvm::ArrayRef<llvm::SmallVector<int64_t>> in_shapes,
+        llvm::ArrayRef<std::string> in_names,
+        llvm::ArrayRef<std::string> argv, ABI mode, Language lang,
+        bool xla_runtime, const std::string &pass_pipeline, size_t batch_size,
+        llvm::ArrayRef<size_t> out_strides, llvm::ArrayRef<size_t> in_strides,
+        bool lazy, bool prefetch, bool hlo_profile, bool minimal_hlo,
+        const Activities &activity) {
+    size_t identifier = last_identifier++;
+
+    // XLA's JIT keeps the objects it links private, so kernels run through
+    // createXLAPrimal have no symbols in the perf map. With
+    // ENABLE_PERFLISTENER they are built through our own JIT instead, which
+    // labels the entry point and keeps each XLA fusion a separate symbol.
+    if (lang == Language::MHLO && mode == ABI::Primal && !xla_runtime &&
+        batch_size == 0 && !getenv("ENABLE_PERFLISTENER")) {
+      auto [kernel, tmpBuf] =
+          createXLAPrimal(identifier, source, out_shapes.size(),
+                          in_shapes.size(), pass_pipeline, hlo_profile,
+                          minimal_hlo);
+      kernels.try_emplace(identifier, std::move(kernel));
+      return std::make_tuple(identifier, tmpBuf);
+    }
+
+    if (lazy) {
+      // The temporary buffer is part of the custom call signature, so MHLO
+      // kernels still run XLA now; clang, Enzyme and the JIT are deferred.
+      size_t tmpBuf =
+          xla_runtime ? 0
+                      : tempSize(source, lang, xla_runtime, pass_pipeline,
+                                 hlo_profile, minimal_hlo);
+      auto src = std::make_unique<KernelSource>(KernelSource{
+          fn, source.str(),
+          llvm::SmallVector<llvm::SmallVector<int64_t>>(out_shapes.begin(),
+                                                         out_shapes.end()),
+          llvm::SmallVector<std::string>(out_names.begin(), out_names.end()),
+          llvm::SmallVector<llvm::SmallVector<int64_t>>(in_shapes.begin(),
+                                                         in_shapes.end()),
+          llvm::SmallVector<std::string>(in_names.begin(), in_names.end()),
+          llvm::SmallVector<std::string>(argv.begin(), argv.end()), mode, lang,
+          xla_runtime, pass_pipeline, hlo_profile, minimal_hlo, activity});
+      auto kernel = std::make_unique<CpuKernel>(
+          identifier, std::move(src), batch_size, out_strides, in_strides);
+      if (prefetch)
+        enqueuePrefetch(kernel.get());
+      kernels.try_emplace(identifier, std::move(kernel));
+      return std::make_tuple(identifier, tmpBuf);
+    }
+
+    std::lock_guard<std::mutex> compile_lock(compile_mutex);
+    std::unique_ptr<HloProfile> profile;
+    auto [mod, llvm_ctx, num_out, tmpBuf] =
+        createLLVMMod(fn, source, out_shapes, out_names, in_shapes, in_names,
+                      argv, mode, lang, xla_runtime, pass_pipeline, activity,
+                      hlo_profile ? &profile : nullptr, minimal_hlo);
+    checkBatch(batch_size, out_strides, num_out, tmpBuf);
+
+    if (grouping) {
+      // A member may already have been called, which compiles its group;
+      // later kernels start a new one.
+      if (!open_group || !open_group->mod) {
+        open_group = std::make_shared<KernelGroup>();
+        open_group->identifier = identifier;
+        open_group->ctx = std::make_unique<llvm::LLVMContext>();
+        open_group->mod =
+            std::make_unique<llvm::Module>("enzyme_group", *open_group->ctx);
+      }
+      addToGroup(*open_group, identifier, std::move(mod));
+      auto kernel = std::make_unique<CpuKernel>(
+          identifier, num_out, 0, batch_size, out_strides, in_strides);
+      kernel->profile = std::move(profile);
+      kernel->group = open_group;
+      open_group->members.push_back(kernel.get());
+      kernels.try_emplace(identifier, std::move(kernel));
+      return std::make_tuple(identifier, tmpBuf);
+    }
+
+    auto Entry = addModule(identifier, std::move(mod), std::move(llvm_ctx),
+                           kernelLabel(fn, mode, identifier));
+
+    auto kernel = std::make_unique<CpuKernel>(
+        identifier, num_out, Entry, batch_size, out_strides, in_strides);
+    kernel->profile = std::move(profile);
+    kernels.try_emplace(identifier, std::move(kernel));
     return std::make_tuple(identifier, tmpBuf);
   }
 
+  // Compiles lazily created kernels ahead of their first call on a single
+  // background thread.
+  static void enqueuePrefetch(CpuKernel *kernel) {
+    static std::once_flag started;
+    std::call_once(started, []() {
+      std::thread([]() {
+        while (true) {
+          CpuKernel *next;
+          {
+            std::unique_lock<std::mutex> lock(prefetch_mutex);
+            prefetch_cv.wait(lock, []() { return !prefetch_queue.empty(); });
+            next = prefetch_queue.front();
+            prefetch_queue.pop_front();
+          }
+          try {
+            next->ensureCompiled();
+          } catch (const std::exception &) {
+            // The error is reported again when the kernel is first called.
+          }
+        }
+      }).detach();
+    });
+    {
+      std::lock_guard<std::mutex> lock(prefetch_mutex);
+      prefetch_queue.push_back(kernel);
+    }
+    prefetch_cv.notify_one();
+  }
+
+  // Returns the cycles accumulated by each HLO instruction and computation of
+  // every profiled kernel, keyed by kernel identifier.
+  static pybind11::dict hloProfiles() {
+    llvm::sys::SmartScopedReader<true> lock(kernel_mutex);
+    pybind11::dict result;
+    for (auto &it : kernels) {
+      auto &profile = it.getSecond()->profile;
+      if (!profile)
+        continue;
+      pybind11::dict cycles;
+      for (size_t i = 0; i < profile->names.size(); i++) {
+        if (profile->names[i].empty())
+          continue;
+        cycles[pybind11::str(profile->names[i])] = profile->counters[i];
+      }
+      result[pybind11::int_(it.getFirst())] = cycles;
+    }
+    return result;
+  }
+
   static CpuKernel *get(int64_t identifier) {
     llvm::sys::SmartScopedReader<true> lock(kernel_mutex);
     auto it = kernels.find(identifier);
@@ -979,24 +1759,106 @@ public:
     return it->getSecond().get();
   }
 
-  void call(void *out, void **ins) const {
+  void invoke(void **outs, void **ins) const {
+    if (!executable) {
+      auto fn = (void (*)(void **outs, void **ins))addr;
+      fn(outs, ins);
+      return;
+    }
+    llvm::SmallVector<void *> tuple;
+    llvm::SmallVector<void *> buffers(buffer_slots.size(), nullptr);
+    for (size_t i = 0; i < buffer_slots.size(); i++) {
+      auto &slot = buffer_slots[i];
+      switch (slot.kind) {
+      case BufferKind::None:
+        break;
+      case BufferKind::Input:
+        buffers[i] = ins[slot.index];
+        break;
+      case BufferKind::Output:
+        buffers[i] = outs[slot.index];
+        break;
+      case BufferKind::Tuple:
+        tuple.assign(outs, outs + slot.index);
+        buffers[i] = tuple.data();
+        break;
+      case BufferKind::Constant:
+        buffers[i] = slot.data;
+        break;
+      }
+    }
+    auto fn = (void (*)(void *retval, void *run_options, void *params,
+                        void **buffer_table, void *status,
+                        void *prof_counters))addr;
+    fn(nullptr, nullptr, nullptr, buffers.data(), nullptr,
+       profile ? profile->counters.get() : nullptr);
+  }
+
+  void call(void *out, void **ins) {
+    ensureCompiled();
     void **outs = num_out > 1 ? reinterpret_cast<void **>(out) : &out;
-    for (int i = 0; i < num_out; i++) {
-      void *data = outs[i];
+    if (batch_size == 0) {
+      invoke(outs, ins);
+      return;
     }
-    auto fn = (void (*)(void **outs, void **ins))addr;
-    fn(outs, ins);
+    auto example = [&](size_t b) {
+      llvm::SmallVector<void *> bouts(num_out);
+      llvm::SmallVector<void *> bins(in_strides.size());
+      for (size_t i = 0; i < num_out; i++)
+        bouts[i] = reinterpret_cast<char *>(outs[i]) + b * out_strides[i];
+      for (size_t i = 0; i < in_strides.size(); i++)
+        bins[i] = reinterpret_cast<char *>(ins[i]) + b * in_strides[i];
+      invoke(bouts.data(), bins.data());
+    };
+    // XLA's profiling code updates the shared counters with plain loads and
+    // stores, so profiled examples run one after the other to not lose
+    // counts.
+    if (profile) {
+      for (size_t b = 0; b < batch_size; b++)
+        example(b);
+      return;
+    }
+    // Examples write disjoint slices of the outputs, so they may run
+    // concurrently.
+    llvm::parallelFor(0, batch_size, example);
   }
 
 private:
   static llvm::DenseMap<int64_t, std::unique_ptr<CpuKernel>> kernels;
   static size_t last_identifier;
   static llvm::sys::SmartRWMutex<true> kernel_mutex;
+  // Identifier and temporary buffer size of every kernel built so far, keyed
+  // by signature().
+  static llvm::StringMap<std::tuple<size_t, size_t>> kernel_cache;
+  static std::mutex tape_cache_mutex;
+  static llvm::StringMap<std::pair<size_t, size_t>> tape_cache;
+  // Serializes clang, Enzyme and JIT work between eager creation, lazy
+  // compilation on first call, the prefetch thread and the size queries made
+  // during abstract evaluation.
+  static std::mutex compile_mutex;
+  // Whether kernels are currently being collected into open_group. Guarded by
+  // kernel_mutex; the group's module is guarded by compile_mutex.
+  static bool grouping;
+  static std::shared_ptr<KernelGroup> open_group;
+  static PerfMapListener perf_map;
+  static std::mutex prefetch_mutex;
+  static std::condition_variable prefetch_cv;
+  static std::deque<CpuKernel *> prefetch_queue;
 };
 
 llvm::DenseMap<int64_t, std::unique_ptr<CpuKernel>> CpuKernel::kernels;
 size_t CpuKernel::last_identifier = 1;
 llvm::sys::SmartRWMutex<true> CpuKernel::kernel_mutex;
+llvm::StringMap<std::tuple<size_t, size_t>> CpuKernel::kernel_cache;
+std::mutex CpuKernel::tape_cache_mutex;
+llvm::StringMap<std::pair<size_t, size_t>> CpuKernel::tape_cache;
+std::mutex CpuKernel::compile_mutex;
+bool CpuKernel::grouping = false;
+std::shared_ptr<CpuKernel::KernelGroup> CpuKernel::open_group;
+PerfMapListener CpuKernel::perf_map;
+std::mutex CpuKernel::prefetch_mutex;
+std::condition_variable CpuKernel::prefetch_cv;
+std::deque<CpuKernel *> CpuKernel::prefetch_queue;
 std::unique_ptr<llvm::DataLayout> CpuKernel::DL;
 std::unique_ptr<llvm::orc::LLJIT> CpuKernel::JIT = nullptr;
 // llvm::orc::ExecutionSession
@@ -1014,7 +1876,44 @@ void Callback(void *out, void **ins) {
     // TODO: find a way to fail more gracefully.
     llvm::report_fatal_error("couldn't find enzyme kernel");
   }
-  kernel->call(out, ins + 1);
+  try {
+    kernel->call(out, ins + 1);
+  } catch (const std::exception &e) {
+    // A lazily compiled kernel failed to build on its first call.
+    llvm::report_fatal_error(llvm::Twine("enzyme kernel failed: ") + e.what());
+  }
+}
+
+static Activities parseActivities(const pybind11::list &py_in_activity,
+                                  const pybind11::list &py_out_activity) {
+  Activities activity;
+  for (const auto &element : py_in_activity)
+    activity.ins.push_back(element.cast<Activity>());
+  for (const auto &element : py_out_activity)
+    activity.outs.push_back(element.cast<Activity>());
+  return activity;
+}
+
+static pybind11::dict
+instrumentationDict(const std::vector<PassInstrumentationRecord> &records) {
+  pybind11::list passes;
+  for (const auto &record : records) {
+    pybind11::dict statistics;
+    for (const auto &[name, value] : record.statistics)
+      statistics[pybind11::str(name)] = value;
+    pybind11::dict entry;
+    entry["pass"] = record.pass;
+    entry["op"] = record.op;
+    entry["runs"] = record.runs;
+    entry["seconds"] = record.seconds;
+    entry["ops_before"] = record.ops_before;
+    entry["ops_after"] = record.ops_after;
+    entry["statistics"] = statistics;
+    passes.append(entry);
+  }
+  pybind11::dict result;
+  result["passes"] = passes;
+  return result;
 }
 
 PYBIND11_MODULE(enzyme_call, m) {
@@ -1054,6 +1953,11 @@ PYBIND11_MODULE(enzyme_call, m) {
       .value("LLVM", Language::LLVM)
       .value("MHLO", Language::MHLO);
 
+  pybind11::enum_<Activity>(m, "Activity")
+      .value("Const", Activity::Const)
+      .value("Dup", Activity::Dup)
+      .value("DupNoNeed", Activity::DupNoNeed);
+
   pybind11::enum_<ABI>(m, "ABI")
       .value("Primal", ABI::Primal)
       .value("Forward", ABI::Forward)
@@ -1066,8 +1970,13 @@ PYBIND11_MODULE(enzyme_call, m) {
            const pybind11::list &py_out_shapes,
            const pybind11::list &py_in_shapes, pybind11::object pyargv,
            ABI mode, Language lang, bool xla_runtime,
-           const std::string &pass_pipeline,
-           const std::string &platform) -> std::tuple<size_t, size_t> {
+           const std::string &pass_pipeline, const std::string &platform,
+           size_t batch_size, const pybind11::list &py_out_strides,
+           const pybind11::list &py_in_strides, bool lazy, bool prefetch,
+           bool hlo_profile, bool minimal_hlo,
+           const pybind11::list &py_in_activity,
+           const pybind11::list &py_out_activity)
+            -> std::tuple<size_t, size_t> {
           llvm::SmallVector<llvm::SmallVector<int64_t>> out_shapes;
           out_shapes.reserve(pybind11::len(py_out_shapes));
           llvm::SmallVector<llvm::SmallVector<int64_t>> in_shapes;
@@ -1101,17 +2010,43 @@ PYBIND11_MODULE(enzyme_call, m) {
               target.push_back(nested_element.cast<int64_t>());
             }
           }
-          return CpuKernel::create(fn, source, out_shapes, out_types, in_shapes,
-                                   in_types, pyargv.ptr(), mode, (Language)lang,
-                                   xla_runtime, pass_pipeline, platform);
-        });
+          llvm::SmallVector<size_t> out_strides;
+          for (const auto &element : py_out_strides)
+            out_strides.push_back(element.cast<size_t>());
+          llvm::SmallVector<size_t> in_strides;
+          for (const auto &element : py_in_strides)
+            in_strides.push_back(element.cast<size_t>());
+          return CpuKernel::create(
+              fn, source, out_shapes, out_types, in_shapes, in_types,
+              pyargv.ptr(), mode, (Language)lang, xla_runtime, pass_pipeline,
+              platform, batch_size, out_strides, in_strides, lazy, prefetch,
+              hlo_profile, minimal_hlo,
+              parseActivities(py_in_activity, py_out_activity));
+        },
+        pybind11::arg("source"), pybind11::arg("fn"),
+        pybind11::arg("out_shapes"), pybind11::arg("in_shapes"),
+        pybind11::arg("argv"), pybind11::arg("mode"), pybind11::arg("lang"),
+        pybind11::arg("xla_runtime"), pybind11::arg("pass_pipeline"),
+        pybind11::arg("platform"), pybind11::arg("batch_size") = 0,
+        pybind11::arg("out_strides") = pybind11::list(),
+        pybind11::arg("in_strides") = pybind11::list(),
+        pybind11::arg("lazy") = false, pybind11::arg("prefetch") = false,
+        pybind11::arg("hlo_profile") = false,
+        pybind11::arg("minimal_hlo") = false,
+        pybind11::arg("in_activity") = pybind11::list(),
+        pybind11::arg("out_activity") = pybind11::list());
 
   m.def("tmp_size",
         [](const std::string &source, Language lang, bool xla_runtime,
-           const std::string &pass_pipeline) -> size_t {
+           const std::string &pass_pipeline, bool hlo_profile,
+           bool minimal_hlo) -> size_t {
           return CpuKernel::tempSize(source, (Language)lang, xla_runtime,
-                                     pass_pipeline);
-        });
+                                     pass_pipeline, hlo_profile, minimal_hlo);
+        },
+        pybind11::arg("source"), pybind11::arg("lang"),
+        pybind11::arg("xla_runtime"), pybind11::arg("pass_pipeline"),
+        pybind11::arg("hlo_profile") = false,
+        pybind11::arg("minimal_hlo") = false);
 
   m.def("compile_to_llvm",
         [](const std::string outfile, const std::string &source,
@@ -1157,7 +2092,8 @@ PYBIND11_MODULE(enzyme_call, m) {
 
           auto [mod, llvm_ctx, num_out, tmpBuf] = CpuKernel::createLLVMMod(
               fn, source, out_shapes, out_types, in_shapes, in_types,
-              pyargv.ptr(), ABI::Primal, lang, xla_runtime, pass_pipeline);
+              CpuKernel::parseArgv(pyargv.ptr()), ABI::Primal, lang,
+              xla_runtime, pass_pipeline);
 
           ostream << *mod;
           ostream.close();
@@ -1168,8 +2104,11 @@ PYBIND11_MODULE(enzyme_call, m) {
         [](const std::string &source, const std::string &fn,
            const pybind11::list &py_out_shapes,
            const pybind11::list &py_in_shapes, pybind11::object pyargv,
-           Language lang, bool xla_runtime,
-           const std::string &pass_pipeline) -> std::pair<size_t, size_t> {
+           Language lang, bool xla_runtime, const std::string &pass_pipeline,
+           bool hlo_profile, bool minimal_hlo,
+           const pybind11::list &py_in_activity,
+           const pybind11::list &py_out_activity)
+            -> std::pair<size_t, size_t> {
           llvm::SmallVector<llvm::SmallVector<int64_t>> out_shapes;
           out_shapes.reserve(pybind11::len(py_out_shapes));
           llvm::SmallVector<llvm::SmallVector<int64_t>> in_shapes;
@@ -1205,21 +2144,52 @@ PYBIND11_MODULE(enzyme_call, m) {
           }
           return CpuKernel::tapeAndTempSize(
               fn, source, out_shapes, out_types, in_shapes, in_types,
-              pyargv.ptr(), (Language)lang, xla_runtime, pass_pipeline);
-        });
+              pyargv.ptr(), (Language)lang, xla_runtime, pass_pipeline,
+              hlo_profile, minimal_hlo,
+              parseActivities(py_in_activity, py_out_activity));
+        },
+        pybind11::arg("source"), pybind11::arg("fn"),
+        pybind11::arg("out_shapes"), pybind11::arg("in_shapes"),
+        pybind11::arg("argv"), pybind11::arg("lang"),
+        pybind11::arg("xla_runtime"), pybind11::arg("pass_pipeline"),
+        pybind11::arg("hlo_profile") = false,
+        pybind11::arg("minimal_hlo") = false,
+        pybind11::arg("in_activity") = pybind11::list(),
+        pybind11::arg("out_activity") = pybind11::list());
+
+  m.def("get_hlo_profile", []() { return CpuKernel::hloProfiles(); });
+
+  m.def("begin_kernel_group", []() { CpuKernel::beginGroup(); });
+  m.def("end_kernel_group", []() { CpuKernel::endGroup(); });
 
   m.def("get_callback", []() {
     return pybind11::capsule(reinterpret_cast<void *>(&Callback),
                              "xla._CUSTOM_CALL_TARGET");
   });
 
-  m.def("optimize_module",
-        [](MlirModule cmod, const std::string &pass_pipeline) {
-          run_pass_pipeline(unwrap(cmod), pass_pipeline);
-        });
+  m.def(
+      "optimize_module",
+      [](pybind11::object pymod, const std::string &pass_pipeline,
+         bool instrument) -> pybind11::object {
+        auto cmod = pymod.cast<MlirModule>();
+        if (!instrument) {
+          run_pass_pipeline(unwrap(cmod), pass_pipeline,
+                            pymod.attr("context"));
+          return pybind11::none();
+        }
+        std::vector<PassInstrumentationRecord> records;
+        run_pass_pipeline(unwrap(cmod), pass_pipeline, pybind11::none(),
+                          &records);
+        return instrumentationDict(records);
+      },
+      pybind11::arg("mod"), pybind11::arg("pass_pipeline"),
+      pybind11::arg("instrument") = false);
+  m.def("inject_module", [](MlirOperation target, MlirModule source) {
+    return inject_module(unwrap(target), unwrap(source).getOperation());
+  });
   m.def("run_pass_pipeline",
         [](pybind11::object pyoldsyms, const std::string &mlir,
-           const std::string &pass_pipeline) {
+           const std::string &pass_pipeline, bool bytecode, bool instrument) {
           auto pyargv = pyoldsyms.ptr();
           std::vector<std::string> oldsyms;
           assert(PySequence_Check(pyargv));
@@ -1240,15 +2210,44 @@ PYBIND11_MODULE(enzyme_call, m) {
       // should not free py3+
 #endif
           }
-          return run_pass_pipeline(oldsyms, mlir, pass_pipeline);
-        });
+          std::vector<PassInstrumentationRecord> records;
+          auto [name, mod] =
+              run_pass_pipeline(oldsyms, mlir, pass_pipeline, bytecode,
+                                instrument ? &records : nullptr);
+          // Bytecode is not valid UTF-8, so it must not go through str.
+          pybind11::object pymod =
+              bytecode ? pybind11::object(pybind11::bytes(mod))
+                       : pybind11::object(pybind11::str(mod));
+          if (instrument)
+            return pybind11::make_tuple(name, pymod,
+                                        instrumentationDict(records));
+          return pybind11::make_tuple(name, pymod);
+        },
+        pybind11::arg("oldsyms"), pybind11::arg("mlir"),
+        pybind11::arg("pass_pipeline"), pybind11::arg("bytecode") = false,
+        pybind11::arg("instrument") = false);
 
   m.def("compile_mhlo_to_llvm_with_xla",
         [](const std::string &mhlo_text, bool xla_runtime,
            const std::string &pass_pipeline) {
           std::string llvm_ir;
           compile_mhlo_to_llvm_with_xla(mhlo_text, llvm_ir, xla_runtime,
-                                        pass_pipeline);
+                                        pass_pipeline, /*hlo_profile*/ false,
+                                        /*ir_only*/ true);
           return llvm_ir;
         });
+  // The bytecode and StableHLO versions this extension reads, which may differ
+  // from those of the jaxlib that writes the modules.
+  m.def("mlir_versions", []() {
+    std::string stablehlo_version;
+    llvm::raw_string_ostream os(stablehlo_version);
+    os << mlir::vhlo::Version::getCurrentVersion();
+    return pybind11::make_tuple(int64_t(mlir::bytecode::kVersion), os.str());
+  });
+  m.def("unknown_simplification_hlo_passes", []() {
+    pybind11::list passes;
+    for (const auto &pass : unknown_simplification_hlo_passes())
+      passes.append(pass);
+    return passes;
+  });
 }
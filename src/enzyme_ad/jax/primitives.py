@@ -1,15 +1,19 @@
 """JAX primitives for Enzyme connection."""
 
 from functools import partial
+import contextlib
+import io
 from collections.abc import Callable, Sequence
 from typing import Any
 import itertools
+import math
 import sys
 
 import jax
 from jax import lax
 from jax.interpreters import mlir as jax_mlir
 from jax.interpreters import ad
+from jax.interpreters import batching
 from jaxlib.mlir import ir
 from jaxlib.mlir.dialects import stablehlo, func
 from jax.lib import xla_client
@@ -23,6 +27,10 @@ LANG_CPP = enzyme_call.Language.CPP
 LANG_LLVM = enzyme_call.Language.LLVM
 LANG_MHLO = enzyme_call.Language.MHLO
 
+ACT_CONST = enzyme_call.Activity.Const
+ACT_DUP = enzyme_call.Activity.Dup
+ACT_DUPNONEED = enzyme_call.Activity.DupNoNeed
+
 from enum import Enum
 
 
@@ -50,16 +58,29 @@ class PipelineConfig:
     def export_llvm(self):
         return None
 
+    # Whether XLA should skip the HLO simplification passes the module no longer
+    # needs
+    def minimal_hlo_passes(self):
+        return False
+
 
 class OldXLAPipeline:
-    def __init__(self, name=None):
+    # passes runs on the StableHLO module before XLA compiles it. When it
+    # already simplifies the module, e.g. with hlo_opts(), minimal_hlo skips
+    # XLA's own HLO simplification passes.
+    def __init__(self, name=None, passes="", minimal_hlo=False):
         self.exportname = name
+        self.passes = passes
+        self.minimal_hlo = minimal_hlo
 
     def xla_runtime(self):
         return False
 
     def pass_pipeline(self):
-        return ""
+        return self.passes
+
+    def minimal_hlo_passes(self):
+        return self.minimal_hlo
 
     def mlir_ad(self):
         return False
@@ -87,6 +108,9 @@ class JaXPipeline:
     def ad_level(self):
         return self.passes.count("enzyme-wrap")
 
+    def minimal_hlo_passes(self):
+        return False
+
 
 class NewXLAPipeline:
     def __init__(self, passes=None, mlirad=False):
@@ -251,6 +275,9 @@ class NewXLAPipeline:
     def ad_level(self):
         return self.passes.count("enzyme-wrap")
 
+    def minimal_hlo_passes(self):
+        return False
+
 
 def hlo_opts():
     return """enzyme-hlo-generate-td{
@@ -290,7 +317,7 @@ cse_max<16>;
 cse_neg<16>;
 cse_concatenate<16>;
 
-concatenate_op_canon<16>(1024);
+concatenate_op_canon<16>(16384);
 select_op_canon<16>(1024);
 add_simplify<16>;
 sub_simplify<16>;
@@ -308,6 +335,7 @@ cos_simplify<16>;
 sin_simplify<16>;
 noop_slice<16>;
 const_prop_through_barrier<16>;
+reduce_const_prop<16>;
 slice_slice<16>;
 shift_right_logical_simplify<16>;
 pad_simplify<16>;
@@ -322,8 +350,9 @@ concat_to_broadcast<16>;
 reduce_to_reshape<16>;
 broadcast_to_reshape<16>;
 gather_simplify<16>;
-iota_simplify<16>(1024);
-broadcast_in_dim_simplify<16>(1024);
+iota_simplify<16>(16384);
+broadcast_in_dim_simplify<16>(16384);
+dot_general_const_prop<16>(16384);
 convert_concat<1>;
 dynamic_update_to_concat<1>;
 slice_of_dynamic_update<1>;
@@ -466,7 +495,12 @@ def cflags():
     return res
 
 
-def optimize_module(mod, pipeline=None):
+def optimize_module(mod, pipeline=None, instrument=False):
+    # With instrument, returns a dict whose "passes" entry lists, for each pass
+    # and anchor operation, the runs, wall time, operation counts before and
+    # after, and pass counters such as the enzyme-hlo-opt iteration counts.
+    # Builds with LLVM statistics enabled also report the MLIR statistics of
+    # upstream passes, such as the number of operations cse removed.
     if pipeline is None:
         pipeline = (
             """
@@ -475,8 +509,26 @@ def optimize_module(mod, pipeline=None):
             canonicalize,"""
             + hlo_opts()
         )
-    enzyme_call.optimize_module(mod, pipeline)
-    return
+    return enzyme_call.optimize_module(mod, pipeline, instrument)
+
+
+@contextlib.contextmanager
+def kernel_group():
+    """Links every enzyme kernel lowered inside the block into one module.
+
+    Kernels of one program, such as the augmented and reverse passes, then
+    share internal functions and constants and are JIT compiled once, when
+    the block exits or one of them is first called. Lower and compile the
+    program inside the block::
+
+        with kernel_group():
+            compiled = jax.jit(f).lower(x).compile()
+    """
+    enzyme_call.begin_kernel_group()
+    try:
+        yield
+    finally:
+        enzyme_call.end_kernel_group()
 
 
 def _enzyme_primal_impl(
@@ -486,7 +538,8 @@ def _enzyme_primal_impl(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None
 ) -> Sequence[jax.Array]:
     del args_flat, source, out_shapes
     raise RuntimeError("must be JIT'ed")
@@ -499,7 +552,9 @@ def _enzyme_fwd_impl(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[jax.Array]:
     del args_flat, source, out_shapes
     raise RuntimeError("must be JIT'ed")
@@ -512,7 +567,9 @@ def _enzyme_aug_impl(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[jax.Array]:
     del args_flat, source, out_shapes
     raise RuntimeError("must be JIT'ed")
@@ -525,7 +582,9 @@ def _enzyme_shadow_aug_impl(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[jax.Array]:
     del args_flat, source, out_shapes
     raise RuntimeError("must be JIT'ed")
@@ -538,7 +597,9 @@ def _enzyme_rev_impl(
     argv: Sequence[str],
     in_shapes,
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[jax.Array]:
     del args_flat, source, in_shapes
     raise RuntimeError("must be JIT'ed")
@@ -551,11 +612,12 @@ def _enzyme_primal_abstract_eval(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None
 ) -> Sequence[jax.core.ShapedArray]:
     # TODO: we may attempt some lightweight parsing of source to extract the
     # result types instead.
-    return out_shapes
+    return batched_avals(out_shapes, batch)
 
 
 def _enzyme_fwd_abstract_eval(
@@ -565,10 +627,33 @@ def _enzyme_fwd_abstract_eval(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[jax.core.ShapedArray]:
     del source, fn, args_flat
-    return tuple(o for o in out_shapes for _ in range(2))
+    return tuple(o for o in batched_avals(out_shapes, batch) for _ in range(2))
+
+
+def mlir_bytecode(module):
+    # Modules cross into enzyme_call as bytecode, which keeps debug locations
+    # and is much cheaper to print and parse than the textual form. The
+    # extension pins its own MLIR and StableHLO and only reads bytecode of
+    # versions it knows, so the textual form is used when jaxlib's StableHLO
+    # differs from the extension's.
+    bytecode_version, stablehlo_version = enzyme_call.mlir_versions()
+    get_version = getattr(stablehlo, "get_current_version", None)
+    if get_version is not None and get_version() == stablehlo_version:
+        buf = io.BytesIO()
+        try:
+            module.operation.write_bytecode(buf, desired_version=bytecode_version)
+        except Exception:
+            # jaxlib's writer predates that version, and so writes one the
+            # extension can read.
+            buf = io.BytesIO()
+            module.operation.write_bytecode(buf)
+        return buf.getvalue()
+    return module.operation.get_asm(enable_debug_info=True)
 
 
 def absmaketup(ty):
@@ -594,7 +679,9 @@ def _enzyme_aug_abstract_eval(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[jax.core.ShapedArray]:
     in_shapes = args_flat
 
@@ -604,6 +691,10 @@ def _enzyme_aug_abstract_eval(
 
     in_shapes = [absmaketup(a) for a in in_shapes]
 
+    if batch is not None:
+        in_shapes = unbatch_shapes(in_shapes, batch[1])
+
+    kept = None
     if lang == LANG_MHLO:
         (in_tree, _, _, mfunc, jit_options) = source
         if "print_mlir" in jit_options:
@@ -611,7 +702,7 @@ def _enzyme_aug_abstract_eval(
         avals_in = jax.tree_util.tree_unflatten(in_tree, args_flat)
         lowered_func = lower(jax.jit(mfunc, **jit_options), avals_in)
         mhlo = lowered_func.compiler_ir(dialect="stablehlo")
-        source = mhlo.operation.get_asm(enable_debug_info=True)
+        source = mlir_bytecode(mhlo)
         kept = lowered_func.compile()._executable._kept_var_idx
         in_shapes = [shape for (i, shape) in enumerate(in_shapes) if i in kept]
 
@@ -626,11 +717,13 @@ def _enzyme_aug_abstract_eval(
         lang,
         pipeline_options.xla_runtime(),
         pipeline_options.pass_pipeline(),
+        **xla_compile_args(pipeline_options),
+        **activity_args(activity, kept),
     )
     res = tuple(prev_out_shapes) + (
         jax.core.ShapedArray((tapeSize,), (jax.numpy.int8)),
     )
-    return res
+    return batched_avals(res, batch)
 
 
 def _enzyme_shadow_aug_abstract_eval(
@@ -640,9 +733,11 @@ def _enzyme_shadow_aug_abstract_eval(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[jax.core.ShapedArray]:
-    return out_shapes
+    return batched_avals(out_shapes, batch)
 
 
 def _enzyme_rev_abstract_eval(
@@ -652,7 +747,9 @@ def _enzyme_rev_abstract_eval(
     argv: Sequence[str],
     in_shapes,
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[jax.core.ShapedArray]:
     return tuple(
         jax.core.ShapedArray(shape, dejaxify(tyid)) for (shape, tyid) in in_shapes
@@ -676,6 +773,95 @@ def maketup(ty):
     return (tystr, ty.shape)
 
 
+_type_sizes = {
+    "bool": 1,
+    "char": 1,
+    "bfloat16": 2,
+    "float": 4,
+    "double": 8,
+    "int32_t": 4,
+    "int64_t": 8,
+    "uint32_t": 4,
+    "uint64_t": 8,
+}
+
+
+# A batched primitive carries `batch=(size, in_batched)`, where in_batched marks
+# which operands have a leading batch axis. Its kernel is compiled for a single
+# example and looped over the batch by enzyme_call; every result is batched.
+def batched_avals(avals, batch):
+    if batch is None:
+        return avals
+    return tuple(
+        jax.core.ShapedArray((batch[0],) + tuple(a.shape), a.dtype) for a in avals
+    )
+
+
+def unbatch_shapes(shapes, batched):
+    return [
+        (ty, shape[1:]) if b else (ty, shape)
+        for ((ty, shape), b) in zip(shapes, batched)
+    ]
+
+
+def batch_kernel_args(batch, out_types, in_args):
+    if batch is None:
+        return {}
+
+    def stride(ty):
+        tystr, shape = maketup(ty)
+        return _type_sizes[tystr] * math.prod(shape[1:])
+
+    return {
+        "batch_size": batch[0],
+        "out_strides": [stride(ty) for ty in out_types],
+        "in_strides": [
+            stride(arg.type) if b else 0 for (arg, b) in zip(in_args, batch[1])
+        ],
+    }
+
+
+# Derivative primitives carry `activity=(in_activity, out_activity)`, the
+# enzyme_call.Activity of each kernel input and output, so Enzyme skips the
+# shadows of arguments that are not differentiated. None means all dup. Input
+# activity comes from symbolic zero tangents in the JVP. Output activity of the
+# forward kernel comes from dead code elimination, see fwd_dce, since which
+# outputs are used is not known in the JVP. The reverse pass keeps the output
+# activity of the augmented pass that produced its tape.
+def activity_args(activity, kept=None):
+    if activity is None:
+        return {}
+    in_activity, out_activity = activity
+    if kept is not None:
+        in_activity = [act for (i, act) in enumerate(in_activity) if i in kept]
+    return {"in_activity": list(in_activity), "out_activity": list(out_activity)}
+
+
+def xla_compile_args(pipeline_options):
+    # ENZYME_HLO_PROFILE compiles MHLO kernels with XLA's per-HLO cycle
+    # counters, which enzyme_call.get_hlo_profile() reports.
+    import os
+
+    args = {}
+    if os.getenv("ENZYME_HLO_PROFILE") is not None:
+        args["hlo_profile"] = True
+    if pipeline_options.minimal_hlo_passes():
+        args["minimal_hlo"] = True
+    return args
+
+
+def kernel_compile_args(pipeline_options):
+    # ENZYME_LAZY_COMPILE defers building kernels until their first call, and
+    # with the value "prefetch" also builds them on a background thread.
+    import os
+
+    args = xla_compile_args(pipeline_options)
+    mode = os.getenv("ENZYME_LAZY_COMPILE")
+    if mode is not None:
+        args |= {"lazy": True, "prefetch": mode == "prefetch"}
+    return args
+
+
 def make_mlir_zero(ty):
     from jax._src.interpreters import mlir
 
@@ -716,7 +902,8 @@ def _enzyme_primal_lowering(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None
 ) -> Sequence[ir.Value]:
     del out_shapes
 
@@ -761,7 +948,7 @@ def _enzyme_primal_lowering(
             ctx.module_context.lowering_parameters,
         )
         mhlo = lowered_func.compiler_ir(dialect="stablehlo")
-        source = mhlo.operation.get_asm(enable_debug_info=True)
+        source = mlir_bytecode(mhlo)
         kept = lowered_func.compile()._executable._kept_var_idx
         in_args = tuple(
             arg
@@ -790,25 +977,26 @@ def _enzyme_primal_lowering(
         if pipeline_options.stablehlo_inject():
             ins = ir.InsertionPoint.current
             mod = ins.block.region.owner.parent
-            fns = []
-            for f in mod.regions[0].blocks[0]:
-                fns.append(f.sym_name.value)
 
-            name, nmod = enzyme_call.run_pass_pipeline(fns, source, pass_pipeline)
+            # Run the pipeline directly in the caller's context and splice the
+            # result into its module, rather than round-tripping through a
+            # private context.
+            nmod = ir.Module.parse(source, context=ctx.module_context.context)
+            enzyme_call.optimize_module(nmod, pass_pipeline)
             if print_mlir:
                 if type(print_mlir) != type(True):
-                    print_mlir.write(nmod)
+                    print_mlir.write(nmod.operation.get_asm(enable_debug_info=True))
                 else:
                     print(str(nmod), flush=True)
-            nmod = ir.Module.parse(nmod)
+            name = enzyme_call.inject_module(mod.operation, nmod)
             fn = None
             pushtop = []
-            for f in nmod.body:
-                if "top_k_gt" in f.sym_name.value:
-                    pushtop.append(f)
-                mod.regions[0].blocks[0].append(f)
-                if f.sym_name.value == name:
+            for f in mod.regions[0].blocks[0]:
+                fname = f.sym_name.value
+                if fname == name:
                     fn = f
+                elif "top_k_gt" in fname:
+                    pushtop.append(f)
             for f in pushtop[::-1]:
                 f.move_before(next(mod.regions[0].blocks[0].__iter__()))
             if True:
@@ -844,6 +1032,7 @@ def _enzyme_primal_lowering(
                 pipeline_options.xla_runtime(),
                 pass_pipeline,
                 ctx.module_context.platforms[0],
+                **kernel_compile_args(pipeline_options),
             )
             identifier_attr = jax_mlir.dense_int_elements([identifier])
             identifier_op = stablehlo.ConstantOp(identifier_attr)
@@ -879,6 +1068,9 @@ def _enzyme_primal_lowering(
 
         results = tuple(results2)
     else:
+        if batch is not None:
+            out_shapes = unbatch_shapes(out_shapes, [True] * len(out_shapes))
+            in_shapes = unbatch_shapes(in_shapes, batch[1])
         assert len(ctx.module_context.platforms) == 1
         identifier, tmpBuf = enzyme_call.create_enzyme_kernel(
             source,
@@ -891,6 +1083,8 @@ def _enzyme_primal_lowering(
             pipeline_options.xla_runtime(),
             pass_pipeline,
             ctx.module_context.platforms[0],
+            **batch_kernel_args(batch, out_types, in_args),
+            **kernel_compile_args(pipeline_options),
         )
         identifier_attr = jax_mlir.dense_int_elements([identifier])
         identifier_op = stablehlo.ConstantOp(identifier_attr)
@@ -922,7 +1116,9 @@ def _enzyme_fwd_lowering(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[ir.Value]:
     del out_shapes
 
@@ -934,6 +1130,7 @@ def _enzyme_fwd_lowering(
 
     in_args = (*args_flat,)
 
+    kept = None
     if lang == LANG_MHLO:
         (in_tree, _, _, mfunc, jit_options) = source
         if "print_mlir" in jit_options:
@@ -941,11 +1138,15 @@ def _enzyme_fwd_lowering(
         avals_in = jax.tree_util.tree_unflatten(in_tree, ctx.avals_in[::2])
         lowered_func = lower(jax.jit(mfunc, **jit_options), avals_in)
         mhlo = lowered_func.compiler_ir(dialect="stablehlo")
-        source = mhlo.operation.get_asm(enable_debug_info=True)
+        source = mlir_bytecode(mhlo)
         kept = lowered_func.compile()._executable._kept_var_idx
         in_args = tuple(arg for (i, arg) in enumerate(in_args) if i // 2 in kept)
         in_shapes = [shape for (i, shape) in enumerate(in_shapes) if i in kept]
 
+    if batch is not None:
+        out_shapes = unbatch_shapes(out_shapes, [True] * len(out_shapes))
+        in_shapes = unbatch_shapes(in_shapes, batch[1][::2])
+
     argv = argv + ("-resource-dir", resource_dir()) + cflags()
     assert len(ctx.module_context.platforms) == 1
     identifier, tmpBuf = enzyme_call.create_enzyme_kernel(
@@ -959,6 +1160,9 @@ def _enzyme_fwd_lowering(
         pipeline_options.xla_runtime(),
         pipeline_options.pass_pipeline(),
         ctx.module_context.platforms[0],
+        **batch_kernel_args(batch, out_types, in_args),
+        **kernel_compile_args(pipeline_options),
+        **activity_args(activity, kept),
     )
     identifier_attr = jax_mlir.dense_int_elements([identifier])
     identifier_op = stablehlo.ConstantOp(identifier_attr)
@@ -988,7 +1192,9 @@ def _enzyme_aug_lowering(
     argv: Sequence[str],
     out_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[ir.Value]:
     del out_shapes
 
@@ -1000,6 +1206,7 @@ def _enzyme_aug_lowering(
 
     in_args = (*args_flat,)
 
+    kept = None
     if lang == LANG_MHLO:
         (in_tree, _, _, mfunc, jit_options) = source
         if "print_mlir" in jit_options:
@@ -1007,11 +1214,15 @@ def _enzyme_aug_lowering(
         avals_in = jax.tree_util.tree_unflatten(in_tree, ctx.avals_in)
         lowered_func = lower(jax.jit(mfunc, **jit_options), avals_in)
         mhlo = lowered_func.compiler_ir(dialect="stablehlo")
-        source = mhlo.operation.get_asm(enable_debug_info=True)
+        source = mlir_bytecode(mhlo)
         kept = lowered_func.compile()._executable._kept_var_idx
         in_args = tuple(arg for (i, arg) in enumerate(in_args) if i in kept)
         in_shapes = [shape for (i, shape) in enumerate(in_shapes) if i in kept]
 
+    if batch is not None:
+        out_shapes = unbatch_shapes(out_shapes, [True] * len(out_shapes))
+        in_shapes = unbatch_shapes(in_shapes, batch[1])
+
     argv = argv + ("-resource-dir", resource_dir()) + cflags()
     assert len(ctx.module_context.platforms) == 1
     identifier, tmpBuf = enzyme_call.create_enzyme_kernel(
@@ -1025,6 +1236,9 @@ def _enzyme_aug_lowering(
         pipeline_options.xla_runtime(),
         pipeline_options.pass_pipeline(),
         ctx.module_context.platforms[0],
+        **batch_kernel_args(batch, out_types, in_args),
+        **kernel_compile_args(pipeline_options),
+        **activity_args(activity, kept),
     )
     identifier_attr = jax_mlir.dense_int_elements([identifier])
     identifier_op = stablehlo.ConstantOp(identifier_attr)
@@ -1052,7 +1266,9 @@ def _enzyme_rev_lowering(
     argv: Sequence[str],
     in_shapes: Sequence[jax.core.ShapedArray],
     lang: enzyme_call.Language,
-    pipeline_options
+    pipeline_options,
+    batch=None,
+    activity=None
 ) -> Sequence[ir.Value]:
     del in_shapes
 
@@ -1063,7 +1279,9 @@ def _enzyme_rev_lowering(
     in_shapes = list(map(maketup, pre_in_types))
     pre_in_shapes = in_shapes
 
-    out_shapes = list(map(lambda x: maketup(x.type), args_flat[1:]))
+    # Operands are the tape, the output cotangents and the primal inputs.
+    num_outs = len(args_flat) - 1 - len(pre_in_types)
+    out_shapes = list(map(lambda x: maketup(x.type), args_flat[1 : 1 + num_outs]))
 
     in_args = (*args_flat,)
 
@@ -1077,14 +1295,20 @@ def _enzyme_rev_lowering(
         avals_in = jax.tree_util.tree_unflatten(in_tree, ctx.avals_out)
         lowered_func = lower(jax.jit(mfunc, **jit_options), avals_in)
         mhlo = lowered_func.compiler_ir(dialect="stablehlo")
-        source = mhlo.operation.get_asm(enable_debug_info=True)
+        source = mlir_bytecode(mhlo)
         kept = lowered_func.compile()._executable._kept_var_idx
-        # in_args = tuple(arg for (i, arg) in enumerate(in_args) if i in kept)
+        in_args = in_args[: 1 + num_outs] + tuple(
+            arg for (i, arg) in enumerate(in_args[1 + num_outs :]) if i in kept
+        )
         in_shapes = [shape for (i, shape) in enumerate(in_shapes) if i in kept]
         rev_return_types = tuple(
             retty for (i, retty) in enumerate(rev_return_types) if i in kept
         )
 
+    if batch is not None:
+        in_shapes = unbatch_shapes(in_shapes, [True] * len(in_shapes))
+        out_shapes = unbatch_shapes(out_shapes, batch[1][1 : 1 + num_outs])
+
     argv = tuple(argv) + ("-resource-dir", resource_dir()) + cflags()
     assert len(ctx.module_context.platforms) == 1
     identifier, tmpBuf = enzyme_call.create_enzyme_kernel(
@@ -1098,6 +1322,9 @@ def _enzyme_rev_lowering(
         pipeline_options.xla_runtime(),
         pipeline_options.pass_pipeline(),
         ctx.module_context.platforms[0],
+        **batch_kernel_args(batch, rev_return_types, in_args),
+        **kernel_compile_args(pipeline_options),
+        **activity_args(activity, kept),
     )
     identifier_attr = jax_mlir.dense_int_elements([identifier])
     identifier_op = stablehlo.ConstantOp(identifier_attr)
@@ -1126,6 +1353,64 @@ def _enzyme_rev_lowering(
     return results
 
 
+class ShapeBuckets:
+    """Rounds the leading dimension of kernel arguments up to a fixed set of
+    sizes, so one compiled kernel serves every batch size in a bucket.
+
+    Kernel dimensions are template parameters of ``enzyme::tensor`` and XLA
+    shapes are static, so each distinct leading extent would otherwise compile
+    a new kernel. Inputs are zero padded up to the bucket and outputs are
+    sliced back, which is only correct when every output row depends on the
+    same input row alone. A kernel that reduces over the leading dimension,
+    such as a sum, mean or max, would see the padding rows and silently return
+    wrong results. The caller states that the kernel treats rows independently
+    with ``rows_independent=True``; bucketing is refused otherwise. Without
+    explicit sizes, buckets are the powers of two.
+    """
+
+    def __init__(self, sizes=None, rows_independent=False):
+        self.sizes = None if sizes is None else tuple(sorted(set(sizes)))
+        self.rows_independent = rows_independent
+
+    def bucket(self, n):
+        if self.sizes is None:
+            return 1 << max(n - 1, 0).bit_length()
+        for size in self.sizes:
+            if size >= n:
+                return size
+        return n
+
+
+def _bucketed_call(args, out_shapes, bucketing, bind):
+    if not bucketing.rows_independent:
+        raise ValueError(
+            "bucketing pads the leading dimension, which changes the results "
+            "of kernels that reduce over it; pass "
+            "ShapeBuckets(rows_independent=True) if every output row only "
+            "depends on the same input row"
+        )
+    shapes = [arg.shape for arg in args] + [shape.shape for shape in out_shapes]
+    if not args or any(len(shape) == 0 for shape in shapes):
+        raise ValueError(
+            "bucketing needs arguments and outputs with a leading dimension"
+        )
+    n = args[0].shape[0]
+    if any(shape[0] != n for shape in shapes):
+        raise ValueError(
+            "bucketing needs the same leading dimension on every argument and "
+            "output, got " + ", ".join(str(shape) for shape in shapes)
+        )
+    b = bucketing.bucket(n)
+    if b == n:
+        return bind(args, out_shapes)
+    args = [jnp.pad(arg, [(0, b - n)] + [(0, 0)] * (arg.ndim - 1)) for arg in args]
+    out_shapes = [
+        jax.core.ShapedArray((b,) + tuple(shape.shape[1:]), shape.dtype)
+        for shape in out_shapes
+    ]
+    return [out[:n] for out in bind(args, out_shapes)]
+
+
 def ffi_call(
     *args,
     out_shapes: Sequence[jax.core.ShapedArray],
@@ -1133,18 +1418,32 @@ def ffi_call(
     fn: str = "f",
     argv: tuple[str] = (),
     lang: int = LANG_CPP,
-    pipeline_options=DefaultCPPPipeline
+    pipeline_options=DefaultCPPPipeline,
+    bucketing: ShapeBuckets = None
 ):
+    """Calls the kernel ``fn`` compiled from ``source`` on ``args``.
+
+    With ``bucketing``, the leading dimension of every argument and output is
+    padded up to a bucket size, which must be the same for all of them. The
+    kernel then also computes the padding rows, so ``bucketing`` must be
+    created with ``rows_independent=True``, see ``ShapeBuckets``.
+    """
     assert type(source) == type("") or len(source) == 5
-    return _enzyme_primal_p.bind(
-        *args,
-        source=source,
-        fn=fn,
-        argv=argv,
-        out_shapes=out_shapes,
-        lang=lang,
-        pipeline_options=pipeline_options
-    )
+
+    def bind(args, out_shapes):
+        return _enzyme_primal_p.bind(
+            *args,
+            source=source,
+            fn=fn,
+            argv=argv,
+            out_shapes=out_shapes,
+            lang=lang,
+            pipeline_options=pipeline_options
+        )
+
+    if bucketing is not None:
+        return _bucketed_call(args, out_shapes, bucketing, bind)
+    return bind(args, out_shapes)
 
 
 def cpp_call(
@@ -1153,8 +1452,14 @@ def cpp_call(
     source: str,
     fn: str = "f",
     argv: tuple[str] = (),
-    pipeline_options=DefaultCPPPipeline
+    pipeline_options=DefaultCPPPipeline,
+    bucketing: ShapeBuckets = None
 ):
+    """Calls the C++ function ``fn`` in ``source`` on ``args``.
+
+    ``bucketing`` has the same row independence requirement as in
+    ``ffi_call``.
+    """
     return ffi_call(
         *args,
         source=source,
@@ -1162,7 +1467,8 @@ def cpp_call(
         argv=argv,
         out_shapes=out_shapes,
         lang=LANG_CPP,
-        pipeline_options=pipeline_options
+        pipeline_options=pipeline_options,
+        bucketing=bucketing
     )
 
 
@@ -1184,7 +1490,6 @@ xla_client.register_custom_call_target("jaxzyme.fwd", enzyme_call.get_callback()
 
 
 def enzyme_jvp(arg_primals, arg_tangents, **kwargs):
-    # TODO propagate activity info rather than make_zero
     def make_zero(tan, prim):
         return lax.zeros_like_array(prim) if type(tan) is ad.Zero else tan
 
@@ -1255,10 +1560,24 @@ def enzyme_jvp(arg_primals, arg_tangents, **kwargs):
             pipeline_options=pipeline_options
         )
     else:
+        # Inputs with symbolic zero tangents are const, so Enzyme neither
+        # propagates nor tapes their shadows. The zeros are still passed to
+        # keep the kernel's buffer layout independent of activity.
+        activity = None
+        if any(type(t) is ad.Zero for t in arg_tangents):
+            in_activity = tuple(
+                ACT_CONST if type(t) is ad.Zero else ACT_DUP for t in arg_tangents
+            )
+            activity = (in_activity, ())
         arg_tangents = tuple(
             make_zero(t, p) for (t, p) in zip(arg_tangents, arg_primals)
         )
         args = tuple(v for t in zip(arg_primals, arg_tangents) for v in t)
+        # Tangents are materialized with the shape of their primal, so they
+        # share its batch axis.
+        batch = kwargs.get("batch")
+        if batch is not None:
+            batch = (batch[0], tuple(b for b in batch[1] for _ in range(2)))
         shadconv = _enzyme_fwd_p.bind(
             *args,
             source=kwargs["source"],
@@ -1266,7 +1585,9 @@ def enzyme_jvp(arg_primals, arg_tangents, **kwargs):
             argv=kwargs["argv"],
             out_shapes=kwargs["out_shapes"],
             lang=kwargs["lang"],
-            pipeline_options=kwargs["pipeline_options"]
+            pipeline_options=kwargs["pipeline_options"],
+            batch=batch,
+            activity=activity
         )
     res = (shadconv[0::2], shadconv[1::2])
     return res
@@ -1339,11 +1660,20 @@ def fwd_partial_eval(trace, *args, **kwargs):
     if not (all_primals_known and some_tangents_unknown):
         return trace.default_process_primitive(_enzyme_fwd_p, args, kwargs)
 
-    outs_known = trace.default_process_primitive(_enzyme_aug_p, primals, kwargs)
+    aug_kwargs = kwargs
+    shadow_aug_kwargs = kwargs
+    if kwargs.get("batch") is not None:
+        size, in_batched = kwargs["batch"]
+        aug_kwargs = kwargs | {"batch": (size, in_batched[0::2])}
+        shadow_aug_kwargs = kwargs | {
+            "batch": (size, (True,) + in_batched[0::2] + in_batched[1::2])
+        }
+
+    outs_known = trace.default_process_primitive(_enzyme_aug_p, primals, aug_kwargs)
 
     shadow_aug_args = (trace.full_raise(outs_known[-1]),) + primals + tangents
     shadows_known = trace.default_process_primitive(
-        _enzyme_shadow_aug_p, shadow_aug_args, kwargs
+        _enzyme_shadow_aug_p, shadow_aug_args, shadow_aug_kwargs
     )
 
     outs = tuple(v for tup in zip(outs_known[:-1], shadows_known) for v in tup)
@@ -1353,6 +1683,33 @@ def fwd_partial_eval(trace, *args, **kwargs):
 pe.custom_partial_eval_rules[_enzyme_fwd_p] = fwd_partial_eval
 
 
+def fwd_dce(used_outputs, eqn):
+    # The forward kernel returns every primal output followed by its tangent.
+    # Dead code elimination tells which of them the program uses: a primal
+    # output that is not used becomes dupnoneed, so Enzyme need not compute
+    # it, and a tangent that is not used becomes const. The kernel still gets
+    # a buffer for every output.
+    if not any(used_outputs):
+        return [False] * len(eqn.invars), None
+    out_activity = tuple(
+        (ACT_DUP if primal else ACT_DUPNONEED) if tangent else ACT_CONST
+        for (primal, tangent) in zip(used_outputs[0::2], used_outputs[1::2])
+    )
+    used_inputs = [True] * len(eqn.invars)
+    if all(act == ACT_DUP for act in out_activity):
+        return used_inputs, eqn
+    activity = eqn.params.get("activity")
+    if activity is None:
+        in_activity = (ACT_DUP,) * (len(eqn.invars) // 2)
+    else:
+        in_activity = activity[0]
+    params = dict(eqn.params, activity=(in_activity, out_activity))
+    return used_inputs, eqn.replace(params=params)
+
+
+pe.dce_rules[_enzyme_fwd_p] = fwd_dce
+
+
 def primal_partial_eval(trace, *args, **kwargs):
     pipeline_options = kwargs["pipeline_options"]
     if (
@@ -1516,16 +1873,39 @@ def enzyme_vjp(shadow_rets, *prim_args, **kwargs):
         return res
 
     del kwargs["out_shapes"]
+    # The augmented kernel already ran with every output dup, and the tape
+    # layout depends on output activity, so outputs whose cotangent is a
+    # symbolic zero cannot become const here. They are passed as zeros.
+    shadow_rets = tuple(ad.instantiate_zeros(ct) for ct in shadow_rets)
     tape = prim_args[0]
     prim_args = prim_args[1 : 1 + (len(prim_args) - 1) // 2]
-    prim_args = tuple(
-        jnp.ones(x.aval.shape, x.aval.dtype) if ad.is_undefined_primal(x) else x
-        for x in prim_args
-    )
+    # The reverse kernel reads the primal inputs, so they must be known.
+    if any(ad.is_undefined_primal(x) for x in prim_args):
+        raise ValueError(
+            "enzyme reverse pass needs the primal inputs, which are not known "
+            "in this transpose"
+        )
     in_shapes = tuple((a.shape, jaxify(a.dtype)) for a in prim_args)
 
-    args = (tape,) + tuple(shadow_rets)
+    # The reverse kernel produces a per-example gradient for every input, which
+    # is summed over the batch for inputs that were broadcast.
+    prim_batched = None
+    if kwargs.get("batch") is not None:
+        size, in_batched = kwargs["batch"]
+        prim_batched = in_batched[1 : 1 + len(prim_args)]
+        in_shapes = tuple(
+            (shape if b else (size,) + tuple(shape), tyid)
+            for ((shape, tyid), b) in zip(in_shapes, prim_batched)
+        )
+        kwargs["batch"] = (size, (True,) * (1 + len(shadow_rets)) + prim_batched)
+
+    # The reverse kernel reloads the primal inputs instead of taping them.
+    args = (tape,) + tuple(shadow_rets) + prim_args
     shadconv = _enzyme_rev_p.bind(*args, **kwargs, in_shapes=in_shapes)
+    if prim_batched is not None:
+        shadconv = tuple(
+            s if b else s.sum(axis=0) for (s, b) in zip(shadconv, prim_batched)
+        )
     res = (None,) + tuple(None for _ in range(len(shadconv))) + tuple(shadconv)
     return res
 
@@ -1533,6 +1913,55 @@ def enzyme_vjp(shadow_rets, *prim_args, **kwargs):
 ad.primitive_transposes[_enzyme_shadow_aug_p] = enzyme_vjp
 
 
+def _enzyme_loop_batch(prim, args, dims, kwargs):
+    args = tuple(
+        a if d is batching.not_mapped else batching.moveaxis(a, d, 0)
+        for (a, d) in zip(args, dims)
+    )
+    batched = [d is not batching.not_mapped for d in dims]
+
+    def body(xs):
+        xs = iter(xs)
+        full = tuple(next(xs) if b else a for (a, b) in zip(args, batched))
+        return tuple(prim.bind(*full, **kwargs))
+
+    outs = lax.map(body, tuple(a for (a, b) in zip(args, batched) if b))
+    return outs, (0,) * len(outs)
+
+
+def enzyme_batch(prim, args, dims, **kwargs):
+    # MHLO kernels carry an XLA temporary buffer per call and already batched
+    # kernels would need nested strides, so loop over the batch instead.
+    if kwargs["lang"] == LANG_MHLO or kwargs.get("batch") is not None:
+        return _enzyme_loop_batch(prim, args, dims, kwargs)
+
+    size = next(
+        a.shape[d] for (a, d) in zip(args, dims) if d is not batching.not_mapped
+    )
+    args = tuple(
+        a if d is batching.not_mapped else batching.moveaxis(a, d, 0)
+        for (a, d) in zip(args, dims)
+    )
+    in_batched = tuple(d is not batching.not_mapped for d in dims)
+    if prim is _enzyme_rev_p:
+        kwargs["in_shapes"] = tuple(
+            ((size,) + tuple(shape), tyid) for (shape, tyid) in kwargs["in_shapes"]
+        )
+    kwargs["batch"] = (size, in_batched)
+    if size == 0:
+        # enzyme_call reads a batch size of zero as an unbatched kernel, which
+        # would run once into the empty outputs. There is nothing to compute.
+        avals = jax.eval_shape(partial(prim.bind, **kwargs), *args)
+        outs = tuple(jnp.zeros(a.shape, a.dtype) for a in avals)
+        return outs, (0,) * len(outs)
+    outs = prim.bind(*args, **kwargs)
+    return outs, (0,) * len(outs)
+
+
+for _prim in (_enzyme_primal_p, _enzyme_fwd_p, _enzyme_aug_p, _enzyme_rev_p):
+    batching.primitive_batchers[_prim] = partial(enzyme_batch, _prim)
+
+
 def export(outfile, func, *args, argv=(), jit_options={}):
     def zero_like(arg):
         if arg.dtype == jax.float0:
@@ -1552,7 +1981,7 @@ def export(outfile, func, *args, argv=(), jit_options={}):
     )
     lowered_func = lower(jitres, avals_in)
     mhlo = lowered_func.compiler_ir(dialect="stablehlo")
-    source = mhlo.operation.get_asm(enable_debug_info=True)
+    source = mlir_bytecode(mhlo)
     kept = lowered_func.compile()._executable._kept_var_idx
     in_shapes = [shape for (i, shape) in enumerate(in_shapes) if i in kept]
     xla_runtime = False
@@ -0,0 +1,33 @@
+// RUN: enzymexlamlir-opt --enzyme-hlo-opt %s | FileCheck %s
+
+func.func @transpose() -> tensor<3x2xi32> {
+  %c = stablehlo.constant dense_resource<input> : tensor<2x3xi32>
+  %0 = stablehlo.transpose %c, dims = [1, 0] : (tensor<2x3xi32>) -> tensor<3x2xi32>
+  return %0 : tensor<3x2xi32>
+}
+
+// CHECK-LABEL:  func.func @transpose() -> tensor<3x2xi32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense_resource<[[transposed:enzymexla_const_[0-9a-f]+]]> : tensor<3x2xi32>
+// CHECK-NEXT:    return %[[c]] : tensor<3x2xi32>
+
+func.func @slice_add() -> tensor<2x2xi32> {
+  %c = stablehlo.constant dense_resource<input> : tensor<2x3xi32>
+  %0 = stablehlo.slice %c [0:2, 1:3] : (tensor<2x3xi32>) -> tensor<2x2xi32>
+  %1 = stablehlo.add %0, %0 : tensor<2x2xi32>
+  return %1 : tensor<2x2xi32>
+}
+
+// CHECK-LABEL:  func.func @slice_add() -> tensor<2x2xi32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense_resource<[[sliced:enzymexla_const_[0-9a-f]+]]> : tensor<2x2xi32>
+// CHECK-NEXT:    return %[[c]] : tensor<2x2xi32>
+
+// CHECK-DAG:  [[transposed]]: "0x08000000010000000400000002000000050000000300000006000000"
+// CHECK-DAG:  [[sliced]]: "0x0800000004000000060000000A0000000C000000"
+
+{-#
+  dialect_resources: {
+    builtin: {
+      input: "0x04000000010000000200000003000000040000000500000006000000"
+    }
+  }
+#-}
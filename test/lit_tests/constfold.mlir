@@ -0,0 +1,123 @@
+// RUN: enzymexlamlir-opt --enzyme-hlo-opt %s | FileCheck %s
+
+func.func @transpose() -> tensor<3x2xi32> {
+  %c = stablehlo.constant dense<[[1, 2, 3], [4, 5, 6]]> : tensor<2x3xi32>
+  %0 = stablehlo.transpose %c, dims = [1, 0] : (tensor<2x3xi32>) -> tensor<3x2xi32>
+  return %0 : tensor<3x2xi32>
+}
+
+// CHECK-LABEL:  func.func @transpose() -> tensor<3x2xi32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<{{\[\[}}1, 4], [2, 5], [3, 6]]> : tensor<3x2xi32>
+// CHECK-NEXT:    return %[[c]] : tensor<3x2xi32>
+
+func.func @broadcast() -> tensor<3x2xi32> {
+  %c = stablehlo.constant dense<[1, 2]> : tensor<2xi32>
+  %0 = stablehlo.broadcast_in_dim %c, dims = [1] : (tensor<2xi32>) -> tensor<3x2xi32>
+  return %0 : tensor<3x2xi32>
+}
+
+// CHECK-LABEL:  func.func @broadcast() -> tensor<3x2xi32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<{{\[\[}}1, 2], [1, 2], [1, 2]]> : tensor<3x2xi32>
+// CHECK-NEXT:    return %[[c]] : tensor<3x2xi32>
+
+func.func @iota_slice() -> tensor<2x2xi32> {
+  %0 = stablehlo.iota dim = 1 : tensor<2x3xi32>
+  %1 = stablehlo.slice %0 [0:2, 1:3] : (tensor<2x3xi32>) -> tensor<2x2xi32>
+  return %1 : tensor<2x2xi32>
+}
+
+// CHECK-LABEL:  func.func @iota_slice() -> tensor<2x2xi32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<{{\[\[}}1, 2], [1, 2]]> : tensor<2x2xi32>
+// CHECK-NEXT:    return %[[c]] : tensor<2x2xi32>
+
+func.func @pad_interior() -> tensor<7xi32> {
+  %c = stablehlo.constant dense<[1, 2, 3]> : tensor<3xi32>
+  %pv = stablehlo.constant dense<0> : tensor<i32>
+  %0 = stablehlo.pad %c, %pv, low = [1], high = [1], interior = [1] : (tensor<3xi32>, tensor<i32>) -> tensor<7xi32>
+  return %0 : tensor<7xi32>
+}
+
+// CHECK-LABEL:  func.func @pad_interior() -> tensor<7xi32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<[0, 1, 0, 2, 0, 3, 0]> : tensor<7xi32>
+// CHECK-NEXT:    return %[[c]] : tensor<7xi32>
+
+func.func @concat() -> tensor<3xi32> {
+  %a = stablehlo.constant dense<[1, 2]> : tensor<2xi32>
+  %b = stablehlo.constant dense<[3]> : tensor<1xi32>
+  %0 = stablehlo.concatenate %a, %b, dim = 0 : (tensor<2xi32>, tensor<1xi32>) -> tensor<3xi32>
+  return %0 : tensor<3xi32>
+}
+
+// CHECK-LABEL:  func.func @concat() -> tensor<3xi32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<[1, 2, 3]> : tensor<3xi32>
+// CHECK-NEXT:    return %[[c]] : tensor<3xi32>
+
+func.func @reduce() -> tensor<3xf32> {
+  %c = stablehlo.constant dense<[[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]]> : tensor<2x3xf32>
+  %init = stablehlo.constant dense<0.0> : tensor<f32>
+  %0 = stablehlo.reduce(%c init: %init) applies stablehlo.add across dimensions = [0] : (tensor<2x3xf32>, tensor<f32>) -> tensor<3xf32>
+  return %0 : tensor<3xf32>
+}
+
+// CHECK-LABEL:  func.func @reduce() -> tensor<3xf32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<[5.000000e+00, 7.000000e+00, 9.000000e+00]> : tensor<3xf32>
+// CHECK-NEXT:    return %[[c]] : tensor<3xf32>
+
+// Each step rounds to bf16, where 1 + 2^-9 is 1, so the small terms vanish.
+// Accumulating in f32 and rounding once would give 1.0078125.
+func.func @reduce_bf16() -> tensor<bf16> {
+  %c = stablehlo.constant dense<[1.0, 0.001953125, 0.001953125, 0.001953125, 0.001953125]> : tensor<5xbf16>
+  %init = stablehlo.constant dense<0.0> : tensor<bf16>
+  %0 = stablehlo.reduce(%c init: %init) applies stablehlo.add across dimensions = [0] : (tensor<5xbf16>, tensor<bf16>) -> tensor<bf16>
+  return %0 : tensor<bf16>
+}
+
+// CHECK-LABEL:  func.func @reduce_bf16() -> tensor<bf16> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<1.000000e+00> : tensor<bf16>
+// CHECK-NEXT:    return %[[c]] : tensor<bf16>
+
+func.func @dot() -> tensor<2x2xi32> {
+  %a = stablehlo.constant dense<[[1, 2], [3, 4]]> : tensor<2x2xi32>
+  %b = stablehlo.constant dense<[[5, 6], [7, 8]]> : tensor<2x2xi32>
+  %0 = stablehlo.dot_general %a, %b, contracting_dims = [1] x [0] : (tensor<2x2xi32>, tensor<2x2xi32>) -> tensor<2x2xi32>
+  return %0 : tensor<2x2xi32>
+}
+
+// CHECK-LABEL:  func.func @dot() -> tensor<2x2xi32> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<{{\[\[}}19, 22], [43, 50]]> : tensor<2x2xi32>
+// CHECK-NEXT:    return %[[c]] : tensor<2x2xi32>
+
+func.func @add_f16() -> tensor<2xf16> {
+  %a = stablehlo.constant dense<[1.0, 2.5]> : tensor<2xf16>
+  %b = stablehlo.constant dense<[0.5, 0.25]> : tensor<2xf16>
+  %0 = stablehlo.add %a, %b : tensor<2xf16>
+  return %0 : tensor<2xf16>
+}
+
+// CHECK-LABEL:  func.func @add_f16() -> tensor<2xf16> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<[1.500000e+00, 2.750000e+00]> : tensor<2xf16>
+// CHECK-NEXT:    return %[[c]] : tensor<2xf16>
+
+func.func @mul_complex() -> tensor<2xcomplex<f32>> {
+  %a = stablehlo.constant dense<(1.0, 2.0)> : tensor<2xcomplex<f32>>
+  %b = stablehlo.constant dense<(3.0, 4.0)> : tensor<2xcomplex<f32>>
+  %0 = stablehlo.multiply %a, %b : tensor<2xcomplex<f32>>
+  return %0 : tensor<2xcomplex<f32>>
+}
+
+// CHECK-LABEL:  func.func @mul_complex() -> tensor<2xcomplex<f32>> {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<(-5.000000e+00,1.000000e+01)> : tensor<2xcomplex<f32>>
+// CHECK-NEXT:    return %[[c]] : tensor<2xcomplex<f32>>
+
+func.func @compare_convert() -> (tensor<2xi1>, tensor<2xf16>) {
+  %a = stablehlo.constant dense<[1.5, 5.0]> : tensor<2xf32>
+  %b = stablehlo.constant dense<3.0> : tensor<2xf32>
+  %0 = stablehlo.compare LT, %a, %b, FLOAT : (tensor<2xf32>, tensor<2xf32>) -> tensor<2xi1>
+  %1 = stablehlo.convert %a : (tensor<2xf32>) -> tensor<2xf16>
+  return %0, %1 : tensor<2xi1>, tensor<2xf16>
+}
+
+// CHECK-LABEL:  func.func @compare_convert() -> (tensor<2xi1>, tensor<2xf16>) {
+// CHECK-DAG:    %[[c:.+]] = stablehlo.constant dense<[true, false]> : tensor<2xi1>
+// CHECK-DAG:    %[[cst:.+]] = stablehlo.constant dense<[1.500000e+00, 5.000000e+00]> : tensor<2xf16>
+// CHECK:    return %[[c]], %[[cst]] : tensor<2xi1>, tensor<2xf16>
@@ -0,0 +1,23 @@
+// RUN: enzymexlamlir-opt %s --enzyme-hlo-generate-td="patterns=reduce_const_prop<16>;dot_general_const_prop<16>(16384)" --transform-interpreter --enzyme-hlo-remove-transform | FileCheck %s
+
+func.func @reduce() -> tensor<3xf32> {
+  %c = stablehlo.constant dense<[[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]]> : tensor<2x3xf32>
+  %init = stablehlo.constant dense<0.0> : tensor<f32>
+  %0 = stablehlo.reduce(%c init: %init) applies stablehlo.add across dimensions = [0] : (tensor<2x3xf32>, tensor<f32>) -> tensor<3xf32>
+  return %0 : tensor<3xf32>
+}
+
+// CHECK-LABEL:  func.func @reduce() -> tensor<3xf32> {
+// CHECK:          %[[c:.+]] = stablehlo.constant dense<[5.000000e+00, 7.000000e+00, 9.000000e+00]> : tensor<3xf32>
+// CHECK-NEXT:     return %[[c]] : tensor<3xf32>
+
+func.func @dot() -> tensor<2x2xi32> {
+  %a = stablehlo.constant dense<[[1, 2], [3, 4]]> : tensor<2x2xi32>
+  %b = stablehlo.constant dense<[[5, 6], [7, 8]]> : tensor<2x2xi32>
+  %0 = stablehlo.dot_general %a, %b, contracting_dims = [1] x [0] : (tensor<2x2xi32>, tensor<2x2xi32>) -> tensor<2x2xi32>
+  return %0 : tensor<2x2xi32>
+}
+
+// CHECK-LABEL:  func.func @dot() -> tensor<2x2xi32> {
+// CHECK:          %[[c:.+]] = stablehlo.constant dense<{{\[\[}}19, 22], [43, 50]]> : tensor<2x2xi32>
+// CHECK-NEXT:     return %[[c]] : tensor<2x2xi32>
@@ -0,0 +1,42 @@
+// RUN: enzymexlamlir-opt --enzyme-hlo-opt %s | FileCheck %s
+
+// The additions are still needed by the other results, so concatenating
+// their operands would only add a third addition.
+func.func @concat_shared(%a : tensor<2xf32>, %b : tensor<1xf32>, %x : tensor<2xf32>, %y : tensor<1xf32>) -> (tensor<3xf32>, tensor<2xf32>, tensor<1xf32>) {
+  %u = stablehlo.add %a, %x : tensor<2xf32>
+  %v = stablehlo.add %b, %y : tensor<1xf32>
+  %concat = stablehlo.concatenate %u, %v, dim = 0 : (tensor<2xf32>, tensor<1xf32>) -> tensor<3xf32>
+  return %concat, %u, %v : tensor<3xf32>, tensor<2xf32>, tensor<1xf32>
+}
+
+// CHECK:  func.func @concat_shared(%arg0: tensor<2xf32>, %arg1: tensor<1xf32>, %arg2: tensor<2xf32>, %arg3: tensor<1xf32>) -> (tensor<3xf32>, tensor<2xf32>, tensor<1xf32>) {
+// CHECK-NEXT:    %0 = stablehlo.add %arg0, %arg2 : tensor<2xf32>
+// CHECK-NEXT:    %1 = stablehlo.add %arg1, %arg3 : tensor<1xf32>
+// CHECK-NEXT:    %2 = stablehlo.concatenate %0, %1, dim = 0 : (tensor<2xf32>, tensor<1xf32>) -> tensor<3xf32>
+// CHECK-NEXT:    return %2, %0, %1 : tensor<3xf32>, tensor<2xf32>, tensor<1xf32>
+// CHECK-NEXT:  }
+
+// Reducing the source of the broadcast saves less than launching the extra
+// multiplication costs.
+func.func @broadcast_reduce_small(%a : tensor<2xf32>, %init : tensor<f32>) -> tensor<2xf32> {
+  %b = stablehlo.broadcast_in_dim %a, dims = [1] : (tensor<2xf32>) -> tensor<2x2xf32>
+  %r = stablehlo.reduce(%b init: %init) applies stablehlo.add across dimensions = [0] : (tensor<2x2xf32>, tensor<f32>) -> tensor<2xf32>
+  return %r : tensor<2xf32>
+}
+
+// CHECK:  func.func @broadcast_reduce_small(%arg0: tensor<2xf32>, %arg1: tensor<f32>) -> tensor<2xf32> {
+// CHECK-NEXT:    %0 = stablehlo.broadcast_in_dim %arg0, dims = [1] : (tensor<2xf32>) -> tensor<2x2xf32>
+// CHECK-NEXT:    %1 = stablehlo.reduce(%0 init: %arg1) applies stablehlo.add across dimensions = [0] : (tensor<2x2xf32>, tensor<f32>) -> tensor<2xf32>
+// CHECK-NEXT:    return %1 : tensor<2xf32>
+// CHECK-NEXT:  }
+
+// The same reduction on a large broadcast is rewritten.
+func.func @broadcast_reduce_large(%a : tensor<1024xf32>, %init : tensor<f32>) -> tensor<1024xf32> {
+  %b = stablehlo.broadcast_in_dim %a, dims = [1] : (tensor<1024xf32>) -> tensor<64x1024xf32>
+  %r = stablehlo.reduce(%b init: %init) applies stablehlo.add across dimensions = [0] : (tensor<64x1024xf32>, tensor<f32>) -> tensor<1024xf32>
+  return %r : tensor<1024xf32>
+}
+
+// CHECK-LABEL:  func.func @broadcast_reduce_large
+// CHECK-NOT:    tensor<64x1024xf32>
+// CHECK:        stablehlo.multiply
@@ -0,0 +1,91 @@
+// RUN: enzymexlamlir-opt --enzyme-hlo-gvn %s | FileCheck %s
+
+func.func @consts(%a : tensor<f32>) -> (tensor<f32>, tensor<f32>) {
+  %c0 = stablehlo.constant dense<1.000000e+00> : tensor<f32>
+  %c1 = stablehlo.constant dense<1.000000e+00> : tensor<f32>
+  %0 = stablehlo.add %a, %c0 : tensor<f32>
+  %1 = stablehlo.add %a, %c1 : tensor<f32>
+  return %0, %1 : tensor<f32>, tensor<f32>
+}
+
+// CHECK:  func.func @consts(%arg0: tensor<f32>) -> (tensor<f32>, tensor<f32>) {
+// CHECK-NEXT:    %[[c:.+]] = stablehlo.constant dense<1.000000e+00> : tensor<f32>
+// CHECK-NEXT:    %[[r:.+]] = stablehlo.add %arg0, %[[c]] : tensor<f32>
+// CHECK-NEXT:    return %[[r]], %[[r]] : tensor<f32>, tensor<f32>
+// CHECK-NEXT:  }
+
+func.func @loop(%a : tensor<2x2xf32>) -> tensor<2x2xf32> {
+  %start = stablehlo.constant dense<0> : tensor<i32>
+  %lim = stablehlo.constant dense<5> : tensor<i32>
+  %e = stablehlo.exponential %a : tensor<2x2xf32>
+  %w:2 = stablehlo.while(%iterArg = %a, %iterArg_0 = %start) : tensor<2x2xf32>, tensor<i32>
+   cond {
+    %cmp = stablehlo.compare  LT, %iterArg_0, %lim,  SIGNED : (tensor<i32>, tensor<i32>) -> tensor<i1>
+    stablehlo.return %cmp : tensor<i1>
+  } do {
+    %step = stablehlo.constant dense<1> : tensor<i32>
+    %e2 = stablehlo.exponential %a : tensor<2x2xf32>
+    %next = stablehlo.add %iterArg, %e2 : tensor<2x2xf32>
+    %ni = stablehlo.add %iterArg_0, %step : tensor<i32>
+    stablehlo.return %next, %ni : tensor<2x2xf32>, tensor<i32>
+  }
+  %r = stablehlo.add %w#0, %e : tensor<2x2xf32>
+  return %r : tensor<2x2xf32>
+}
+
+// CHECK:  func.func @loop(%arg0: tensor<2x2xf32>) -> tensor<2x2xf32> {
+// CHECK:    %[[e:.+]] = stablehlo.exponential %arg0 : tensor<2x2xf32>
+// CHECK:    stablehlo.while
+// CHECK-NOT:    stablehlo.exponential
+// CHECK:      stablehlo.add %iterArg, %[[e]] : tensor<2x2xf32>
+
+func.func @reduce(%a : tensor<4x4xf32>) -> (tensor<4xf32>, tensor<4xf32>) {
+  %zero = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+  %0 = stablehlo.reduce(%a init: %zero) applies stablehlo.add across dimensions = [1] : (tensor<4x4xf32>, tensor<f32>) -> tensor<4xf32>
+  %1 = stablehlo.reduce(%a init: %zero) applies stablehlo.add across dimensions = [1] : (tensor<4x4xf32>, tensor<f32>) -> tensor<4xf32>
+  %2 = stablehlo.reduce(%a init: %zero) applies stablehlo.multiply across dimensions = [1] : (tensor<4x4xf32>, tensor<f32>) -> tensor<4xf32>
+  %3 = stablehlo.add %1, %2 : tensor<4xf32>
+  return %0, %3 : tensor<4xf32>, tensor<4xf32>
+}
+
+// CHECK:  func.func @reduce(%arg0: tensor<4x4xf32>) -> (tensor<4xf32>, tensor<4xf32>) {
+// CHECK-NEXT:    %[[z:.+]] = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+// CHECK-NEXT:    %[[s:.+]] = stablehlo.reduce(%arg0 init: %[[z]]) applies stablehlo.add across dimensions = [1] : (tensor<4x4xf32>, tensor<f32>) -> tensor<4xf32>
+// CHECK-NEXT:    %[[p:.+]] = stablehlo.reduce(%arg0 init: %[[z]]) applies stablehlo.multiply across dimensions = [1] : (tensor<4x4xf32>, tensor<f32>) -> tensor<4xf32>
+// CHECK-NEXT:    %[[r:.+]] = stablehlo.add %[[s]], %[[p]] : tensor<4xf32>
+// CHECK-NEXT:    return %[[s]], %[[r]] : tensor<4xf32>, tensor<4xf32>
+// CHECK-NEXT:  }
+
+func.func @isolated(%a : tensor<4xf32>) -> (tensor<4xf32>, tensor<f32>) {
+  %zero = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+  %0 = "stablehlo.sort"(%a) <{dimension = 0 : i64, is_stable = false}> ({
+    ^bb0(%x: tensor<f32>, %y: tensor<f32>):
+      %z = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+      %xs = stablehlo.add %x, %z : tensor<f32>
+      %cmp = stablehlo.compare  LT, %xs, %y,  FLOAT : (tensor<f32>, tensor<f32>) -> tensor<i1>
+      stablehlo.return %cmp : tensor<i1>
+    }) : (tensor<4xf32>) -> tensor<4xf32>
+  %1 = stablehlo.reduce(%a init: %zero) across dimensions = [0] : (tensor<4xf32>, tensor<f32>) -> tensor<f32>
+     reducer(%p: tensor<f32>, %q: tensor<f32>)  {
+      %z0 = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+      %z1 = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+      %s = stablehlo.add %p, %q : tensor<f32>
+      %s0 = stablehlo.maximum %s, %z0 : tensor<f32>
+      %s1 = stablehlo.maximum %s0, %z1 : tensor<f32>
+      stablehlo.return %s1 : tensor<f32>
+    }
+  return %0, %1 : tensor<4xf32>, tensor<f32>
+}
+
+// CHECK:  func.func @isolated(%arg0: tensor<4xf32>) -> (tensor<4xf32>, tensor<f32>) {
+// CHECK-NEXT:    %[[z:.+]] = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+// CHECK-NEXT:    "stablehlo.sort"(%arg0)
+// CHECK-NEXT:    ^bb0(%[[x:.+]]: tensor<f32>, %[[y:.+]]: tensor<f32>):
+// CHECK-NEXT:      %[[cz:.+]] = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+// CHECK-NEXT:      stablehlo.add %[[x]], %[[cz]] : tensor<f32>
+// CHECK:    stablehlo.reduce(%arg0 init: %[[z]])
+// CHECK-NEXT:     reducer(%[[p:.+]]: tensor<f32>, %[[q:.+]]: tensor<f32>)
+// CHECK-NEXT:      %[[rz:.+]] = stablehlo.constant dense<0.000000e+00> : tensor<f32>
+// CHECK-NEXT:      %[[s:.+]] = stablehlo.add %[[p]], %[[q]] : tensor<f32>
+// CHECK-NEXT:      %[[m:.+]] = stablehlo.maximum %[[s]], %[[rz]] : tensor<f32>
+// CHECK-NEXT:      stablehlo.maximum %[[m]], %[[rz]] : tensor<f32>
@@ -0,0 +1,106 @@
+// RUN: enzymexlamlir-opt --enzyme-hlo-transpose-propagation %s | FileCheck %s
+
+func.func @add_transposes(%a : tensor<2x3xf32>, %b : tensor<2x3xf32>) -> tensor<3x2xf32> {
+  %ta = stablehlo.transpose %a, dims = [1, 0] : (tensor<2x3xf32>) -> tensor<3x2xf32>
+  %tb = stablehlo.transpose %b, dims = [1, 0] : (tensor<2x3xf32>) -> tensor<3x2xf32>
+  %r = stablehlo.add %ta, %tb : tensor<3x2xf32>
+  return %r : tensor<3x2xf32>
+}
+
+// CHECK:  func.func @add_transposes(%arg0: tensor<2x3xf32>, %arg1: tensor<2x3xf32>) -> tensor<3x2xf32> {
+// CHECK-NEXT:    %0 = stablehlo.add %arg0, %arg1 : tensor<2x3xf32>
+// CHECK-NEXT:    %1 = stablehlo.transpose %0, dims = [1, 0] : (tensor<2x3xf32>) -> tensor<3x2xf32>
+// CHECK-NEXT:    return %1 : tensor<3x2xf32>
+// CHECK-NEXT:  }
+
+// The transpose is sunk below the exponential, where it cancels out.
+func.func @roundtrip(%a : tensor<2x3xf32>) -> tensor<2x3xf32> {
+  %t = stablehlo.transpose %a, dims = [1, 0] : (tensor<2x3xf32>) -> tensor<3x2xf32>
+  %cst = stablehlo.constant dense<2.000000e+00> : tensor<3x2xf32>
+  %m = stablehlo.multiply %t, %cst : tensor<3x2xf32>
+  %e = stablehlo.exponential %m : tensor<3x2xf32>
+  %r = stablehlo.transpose %e, dims = [1, 0] : (tensor<3x2xf32>) -> tensor<2x3xf32>
+  return %r : tensor<2x3xf32>
+}
+
+// CHECK-LABEL:  func.func @roundtrip
+// CHECK-NOT:      stablehlo.transpose
+// CHECK:          stablehlo.multiply %arg0, %{{.*}} : tensor<2x3xf32>
+// CHECK-NOT:      stablehlo.transpose
+
+func.func @reduce_transpose(%a : tensor<2x3x4xf32>, %init : tensor<f32>) -> tensor<4x2xf32> {
+  %t = stablehlo.transpose %a, dims = [2, 0, 1] : (tensor<2x3x4xf32>) -> tensor<4x2x3xf32>
+  %r = stablehlo.reduce(%t init: %init) applies stablehlo.add across dimensions = [2] : (tensor<4x2x3xf32>, tensor<f32>) -> tensor<4x2xf32>
+  return %r : tensor<4x2xf32>
+}
+
+// CHECK:  func.func @reduce_transpose(%arg0: tensor<2x3x4xf32>, %arg1: tensor<f32>) -> tensor<4x2xf32> {
+// CHECK-NEXT:    %0 = stablehlo.reduce(%arg0 init: %arg1) applies stablehlo.add across dimensions = [1] : (tensor<2x3x4xf32>, tensor<f32>) -> tensor<2x4xf32>
+// CHECK-NEXT:    %1 = stablehlo.transpose %0, dims = [1, 0] : (tensor<2x4xf32>) -> tensor<4x2xf32>
+// CHECK-NEXT:    return %1 : tensor<4x2xf32>
+// CHECK-NEXT:  }
+
+func.func @concat_transposes(%a : tensor<2x3xf32>, %b : tensor<2x5xf32>) -> tensor<8x2xf32> {
+  %ta = stablehlo.transpose %a, dims = [1, 0] : (tensor<2x3xf32>) -> tensor<3x2xf32>
+  %tb = stablehlo.transpose %b, dims = [1, 0] : (tensor<2x5xf32>) -> tensor<5x2xf32>
+  %r = stablehlo.concatenate %ta, %tb, dim = 0 : (tensor<3x2xf32>, tensor<5x2xf32>) -> tensor<8x2xf32>
+  return %r : tensor<8x2xf32>
+}
+
+// CHECK:  func.func @concat_transposes(%arg0: tensor<2x3xf32>, %arg1: tensor<2x5xf32>) -> tensor<8x2xf32> {
+// CHECK-NEXT:    %0 = stablehlo.concatenate %arg0, %arg1, dim = 1 : (tensor<2x3xf32>, tensor<2x5xf32>) -> tensor<2x8xf32>
+// CHECK-NEXT:    %1 = stablehlo.transpose %0, dims = [1, 0] : (tensor<2x8xf32>) -> tensor<8x2xf32>
+// CHECK-NEXT:    return %1 : tensor<8x2xf32>
+// CHECK-NEXT:  }
+
+// The loop transposes its carried value back and forth on every iteration,
+// which is done once before and once after the loop instead.
+func.func @while_carried(%a : tensor<2x3xf32>, %n : tensor<i64>) -> tensor<2x3xf32> {
+  %c0 = stablehlo.constant dense<0> : tensor<i64>
+  %c1 = stablehlo.constant dense<1> : tensor<i64>
+  %r:2 = stablehlo.while(%i = %c0, %x = %a) : tensor<i64>, tensor<2x3xf32>
+    cond {
+    %lt = stablehlo.compare LT, %i, %n : (tensor<i64>, tensor<i64>) -> tensor<i1>
+    stablehlo.return %lt : tensor<i1>
+  } do {
+    %next = stablehlo.add %i, %c1 : tensor<i64>
+    %t = stablehlo.transpose %x, dims = [1, 0] : (tensor<2x3xf32>) -> tensor<3x2xf32>
+    %rev = stablehlo.reverse %t, dims = [0] : tensor<3x2xf32>
+    %b = stablehlo.transpose %rev, dims = [1, 0] : (tensor<3x2xf32>) -> tensor<2x3xf32>
+    stablehlo.return %next, %b : tensor<i64>, tensor<2x3xf32>
+  }
+  return %r#1 : tensor<2x3xf32>
+}
+
+// CHECK-LABEL:  func.func @while_carried
+// CHECK:          stablehlo.transpose %arg0, dims = [1, 0] : (tensor<2x3xf32>) -> tensor<3x2xf32>
+// CHECK:          stablehlo.while
+// CHECK-NOT:      stablehlo.transpose
+// CHECK:          stablehlo.reverse %{{.*}}, dims = [0] : tensor<3x2xf32>
+// CHECK-NOT:      stablehlo.transpose
+// CHECK:          stablehlo.return
+// CHECK:          stablehlo.transpose %{{.*}}, dims = [1, 0] : (tensor<3x2xf32>) -> tensor<2x3xf32>
+
+// The body yields a transpose of its argument, which has to stay in the loop.
+func.func @while_transpose_arg(%a : tensor<3x3xf32>, %n : tensor<i64>) -> tensor<3x3xf32> {
+  %c0 = stablehlo.constant dense<0> : tensor<i64>
+  %c1 = stablehlo.constant dense<1> : tensor<i64>
+  %r:2 = stablehlo.while(%i = %c0, %x = %a) : tensor<i64>, tensor<3x3xf32>
+    cond {
+    %lt = stablehlo.compare LT, %i, %n : (tensor<i64>, tensor<i64>) -> tensor<i1>
+    stablehlo.return %lt : tensor<i1>
+  } do {
+    %next = stablehlo.add %i, %c1 : tensor<i64>
+    %t = stablehlo.transpose %x, dims = [1, 0] : (tensor<3x3xf32>) -> tensor<3x3xf32>
+    stablehlo.return %next, %t : tensor<i64>, tensor<3x3xf32>
+  }
+  return %r#1 : tensor<3x3xf32>
+}
+
+// CHECK-LABEL:  func.func @while_transpose_arg
+// CHECK-NOT:      stablehlo.transpose
+// CHECK:          stablehlo.while(%[[I:.+]] = %{{.*}}, %[[X:.+]] = %arg0)
+// CHECK:          %[[T:.+]] = stablehlo.transpose %[[X]], dims = [1, 0] : (tensor<3x3xf32>) -> tensor<3x3xf32>
+// CHECK-NEXT:     stablehlo.return %{{.*}}, %[[T]] : tensor<i64>, tensor<3x3xf32>
+// CHECK:          return
+// CHECK-NOT:      stablehlo.transpose
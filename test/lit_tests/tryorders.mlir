@@ -0,0 +1,54 @@
+// RUN: enzymexlamlir-opt --pass-pipeline="builtin.module(enzyme-hlo-opt{try_orders=true})" %s | FileCheck %s
+
+func.func @slice_sub(%x: tensor<1x1x8192x1x256xbf16>, %y: tensor<1x1x8192x1x256xbf16>) -> (tensor<1x1x3072x1x256xbf16>) {
+  %0 = stablehlo.subtract %x, %y : tensor<1x1x8192x1x256xbf16>
+  %1 = stablehlo.slice %0 [0:1, 0:1, 0:3072, 0:1, 0:256] : (tensor<1x1x8192x1x256xbf16>) -> tensor<1x1x3072x1x256xbf16>
+  return %1 : tensor<1x1x3072x1x256xbf16>
+}
+
+// CHECK:  func.func @slice_sub(%arg0: tensor<1x1x8192x1x256xbf16>, %arg1: tensor<1x1x8192x1x256xbf16>) -> tensor<1x1x3072x1x256xbf16> {
+// CHECK-NEXT:    %0 = stablehlo.slice %arg0 [0:1, 0:1, 0:3072, 0:1, 0:256] : (tensor<1x1x8192x1x256xbf16>) -> tensor<1x1x3072x1x256xbf16>
+// CHECK-NEXT:    %1 = stablehlo.slice %arg1 [0:1, 0:1, 0:3072, 0:1, 0:256] : (tensor<1x1x8192x1x256xbf16>) -> tensor<1x1x3072x1x256xbf16>
+// CHECK-NEXT:    %2 = stablehlo.subtract %0, %1 : tensor<1x1x3072x1x256xbf16>
+// CHECK-NEXT:    return %2 : tensor<1x1x3072x1x256xbf16>
+// CHECK-NEXT:  }
+
+func.func @concat_add(%a : tensor<2xf32>, %b : tensor<1xf32>, %x : tensor<2xf32>, %y : tensor<1xf32>) -> tensor<3xf32> {
+  %u = stablehlo.add %a, %x : tensor<2xf32>
+  %v = stablehlo.add %b, %y : tensor<1xf32>
+  %concat = stablehlo.concatenate %u, %v, dim = 0 : (tensor<2xf32>, tensor<1xf32>) -> tensor<3xf32>
+  return %concat : tensor<3xf32>
+}
+
+// CHECK:  func.func @concat_add(%arg0: tensor<2xf32>, %arg1: tensor<1xf32>, %arg2: tensor<2xf32>, %arg3: tensor<1xf32>) -> tensor<3xf32> {
+// CHECK-NEXT:    %0 = stablehlo.concatenate %arg0, %arg1, dim = 0 : (tensor<2xf32>, tensor<1xf32>) -> tensor<3xf32>
+// CHECK-NEXT:    %1 = stablehlo.concatenate %arg2, %arg3, dim = 0 : (tensor<2xf32>, tensor<1xf32>) -> tensor<3xf32>
+// CHECK-NEXT:    %2 = stablehlo.add %0, %1 : tensor<3xf32>
+// CHECK-NEXT:    return %2 : tensor<3xf32>
+// CHECK-NEXT:  }
+
+// The operand of the first multiply only folds to a constant once value
+// numbering has merged the two slices in the second iteration. Pushing the
+// concatenation through the multiplies in the first one, in either traversal
+// direction, keeps a multiply of twice the size, while reordering last lets the
+// first multiply fold away.
+func.func @concat_mul_late_constant(%u : tensor<8xi32>, %y : tensor<4xi32>, %z : tensor<4xi32>) -> tensor<8xi32> {
+  %k1 = stablehlo.constant dense<[1, 2, 3, 4]> : tensor<4xi32>
+  %k2 = stablehlo.constant dense<[5, 6, 7, 8]> : tensor<4xi32>
+  %w = stablehlo.slice %u [0:6] : (tensor<8xi32>) -> tensor<6xi32>
+  %p = stablehlo.slice %w [0:4] : (tensor<6xi32>) -> tensor<4xi32>
+  %q = stablehlo.slice %u [0:4] : (tensor<8xi32>) -> tensor<4xi32>
+  %d = stablehlo.subtract %p, %q : tensor<4xi32>
+  %s = stablehlo.add %d, %k2 : tensor<4xi32>
+  %m1 = stablehlo.multiply %k1, %s : tensor<4xi32>
+  %m2 = stablehlo.multiply %y, %z : tensor<4xi32>
+  %concat = stablehlo.concatenate %m1, %m2, dim = 0 : (tensor<4xi32>, tensor<4xi32>) -> tensor<8xi32>
+  return %concat : tensor<8xi32>
+}
+
+// CHECK-LABEL:  func.func @concat_mul_late_constant
+// CHECK-NOT:      stablehlo.multiply {{.*}} : tensor<8xi32>
+// CHECK-DAG:      %[[C:.+]] = stablehlo.constant dense<[5, 12, 21, 32]> : tensor<4xi32>
+// CHECK-DAG:      %[[M:.+]] = stablehlo.multiply %arg1, %arg2 : tensor<4xi32>
+// CHECK:          %[[R:.+]] = stablehlo.concatenate %[[C]], %[[M]], dim = 0 : (tensor<4xi32>, tensor<4xi32>) -> tensor<8xi32>
+// CHECK-NEXT:     return %[[R]] : tensor<8xi32>
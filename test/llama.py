@@ -445,6 +445,75 @@ class Llama(EnzymeJaxTest):
         self.douts = [dx]
         self.tol = 5e-5
 
+    def test_tape_size(self):
+        # Prints the bytes llama's gradient keeps on the tape between the
+        # augmented and the reverse kernel, to compare builds.
+        fn = enzyme_jax_ir(pipeline_options=OldXLAPipeline(), argv=argv)(self.fn)
+
+        def rev(*ins):
+            _, f_vjp = jax.vjp(fn, *ins)
+            return f_vjp(*self.douts)
+
+        jaxpr = jax.make_jaxpr(rev)(*self.ins)
+        (aug,) = [e for e in jaxpr.jaxpr.eqns if e.primitive.name == "enzyme_aug"]
+        (tape,) = aug.outvars[-1].aval.shape
+        print(self.name, ",", "Tape", ",", tape, sep="\t")
+        self.assertGreater(tape, 0)
+
+    def test_minimal_hlo(self):
+        # Once enzyme-hlo-opt has simplified the module, compare compiling it with
+        # XLA's full HLO pipeline against only the passes its CPU backend needs.
+        # Skipping XLA's HLO simplification passes must not change the results.
+        setup_backends()
+        if "cpu" not in self.AllBackends:
+            return
+        hloopt = (
+            "inline{default-pipeline=canonicalize max-iterations=4},"
+            + "canonicalize,cse,enzyme-hlo-opt,cse"
+        )
+        res = None
+        for pname, pipeline in [
+            ("HLOOptXLA", OldXLAPipeline(passes=hloopt)),
+            ("HLOOptMin", OldXLAPipeline(passes=hloopt, minimal_hlo=True)),
+        ]:
+            fn = jax.jit(enzyme_jax_ir(pipeline_options=pipeline, argv=argv)(self.fn))
+            start = timeit.default_timer()
+            compiled = fn.lower(*self.ins).compile()
+            elapsed = timeit.default_timer() - start
+            out = compiled(*self.ins)
+            if res is None:
+                res = out
+            else:
+                recursive_check(self, out, res, self.tol)
+            print(
+                self.name,
+                ",",
+                pname,
+                ",",
+                "cpu",
+                ",",
+                "Compile",
+                ",",
+                elapsed,
+                sep="\t",
+            )
+            # Skipping XLA's simplifications must not make the kernel slower.
+            print(
+                self.name,
+                ",",
+                pname,
+                ",",
+                "cpu",
+                ",",
+                "Primal",
+                ",",
+                timeit.Timer(
+                    lambda: jax.block_until_ready(compiled(*self.ins))
+                ).timeit(self.count)
+                / self.count,
+                sep="\t",
+            )
+
 
 if __name__ == "__main__":
     absltest.main()
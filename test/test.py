@@ -1,13 +1,50 @@
 from absl.testing import absltest
+import contextlib
 import jax
 import jax.numpy as jnp
-from enzyme_ad.jax import cpp_call, enzyme_jax_ir, optimize_module
+from enzyme_ad.jax import (
+    cpp_call,
+    enzyme_jax_ir,
+    kernel_group,
+    OldXLAPipeline,
+    optimize_module,
+    ShapeBuckets,
+)
 
 jax.config.update("jax_platform_name", "cpu")
 
 argv = ("-I/usr/include/c++/11", "-I/usr/include/x86_64-linux-gnu/c++/11")
 
 
+def elementwise_source(body, num_inputs=1):
+    # A C++ kernel setting out0[j] to body for every j of the one dimensional
+    # float inputs in0, in1, ...
+    inputs = "".join(
+        ",\n               const enzyme::tensor<float, N>& in%d" % i
+        for i in range(num_inputs)
+    )
+    return """
+        template<std::size_t N>
+        void f(enzyme::tensor<float, N>& out0%s) {
+          for (int j=0; j<N; j++) {
+            out0[j] = %s;
+          }
+        }
+        """ % (inputs, body)
+
+
+def elementwise(body, num_inputs=1, **kwargs):
+    # Calls the kernel of elementwise_source on arguments shaped like the first.
+    source = elementwise_source(body, num_inputs)
+
+    def call(*xs):
+        shape = jax.core.ShapedArray(xs[0].shape, xs[0].dtype)
+        (y,) = cpp_call(*xs, out_shapes=[shape], source=source, argv=argv, **kwargs)
+        return y
+
+    return call
+
+
 class EnzymePipeline(absltest.TestCase):
     def test_pipeline(self):
         def fn(x):
@@ -20,6 +57,124 @@ class EnzymePipeline(absltest.TestCase):
             # optimize_module(module)
             print(str(module))
 
+    def test_pass_pipeline_bytecode(self):
+        from enzyme_ad.jax import enzyme_call
+
+        source = """
+        func.func @main(%x : tensor<3xf32>) -> tensor<3xf32> {
+          return %x : tensor<3xf32>
+        }
+        """
+        name, text = enzyme_call.run_pass_pipeline([], source, "canonicalize")
+        self.assertIsInstance(text, str)
+        name, code = enzyme_call.run_pass_pipeline(
+            [], source, "canonicalize", bytecode=True
+        )
+        self.assertIsInstance(code, bytes)
+        self.assertTrue(code.startswith(b"ML\xefR"))
+
+    def test_instrumented_counters(self):
+        from enzyme_ad.jax import enzyme_call
+
+        source = """
+        func.func @main(%x : tensor<3xf32>) -> tensor<3xf32> {
+          %y = stablehlo.add %x, %x : tensor<3xf32>
+          return %y : tensor<3xf32>
+        }
+        """
+        # The counters must count in release builds too, where pass statistics
+        # are always 0.
+        _, _, report = enzyme_call.run_pass_pipeline(
+            [], source, "enzyme-hlo-opt", instrument=True
+        )
+        (record,) = [p for p in report["passes"] if p["pass"] == "enzyme-hlo-opt"]
+        self.assertGreater(record["statistics"]["iterations"], 0)
+        self.assertEqual(record["statistics"]["converged"], 1)
+
+    def test_many_function_module(self):
+        from enzyme_ad.jax import enzyme_call
+
+        # The patterns are built once in initialize(), not once per function,
+        # so the time per run should stay flat as the module grows.
+        num_funcs = 256
+        source = "\n".join(
+            """
+            func.func @f%d(%%x : tensor<3xf32>) -> tensor<3xf32> {
+              %%y = stablehlo.add %%x, %%x : tensor<3xf32>
+              return %%y : tensor<3xf32>
+            }
+            """
+            % i
+            for i in range(num_funcs)
+        )
+        # The fastest of a few runs, so numbers from different builds compare.
+        seconds = None
+        for _ in range(5):
+            _, _, report = enzyme_call.run_pass_pipeline(
+                [], source, "func.func(enzyme-hlo-opt)", instrument=True
+            )
+            (record,) = [
+                p for p in report["passes"] if p["pass"] == "enzyme-hlo-opt"
+            ]
+            self.assertEqual(record["runs"], num_funcs)
+            if seconds is None or record["seconds"] < seconds:
+                seconds = record["seconds"]
+        print(
+            "enzyme-hlo-opt",
+            num_funcs,
+            seconds,
+            seconds / num_funcs,
+            sep="\t",
+        )
+
+    def test_large_constants(self):
+        import struct
+        from enzyme_ad.jax import enzyme_call
+
+        # Constants of 64 KiB and more are read as resource blobs and folded
+        # in place, but the output must hold dense constants again for XLA.
+        n = 128
+        values = [float(i) for i in range(n * n)]
+        data = struct.pack("<%df" % len(values), *values).hex().upper()
+        source = """
+        func.func @main() -> tensor<%dx%dxf32> {
+          %%c = stablehlo.constant dense<"0x%s"> : tensor<%dx%dxf32>
+          %%t = stablehlo.transpose %%c, dims = [1, 0] : (tensor<%dx%dxf32>) -> tensor<%dx%dxf32>
+          return %%t : tensor<%dx%dxf32>
+        }
+        """ % ((n, n, data) + (n, n) * 4)
+        # The second run finds the blobs the first interned in the same context.
+        for _ in range(2):
+            _, text = enzyme_call.run_pass_pipeline([], source, "enzyme-hlo-opt")
+            self.assertNotIn("dense_resource", text)
+            self.assertNotIn("transpose", text)
+            self.assertIn("stablehlo.constant dense<", text)
+        ir = enzyme_call.compile_mhlo_to_llvm_with_xla(source, False, "")
+        self.assertIn("define", ir)
+
+    def test_minimal_hlo_pass_names(self):
+        from enzyme_ad.jax import enzyme_call
+
+        # minimal_hlo disables XLA passes by name, which does nothing for a name
+        # that the pinned XLA does not use.
+        self.assertEqual(enzyme_call.unknown_simplification_hlo_passes(), [])
+
+    def test_xla_pass_pipeline(self):
+        from enzyme_ad.jax import enzyme_call
+
+        source = """
+        func.func @main(%x : tensor<3xf32>) -> tensor<3xf32> {
+          %y = stablehlo.add %x, %x : tensor<3xf32>
+          return %y : tensor<3xf32>
+        }
+        """
+        # Without the XLA runtime, the pipeline runs on the StableHLO module
+        # before it is handed to XLA, so it must be valid.
+        ir = enzyme_call.compile_mhlo_to_llvm_with_xla(source, False, "canonicalize")
+        self.assertIn("define", ir)
+        with self.assertRaises(ValueError):
+            enzyme_call.compile_mhlo_to_llvm_with_xla(source, False, "no-such-pass")
+
 
 class EnzymeJax(absltest.TestCase):
     def test_custom_cpp_kernel(self):
@@ -96,6 +251,267 @@ class EnzymeJax(absltest.TestCase):
             ).all()
         )
 
+        # The cotangents of b and c are symbolic zeros.
+        grads = jax.grad(lambda x: do_something(x)[0].sum())(ones)
+        self.assertTrue((grads == 1).all())
+
+    def test_vmap_cpp_kernel(self):
+        square = elementwise("in0[j] * in0[j]")
+
+        xs = jnp.arange(12, dtype=jnp.float32).reshape(4, 3)
+
+        ys = jax.jit(jax.vmap(square))(xs)
+        self.assertTrue((ys == xs * xs).all())
+
+        ys = jax.jit(jax.vmap(square, in_axes=1))(xs.T)
+        self.assertTrue((ys == xs * xs).all())
+
+        grads = jax.jit(jax.vmap(jax.grad(lambda x: square(x).sum())))(xs)
+        self.assertTrue((grads == 2 * xs).all())
+
+        empty = jnp.zeros((0, 3), dtype=jnp.float32)
+        ys = jax.jit(jax.vmap(square))(empty)
+        self.assertEqual(ys.shape, (0, 3))
+        grads = jax.jit(jax.vmap(jax.grad(lambda x: square(x).sum())))(empty)
+        self.assertEqual(grads.shape, (0, 3))
+
+    def test_input_tape_size(self):
+        from enzyme_ad.jax import enzyme_call
+        from enzyme_ad.jax.primitives import cflags, resource_dir
+
+        def tape_size(body):
+            shapes = [("float", [1024])]
+            size, _ = enzyme_call.tape_and_tmp_size(
+                elementwise_source(body),
+                "f",
+                shapes,
+                shapes,
+                argv + ("-resource-dir", resource_dir()) + cflags(),
+                enzyme_call.Language.CPP,
+                False,
+                "",
+            )
+            return size
+
+        # The derivative of a square reads the input, which used to be copied
+        # to the tape, 4096 bytes here, while the one of a shift does not. Now
+        # that the reverse pass receives the input, both tapes are the same.
+        square, shift = tape_size("in0[j] * in0[j]"), tape_size("in0[j] + 1")
+        print("tape size", square, shift, sep="\t")
+        self.assertLess(square, 4096)
+        self.assertEqual(square, shift)
+
+    def test_partial_grad_cpp_kernel(self):
+        scale = elementwise("in0[j] * in1[j]", num_inputs=2)
+
+        x = jnp.array([1.0, 2.0, 3.0])
+        w = jnp.array([4.0, 5.0, 6.0])
+
+        # w has a symbolic zero tangent, so it is passed to Enzyme as const.
+        primal, tangent = jax.jvp(lambda x: scale(x, w), (x,), (jnp.ones(3),))
+        self.assertTrue((primal == x * w).all())
+        self.assertTrue((tangent == w).all())
+
+        grads = jax.jit(jax.grad(lambda x: scale(x, w).sum()))(x)
+        self.assertTrue((grads == w).all())
+
+    def test_unused_primal_is_dupnoneed(self):
+        from unittest import mock
+        from enzyme_ad.jax import enzyme_call
+        from enzyme_ad.jax.primitives import ACT_DUPNONEED
+
+        square = elementwise("in0[j] * in0[j]")
+
+        # Records the output activity of every kernel built while lowering.
+        out_activities = []
+        create = enzyme_call.create_enzyme_kernel
+
+        def create_and_record(*args, **kwargs):
+            out_activities.append(kwargs.get("out_activity", []))
+            return create(*args, **kwargs)
+
+        x = jnp.array([1.0, 2.0, 3.0])
+        with mock.patch.object(enzyme_call, "create_enzyme_kernel", create_and_record):
+            tangent = jax.jit(lambda x: jax.jvp(square, (x,), (jnp.ones(3),))[1])(x)
+        self.assertTrue((tangent == 2 * x).all())
+        # Only the tangent is used, so the primal output need not be computed.
+        self.assertIn([ACT_DUPNONEED], out_activities)
+
+    def test_kernel_group(self):
+        cube = elementwise("in0[j] * in0[j] * in0[j]")
+
+        def value_and_grad(x):
+            return jax.value_and_grad(lambda x: cube(x).sum())(x)
+
+        x = jnp.array([1.0, 2.0, 3.0])
+        with kernel_group():
+            compiled = jax.jit(value_and_grad).lower(x).compile()
+        value, grads = compiled(x)
+        self.assertEqual(value, 36.0)
+        self.assertTrue((grads == 3 * x * x).all())
+
+    def test_kernel_group_globals(self):
+        # Both kernels define the namespace-scope global calls, which must stay
+        # private to each of them once they are linked into one group.
+        source = """
+        int calls = 0;
+        template<std::size_t N>
+        void f(enzyme::tensor<float, N>& out0, const enzyme::tensor<float, N>& in0) {
+          calls++;
+          for (int j=0; j<N; j++) {
+            out0[j] = in0[j] + calls;
+          }
+        }
+        """
+
+        def call(x):
+            shape = jax.core.ShapedArray(x.shape, x.dtype)
+            (y,) = cpp_call(x, out_shapes=[shape], source=source, argv=argv)
+            return y
+
+        x = jnp.array([1.0, 2.0, 3.0])
+        y = jnp.array([1.0, 2.0])
+        with kernel_group():
+            compiled = jax.jit(lambda x, y: (call(x), call(y))).lower(x, y).compile()
+        a, b = compiled(x, y)
+        self.assertTrue((a == x + 1).all())
+        self.assertTrue((b == y + 1).all())
+
+    def test_bucketed_cpp_kernel(self):
+        from unittest import mock
+        from enzyme_ad.jax import enzyme_call
+
+        square = elementwise(
+            "in0[j] * in0[j]", bucketing=ShapeBuckets(rows_independent=True)
+        )
+
+        # Records the identifier of every kernel built while lowering.
+        identifiers = []
+        create = enzyme_call.create_enzyme_kernel
+
+        def create_and_record(*args, **kwargs):
+            identifier, tmpBuf = create(*args, **kwargs)
+            identifiers.append(identifier)
+            return identifier, tmpBuf
+
+        primal = {}
+        for n in (3, 5, 8):
+            xs = jnp.arange(n, dtype=jnp.float32)
+            del identifiers[:]
+            with mock.patch.object(
+                enzyme_call, "create_enzyme_kernel", create_and_record
+            ):
+                ys = jax.jit(square)(xs)
+            (primal[n],) = identifiers
+            self.assertEqual(ys.shape, (n,))
+            self.assertTrue((ys == xs * xs).all())
+
+            grads = jax.jit(jax.grad(lambda x: square(x).sum()))(xs)
+            self.assertTrue((grads == 2 * xs).all())
+
+        # 5 and 8 both round up to 8, so they share one compiled kernel.
+        self.assertEqual(primal[5], primal[8])
+        self.assertNotEqual(primal[3], primal[5])
+
+        with self.assertRaises(ValueError):
+            square(jnp.float32(2.0))
+
+    def test_bucketing_needs_independent_rows(self):
+        # Every output depends on the mean of all rows, which zero padding
+        # would change, so the kernel cannot be bucketed.
+        source = """
+        template<std::size_t N>
+        void f(enzyme::tensor<float, N>& out0,
+               const enzyme::tensor<float, N>& in0) {
+          float mean = 0;
+          for (int j=0; j<N; j++) {
+            mean += in0[j] / N;
+          }
+          for (int j=0; j<N; j++) {
+            out0[j] = in0[j] - mean;
+          }
+        }
+        """
+        xs = jnp.arange(5, dtype=jnp.float32)
+        shape = jax.core.ShapedArray(xs.shape, xs.dtype)
+
+        with self.assertRaises(ValueError):
+            cpp_call(
+                xs,
+                out_shapes=[shape],
+                source=source,
+                argv=argv,
+                bucketing=ShapeBuckets(),
+            )
+
+        (ys,) = cpp_call(xs, out_shapes=[shape], source=source, argv=argv)
+        self.assertTrue(jnp.allclose(ys, xs - xs.mean()))
+
+    def test_hlo_profile_grad(self):
+        import os
+        from unittest import mock
+        from enzyme_ad.jax import enzyme_call
+
+        # The kernel is compiled by XLA with its cycle counters, which Enzyme
+        # must treat as inactive for the gradient to stay correct.
+        with mock.patch.dict(os.environ, {"ENZYME_HLO_PROFILE": "1"}):
+
+            @enzyme_jax_ir(pipeline_options=OldXLAPipeline(), argv=argv)
+            def cube(x):
+                return x * x * x
+
+            x = jnp.array([1.0, 2.0, 3.0])
+            grads = jax.jit(jax.grad(lambda x: cube(x).sum()))(x)
+            self.assertTrue(jnp.allclose(grads, 3 * x * x))
+
+            # Batched examples update the same counters, so they must not race.
+            xs = jnp.arange(12, dtype=jnp.float32).reshape(4, 3)
+            grads = jax.jit(jax.vmap(jax.grad(lambda x: cube(x).sum())))(xs)
+            self.assertTrue(jnp.allclose(grads, 3 * xs * xs))
+
+        profiles = enzyme_call.get_hlo_profile()
+        self.assertTrue(
+            any(c > 0 for cycles in profiles.values() for c in cycles.values())
+        )
+
+    def test_lowered_module_round_trip(self):
+        from unittest import mock
+        from enzyme_ad.jax import enzyme_call
+
+        # Lowered modules reach create_enzyme_kernel as bytecode when jaxlib's
+        # StableHLO matches the extension's, and as text otherwise. Both must
+        # parse and give the same kernel.
+        sources = []
+        create = enzyme_call.create_enzyme_kernel
+
+        def create_and_record(source, *args, **kwargs):
+            sources.append(source)
+            return create(source, *args, **kwargs)
+
+        x = jnp.array([1.0, 2.0, 3.0])
+        bytecode_version, _ = enzyme_call.mlir_versions()
+        for versions in [None, (bytecode_version, "0.0.0")]:
+
+            @enzyme_jax_ir(pipeline_options=OldXLAPipeline(), argv=argv)
+            def cube(x):
+                return x * x * x
+
+            with contextlib.ExitStack() as stack:
+                stack.enter_context(
+                    mock.patch.object(
+                        enzyme_call, "create_enzyme_kernel", create_and_record
+                    )
+                )
+                if versions is not None:
+                    stack.enter_context(
+                        mock.patch.object(
+                            enzyme_call, "mlir_versions", return_value=versions
+                        )
+                    )
+                y = jax.jit(cube)(x)
+            self.assertTrue(jnp.allclose(y, x * x * x))
+        self.assertTrue(any(isinstance(s, str) for s in sources))
+
     def test_enzyme_mlir_jit(self):
         @jax.jit
         @enzyme_jax_ir(argv=argv)